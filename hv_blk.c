@@ -0,0 +1,385 @@
+/*
+ *
+ *  blk-mq block device over the MMLS region.
+ *
+ *  With hv_blk=1 a block device /dev/hvmmlsN is registered next to the
+ *  char device and serves the same memory, so a filesystem or O_DIRECT
+ *  files can live on it. There is one hardware queue per CPU and no
+ *  device-wide lock on the data path: a request is copied straight
+ *  between its bio pages and the region, and only the cmd driver's
+ *  mmls_read_command()/mmls_write_command() calls are serialized, by
+ *  backend_lock inside the backend helpers.
+ *
+ *  hv_blk_poll_queues extra queues take REQ_POLLED I/O. Requests on
+ *  them are copied at submit time but completed from ->poll(), so
+ *  io_uring with IORING_SETUP_IOPOLL never waits for an interrupt.
+ *
+ *  Bypasses cmutex and so also the char device's readahead, extents,
+ *  compression, checksums and snapshots; it is not registered when
+ *  extents, compression or checksums are on, and snapshots are refused
+ *  while it exists.
+ *
+ *  Needs blk-mq polling as of Linux 5.17.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cmd.h"
+#include <linux/slab.h>
+
+static bool hv_blk;
+module_param(hv_blk, bool, S_IRUGO);
+MODULE_PARM_DESC(hv_blk, "Also register a blk-mq block device /dev/hvmmlsN (default 0)");
+
+static unsigned int hv_blk_poll_queues = 1;
+module_param(hv_blk_poll_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(hv_blk_poll_queues, "Hardware queues for polled (REQ_POLLED) I/O");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+
+#define HV_BLK_NAME	"hvmmls"
+
+struct hv_blk {
+	hv_cdev_private *priv;
+	struct blk_mq_tag_set tag_set;
+	struct gendisk *disk;
+	unsigned int poll_queues;
+};
+
+/* Per hardware queue: polled requests waiting for ->poll() */
+struct hv_blk_queue {
+	spinlock_t lock;
+	struct list_head done;
+};
+
+/* Per request */
+struct hv_blk_cmd {
+	struct list_head list;
+	blk_status_t status;
+};
+
+static int hv_blk_major;
+static int hv_blk_count;		/* disks using hv_blk_major */
+
+static void hv_blk_put_disk(struct gendisk *disk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	put_disk(disk);
+#else
+	blk_cleanup_disk(disk);
+#endif
+}
+
+static blk_status_t hv_blk_rw(hv_cdev_private *priv, struct request *rq)
+{
+	u64 pos = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+	u64 len = blk_rq_bytes(rq);
+	bool write = req_op(rq) == REQ_OP_WRITE;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	void *buf;
+	u64 off = pos;
+
+	if (pos >= priv->dev_size || len > priv->dev_size - pos)
+		return BLK_STS_IOERR;
+
+	hv_scrub_wait(priv, pos, len);
+
+	if (!write)
+		hv_cdev_backend_read(priv, pos, len);
+
+	rq_for_each_segment(bvec, rq, iter) {
+		buf = bvec_kmap_local(&bvec);
+		if (write)
+			hv_cdev_memcpy_nt(hv_cdev_vaddr(priv, off), buf,
+					bvec.bv_len);
+		else
+			memcpy(buf, hv_cdev_vaddr(priv, off), bvec.bv_len);
+		kunmap_local(buf);
+		off += bvec.bv_len;
+	}
+
+	if (write) {
+		wmb();
+		hv_cdev_backend_write(priv, pos, len);
+	}
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t hv_blk_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	struct hv_blk_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct hv_blk_queue *q = hctx->driver_data;
+	hv_cdev_private *priv = hctx->queue->queuedata;
+
+	blk_mq_start_request(rq);
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		cmd->status = hv_blk_rw(priv, rq);
+		break;
+	case REQ_OP_FLUSH:
+		/* Writes bypass the CPU cache; just order them */
+		wmb();
+		cmd->status = BLK_STS_OK;
+		break;
+	default:
+		cmd->status = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	if (hctx->type == HCTX_TYPE_POLL) {
+		spin_lock(&q->lock);
+		list_add_tail(&cmd->list, &q->done);
+		spin_unlock(&q->lock);
+		return BLK_STS_OK;
+	}
+
+	blk_mq_end_request(rq, cmd->status);
+
+	return BLK_STS_OK;
+}
+
+static int hv_blk_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct hv_blk_queue *q = hctx->driver_data;
+	struct hv_blk_cmd *cmd, *tmp;
+	LIST_HEAD(list);
+	int n = 0;
+
+	spin_lock(&q->lock);
+	list_splice_init(&q->done, &list);
+	spin_unlock(&q->lock);
+
+	list_for_each_entry_safe(cmd, tmp, &list, list) {
+		list_del(&cmd->list);
+		blk_mq_end_request(blk_mq_rq_from_pdu(cmd), cmd->status);
+		n++;
+	}
+
+	return n;
+}
+
+static int hv_blk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+		unsigned int idx)
+{
+	struct hv_blk_queue *q;
+
+	q = kzalloc_node(sizeof(*q), GFP_KERNEL, hctx->numa_node);
+	if (!q)
+		return -ENOMEM;
+
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->done);
+	hctx->driver_data = q;
+
+	return 0;
+}
+
+static void hv_blk_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int idx)
+{
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
+}
+
+/* One default queue per CPU, then the poll queues */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static void hv_blk_map_queues(struct blk_mq_tag_set *set)
+#else
+static int hv_blk_map_queues(struct blk_mq_tag_set *set)
+#endif
+{
+	struct hv_blk *blk = set->driver_data;
+	unsigned int i, offset = 0;
+
+	set->map[HCTX_TYPE_DEFAULT].nr_queues =
+		set->nr_hw_queues - blk->poll_queues;
+	set->map[HCTX_TYPE_READ].nr_queues = 0;
+	set->map[HCTX_TYPE_POLL].nr_queues = blk->poll_queues;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		set->map[i].queue_offset = offset;
+		offset += set->map[i].nr_queues;
+		if (set->map[i].nr_queues)
+			blk_mq_map_queues(&set->map[i]);
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+	return 0;
+#endif
+}
+
+static const struct blk_mq_ops hv_blk_mq_ops = {
+	.queue_rq	= hv_blk_queue_rq,
+	.poll		= hv_blk_poll,
+	.init_hctx	= hv_blk_init_hctx,
+	.exit_hctx	= hv_blk_exit_hctx,
+	.map_queues	= hv_blk_map_queues,
+};
+
+static const struct block_device_operations hv_blk_fops = {
+	.owner		= THIS_MODULE,
+};
+
+int hv_blk_init(hv_cdev_private *priv, int index)
+{
+	struct blk_mq_tag_set *set;
+	struct hv_blk *blk;
+	struct gendisk *disk;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	struct queue_limits lim = {
+		.logical_block_size	= SECTOR_SIZE,
+		.physical_block_size	= PAGE_SIZE,
+		.max_hw_sectors		= UINT_MAX >> SECTOR_SHIFT,
+	};
+#endif
+	int res;
+
+	if (!hv_blk)
+		return 0;
+
+	/* Both remap or restrict raw offsets that blk I/O would bypass */
+	if (priv->comp || priv->arena) {
+		PERR("%s: not available with compression or extents\n",
+			__func__);
+		return 0;
+	}
+
+	/*
+	 * Block I/O runs without cmutex, so it cannot keep the per-block
+	 * checksums consistent with concurrent writes
+	 */
+	if (priv->csum) {
+		PERR("%s: not available with checksums\n", __func__);
+		return 0;
+	}
+
+	if (!hv_blk_major) {
+		res = register_blkdev(0, HV_BLK_NAME);
+		if (res < 0)
+			return res;
+		hv_blk_major = res;
+	}
+
+	blk = kzalloc(sizeof(*blk), GFP_KERNEL);
+	if (!blk)
+		return -ENOMEM;
+
+	blk->priv = priv;
+	blk->poll_queues = min(hv_blk_poll_queues, num_online_cpus());
+
+	set = &blk->tag_set;
+	set->ops = &hv_blk_mq_ops;
+	set->nr_hw_queues = num_online_cpus() + blk->poll_queues;
+	set->nr_maps = blk->poll_queues ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = 128;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct hv_blk_cmd);
+	/* The cmd driver may sleep in mmls_*_command() */
+	set->flags = BLK_MQ_F_BLOCKING;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+	set->flags |= BLK_MQ_F_SHOULD_MERGE;
+#endif
+	set->driver_data = blk;
+
+	res = blk_mq_alloc_tag_set(set);
+	if (res)
+		goto out_free;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	disk = blk_mq_alloc_disk(set, &lim, priv);
+#else
+	disk = blk_mq_alloc_disk(set, priv);
+#endif
+	if (IS_ERR(disk)) {
+		res = PTR_ERR(disk);
+		goto out_tag_set;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+	blk_queue_logical_block_size(disk->queue, SECTOR_SIZE);
+	blk_queue_physical_block_size(disk->queue, PAGE_SIZE);
+	blk_queue_max_hw_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+#endif
+
+	disk->major = hv_blk_major;
+	disk->first_minor = index;
+	disk->minors = 1;
+	disk->fops = &hv_blk_fops;
+	disk->private_data = blk;
+	snprintf(disk->disk_name, DISK_NAME_LEN, HV_BLK_NAME "%d", index);
+	set_capacity(disk, priv->dev_size >> SECTOR_SHIFT);
+
+	res = add_disk(disk);
+	if (res)
+		goto out_disk;
+
+	blk->disk = disk;
+	priv->blk = blk;
+	hv_blk_count++;
+
+	PINFO("%s: /dev/%s, %u CPU queues, %u poll queues\n", __func__,
+		disk->disk_name, num_online_cpus(), blk->poll_queues);
+
+	return 0;
+
+out_disk:
+	hv_blk_put_disk(disk);
+out_tag_set:
+	blk_mq_free_tag_set(set);
+out_free:
+	kfree(blk);
+	return res;
+}
+
+void hv_blk_exit(hv_cdev_private *priv)
+{
+	struct hv_blk *blk = priv->blk;
+
+	if (blk) {
+		del_gendisk(blk->disk);
+		hv_blk_put_disk(blk->disk);
+		blk_mq_free_tag_set(&blk->tag_set);
+		kfree(blk);
+		priv->blk = NULL;
+		hv_blk_count--;
+	}
+
+	if (hv_blk_major && !hv_blk_count) {
+		unregister_blkdev(hv_blk_major, HV_BLK_NAME);
+		hv_blk_major = 0;
+	}
+}
+
+#else
+
+int hv_blk_init(hv_cdev_private *priv, int index)
+{
+	if (hv_blk)
+		PERR("%s: needs Linux 5.17 or later\n", __func__);
+
+	return 0;
+}
+
+void hv_blk_exit(hv_cdev_private *priv)
+{
+}
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ *
+ *  Buddy allocator for device extents.
+ *
+ *  state[] holds, for every unit, either HV_BUDDY_NONE (unit is inside
+ *  a block) or the order of the block starting there, with
+ *  HV_BUDDY_FREE set while the block sits on a free list. Free lists
+ *  are doubly linked through next[]/prev[] by unit index, so a buddy
+ *  can be unlinked in O(1) when blocks coalesce.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include "hv_buddy.h"
+
+#define HV_BUDDY_NONE		0xff
+#define HV_BUDDY_FREE		0x80
+#define HV_BUDDY_ORDER_MASK	0x3f
+#define HV_BUDDY_NIL		((u32)~0U)
+
+static void hv_buddy_push(struct hv_buddy *b, u32 unit, unsigned int order)
+{
+	u32 first = b->head[order];
+
+	b->state[unit] = HV_BUDDY_FREE | order;
+	b->prev[unit] = HV_BUDDY_NIL;
+	b->next[unit] = first;
+	if (first != HV_BUDDY_NIL)
+		b->prev[first] = unit;
+	b->head[order] = unit;
+}
+
+static void hv_buddy_unlink(struct hv_buddy *b, u32 unit, unsigned int order)
+{
+	if (b->prev[unit] != HV_BUDDY_NIL)
+		b->next[b->prev[unit]] = b->next[unit];
+	else
+		b->head[order] = b->next[unit];
+
+	if (b->next[unit] != HV_BUDDY_NIL)
+		b->prev[b->next[unit]] = b->prev[unit];
+
+	b->state[unit] = HV_BUDDY_NONE;
+}
+
+int hv_buddy_init(struct hv_buddy *b, u64 size, unsigned int unit_shift)
+{
+	u64 nunits = size >> unit_shift;
+	unsigned int order;
+	u32 unit;
+
+	if (!nunits || nunits >= HV_BUDDY_NIL)
+		return -EINVAL;
+
+	b->unit_shift = unit_shift;
+	b->nunits = nunits;
+	b->max_order = min_t(unsigned int, ilog2(nunits), HV_BUDDY_MAX_ORDER);
+
+	b->state = vmalloc(nunits);
+	b->next = vmalloc(nunits * sizeof(u32));
+	b->prev = vmalloc(nunits * sizeof(u32));
+	if (!b->state || !b->next || !b->prev) {
+		hv_buddy_destroy(b);
+		return -ENOMEM;
+	}
+
+	memset(b->state, HV_BUDDY_NONE, nunits);
+	for (order = 0; order <= HV_BUDDY_MAX_ORDER; order++)
+		b->head[order] = HV_BUDDY_NIL;
+
+	/* Carve the range into the largest aligned blocks that fit */
+	for (unit = 0; unit < b->nunits; unit += 1U << order) {
+		order = unit ? min_t(unsigned int, __ffs(unit), b->max_order) :
+			b->max_order;
+		while (unit + (1ULL << order) > b->nunits)
+			order--;
+		hv_buddy_push(b, unit, order);
+	}
+
+	b->free_units = b->nunits;
+
+	return 0;
+}
+
+void hv_buddy_destroy(struct hv_buddy *b)
+{
+	vfree(b->state);
+	vfree(b->next);
+	vfree(b->prev);
+	b->state = NULL;
+	b->next = NULL;
+	b->prev = NULL;
+}
+
+/*
+ * Allocate at least size bytes aligned to align bytes (power of two,
+ * 0 = unit). The block is rounded up to a power-of-two number of
+ * units; its offset and real size are returned.
+ */
+int hv_buddy_alloc(struct hv_buddy *b, u64 size, u64 align,
+		u64 *off, u64 *alloc_size)
+{
+	u64 units = DIV_ROUND_UP(size, 1ULL << b->unit_shift);
+	u64 align_units = align >> b->unit_shift;
+	unsigned int order, j;
+	u32 unit;
+
+	if (!size || (align & (align - 1)))
+		return -EINVAL;
+
+	units = max(units, align_units);
+	order = order_base_2(units);
+	if (order > b->max_order)
+		return -ENOMEM;
+
+	for (j = order; j <= b->max_order; j++)
+		if (b->head[j] != HV_BUDDY_NIL)
+			break;
+
+	if (j > b->max_order)
+		return -ENOMEM;
+
+	unit = b->head[j];
+	hv_buddy_unlink(b, unit, j);
+
+	/* Split, returning upper halves to the free lists */
+	while (j > order) {
+		j--;
+		hv_buddy_push(b, unit + (1U << j), j);
+	}
+
+	b->state[unit] = order;
+	b->free_units -= 1U << order;
+
+	*off = (u64)unit << b->unit_shift;
+	*alloc_size = 1ULL << (order + b->unit_shift);
+
+	return 0;
+}
+
+int hv_buddy_free(struct hv_buddy *b, u64 off)
+{
+	u32 unit = off >> b->unit_shift;
+	unsigned int order;
+	u32 buddy;
+
+	if (off & ((1ULL << b->unit_shift) - 1) || unit >= b->nunits)
+		return -EINVAL;
+
+	/* Must be the head of an allocated block */
+	if (b->state[unit] & HV_BUDDY_FREE)
+		return -EINVAL;
+
+	order = b->state[unit] & HV_BUDDY_ORDER_MASK;
+	b->free_units += 1U << order;
+
+	while (order < b->max_order) {
+		buddy = unit ^ (1U << order);
+		if (buddy >= b->nunits ||
+		    b->state[buddy] != (HV_BUDDY_FREE | order))
+			break;
+
+		hv_buddy_unlink(b, buddy, order);
+		b->state[unit] = HV_BUDDY_NONE;
+		unit = min(unit, buddy);
+		order++;
+	}
+
+	hv_buddy_push(b, unit, order);
+
+	return 0;
+}
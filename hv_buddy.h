@@ -0,0 +1,44 @@
+/*
+ *
+ *  Buddy allocator for device extents.
+ *
+ *  Manages offsets only; it never touches the memory it hands out.
+ *  Blocks of order k are 2^k units long and aligned to 2^k units, so
+ *  alloc and free are O(log n). Not locked, callers serialize.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef _HV_BUDDY_H_
+#define _HV_BUDDY_H_
+
+#include <linux/types.h>
+
+#define HV_BUDDY_MAX_ORDER	31
+
+struct hv_buddy {
+	unsigned int unit_shift;	/* log2 bytes of one unit */
+	unsigned int max_order;
+	u32 nunits;
+	u32 free_units;
+	u8 *state;			/* per unit, see hv_buddy.c */
+	u32 *next;			/* free list links, per unit */
+	u32 *prev;
+	u32 head[HV_BUDDY_MAX_ORDER + 1];
+};
+
+int hv_buddy_init(struct hv_buddy *b, u64 size, unsigned int unit_shift);
+void hv_buddy_destroy(struct hv_buddy *b);
+int hv_buddy_alloc(struct hv_buddy *b, u64 size, u64 align,
+		u64 *off, u64 *alloc_size);
+int hv_buddy_free(struct hv_buddy *b, u64 off);
+
+#endif
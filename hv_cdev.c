@@ -33,7 +33,6 @@
 
 #define HV_CDEV_N_MINORS		1
 #define HV_CDEV_FIRST_MINOR		0
-#define HV_CDEV_BUFF_SIZE		(4096 * 8)
 #define HV_CDEV_CLASS_NAME		"hv_cdev_class"
 #define HV_CDEV_DEVICE_FILENAME	"hv_cdev"
 
@@ -45,37 +44,157 @@ int hv_cdev_major;
 
 /* 1 = if cmd drv reports no hv hw or ramdisk	*/
 /* driver will use privatedata.buff[] as buffer	*/
-static int use_static_buff;
+int use_static_buff;
 
 dev_t hv_cdev_device_num;	/* contains major and minor #. For temp var */
 
 static struct HV_MMLS_IO_t mmls_io_data;
 
-typedef struct privatedata {
-	int nminor;
-	char buff[HV_CDEV_BUFF_SIZE];
-	struct cdev cdev;
-	struct fasync_struct *fasync;
-	struct class *hv_cdev_class;
-	struct mutex cmutex;
-	struct device *hv_cdev_device;
-	u64 dev_size;			/* bytes */
-					/* phys_addr_t is word size of any arch */
-	phys_addr_t phys_start;		/* physical address of mmls (mmls_start) */
-	void __iomem *mmls_iomem;	/* kernel virtual address ptr of iomem   */
-	unsigned long pfn;		/* page frame number of physical mem */
-	unsigned long mmls_nsectors;	/* num of sectors */
-} hv_cdev_private;
-
 hv_cdev_private devices[HV_CDEV_N_MINORS];
 
 extern int get_use_mmls_cdev(void);
 
+/*
+ * Backend helpers
+ *
+ * Ask the cmd driver to bring a byte range of the device in (read) or
+ * to push it out (write). The range is widened to whole sectors.
+ * backend_lock serializes the commands, as the block device issues
+ * them without cmutex.
+ */
+void hv_cdev_backend_read(hv_cdev_private *priv, u64 off, u64 len)
+{
+	u64 first = off >> HV_CDEV_SECTOR_SHIFT;
+	u64 last = DIV_ROUND_UP(off + len, HV_CDEV_SECTOR_SIZE);
+
+	if (use_static_buff || !len)
+		return;
+
+	mutex_lock(&priv->backend_lock);
+	mmls_read_command(1, last - first, first, (unsigned long)priv->mmls_iomem, 0, NULL);
+	mutex_unlock(&priv->backend_lock);
+}
+
+void hv_cdev_backend_write(hv_cdev_private *priv, u64 off, u64 len)
+{
+	u64 first = off >> HV_CDEV_SECTOR_SHIFT;
+	u64 last = DIV_ROUND_UP(off + len, HV_CDEV_SECTOR_SIZE);
+
+	if (use_static_buff || !len)
+		return;
+
+	mutex_lock(&priv->backend_lock);
+	mmls_write_command(1, last - first, first, (unsigned long)priv->mmls_iomem, 0, NULL);
+	mutex_unlock(&priv->backend_lock);
+}
+
+/* Strict bounds check for device-side ops; no trimming */
+int hv_cdev_check_range(hv_cdev_file *hfile, u64 off, u64 size)
+{
+	hv_cdev_private *priv = hfile->priv;
+	int res;
+
+	/* Ops work on raw device offsets, which compression remaps */
+	if (priv->comp)
+		return -EOPNOTSUPP;
+
+	if (off >= priv->dev_size || size > priv->dev_size - off)
+		return -EINVAL;
+
+	res = hv_arena_check(hfile, off, size);
+	if (res)
+		return res;
+
+	hv_scrub_wait(priv, off, size);
+
+	return 0;
+}
+
+/*
+ * As hv_cdev_check_range(), and holds the arena extent until
+ * hv_cdev_put_range(), so HV_MMLS_FREE cannot hand it to another file
+ * while the op still works on it
+ */
+int hv_cdev_get_range(hv_cdev_file *hfile, u64 off, u64 size)
+{
+	hv_cdev_private *priv = hfile->priv;
+	int res;
+
+	if (priv->comp)
+		return -EOPNOTSUPP;
+
+	if (off >= priv->dev_size || size > priv->dev_size - off)
+		return -EINVAL;
+
+	res = hv_arena_get(hfile, off, size);
+	if (res)
+		return res;
+
+	hv_scrub_wait(priv, off, size);
+
+	return 0;
+}
+
+void hv_cdev_put_range(hv_cdev_file *hfile, u64 off, u64 size)
+{
+	hv_arena_put(hfile, off, size);
+}
+
+/* Both ranges of a two-range op, or neither */
+static int hv_cdev_get_range2(hv_cdev_file *hfile, u64 off1, u64 off2,
+		u64 size)
+{
+	int res;
+
+	res = hv_cdev_get_range(hfile, off1, size);
+	if (res)
+		return res;
+
+	res = hv_cdev_get_range(hfile, off2, size);
+	if (res)
+		hv_cdev_put_range(hfile, off1, size);
+
+	return res;
+}
+
+static void hv_cdev_put_range2(hv_cdev_file *hfile, u64 off1, u64 off2,
+		u64 size)
+{
+	hv_cdev_put_range(hfile, off2, size);
+	hv_cdev_put_range(hfile, off1, size);
+}
+
+/* Write back the CPU cache over a range. Called with cmutex held. */
+void hv_cdev_flush(hv_cdev_private *priv, u64 off, u64 size)
+{
+	if (use_static_buff) {
+		/*  parm: virtual start address, size */
+		clflush_cache_range(priv->buff + off, size);
+	} else if (priv->comp) {
+		/* Compressed chunks are written through as they are stored */
+		return;
+	} else {
+		clflush_cache_range(priv->mmls_iomem + off, size);
+	}
+}
+
 static int hv_cdev_open(struct inode *inode, struct file *filp)
 {
 	hv_cdev_private *priv = container_of(inode->i_cdev, hv_cdev_private, cdev);
+	hv_cdev_file *hfile;
+
+	hfile = kzalloc(sizeof(*hfile), GFP_KERNEL);
+	if (!hfile)
+		return -ENOMEM;
+
+	hfile->priv = priv;
+	hv_ra_init(hfile);
+	hv_arena_open(hfile);
+	hv_event_open(hfile);
+	hv_qos_open(hfile);
+	hv_heat_open(priv, filp);
 
-	filp->private_data = priv;
+	filp->private_data = hfile;
 
 	PINFO("%s:\n", __func__);
 	PDEBUG("%s: iminor = %d\n", __func__, iminor(inode));
@@ -86,30 +205,43 @@ static int hv_cdev_open(struct inode *inode, struct file *filp)
 
 static int hv_cdev_release(struct inode *inode, struct file *filp)
 {
-	hv_cdev_private *priv;
+	hv_cdev_file *hfile = filp->private_data;
 
-	priv = filp->private_data;
+	/* Stop readahead still queued on this file */
+	hv_ra_release(hfile);
 
-	/* flush data */
-	priv = 0;
+	/* Wait for async ops and drop eventfd/fasync */
+	hv_event_release(filp);
+
+	/* Extents die with the file that allocated them */
+	hv_arena_release(hfile);
+
+	hv_qos_release(hfile);
+
+	kfree(hfile);
+	filp->private_data = NULL;
 
 	PINFO("%s:\n", __func__);
 
 	return 0;
 }
 
-static ssize_t hv_cdev_read(struct file *filp,
+static ssize_t hv_cdev_read_slice(struct file *filp,
 	char __user *ubuff, size_t count, loff_t *f_pos)
 {
-	int n = 0;
-	hv_cdev_private *priv;
-
-	priv = filp->private_data;
+	ssize_t n = 0;
+	ssize_t done = 0;
+	u64 off;
+	hv_cdev_file *hfile = filp->private_data;
+	hv_cdev_private *priv = hfile->priv;
 
 	PINFO("%s:\n", __func__);
 	PDEBUG("ubuf=%p, count=%zu, f_pos=%lld, priv->dev_size=%llu\n",
 				ubuff, count, *f_pos, priv->dev_size);
 
+	/* Let an in-flight prefetch of this range land first */
+	hv_ra_wait(hfile, *f_pos, count);
+
 	if (mutex_lock_interruptible(&priv->cmutex)) {
 		PERR("%s: Failed to acquire cmutex\n", __func__);
 		return -ERESTARTSYS;
@@ -125,35 +257,78 @@ static ssize_t hv_cdev_read(struct file *filp,
 	if ((*f_pos + count) > priv->dev_size)
 		count = priv->dev_size - *f_pos;
 
+	/* Held so HV_MMLS_FREE cannot pass it on while we copy */
+	n = hv_arena_get(hfile, *f_pos, count);
+	if (n)
+		goto out;
+	off = *f_pos;
+
+	hv_heat_io(priv, *f_pos, count);
+	hv_scrub_wait(priv, *f_pos, count);
+
 	if (use_static_buff) {
 		if (copy_to_user(ubuff, priv->buff + *f_pos, count)) {
 			n = -EFAULT;
 			PERR("Error: Copy_to_user failed\n");
-			goto out;
+			goto put;
+		}
+	} else if (priv->comp) {
+		n = hv_comp_read(priv, ubuff, *f_pos, count);
+		if (n) {
+			PERR("Error: compressed read failed\n");
+			goto put;
 		}
 	} else {
-		mmls_read_command(1, count/512, (*f_pos)/512, (unsigned long)priv->mmls_iomem, 0, NULL);
-		if (copy_to_user(ubuff, priv->mmls_iomem + *f_pos, count)) {
+		/* Fetch from backend unless readahead already did */
+		hv_ra_read(hfile, *f_pos, count);
+
+		/* Large reads are copied by several CPUs */
+		if (hv_par_want(count)) {
+			done = hv_par_copy_user(priv, *f_pos,
+					(unsigned long)ubuff, count, true);
+			if (done < 0) {
+				n = done;
+				PERR("Error: parallel copy failed\n");
+				goto put;
+			}
+		}
+
+		if (priv->csum) {
+			/* Verify each block as it is copied */
+			n = hv_csum_copy_to_user(priv, ubuff + done,
+					*f_pos + done, count - done);
+			if (n) {
+				PERR("Error: checksummed copy failed\n");
+				goto put;
+			}
+		} else if (copy_to_user(ubuff + done,
+					priv->mmls_iomem + *f_pos + done,
+					count - done)) {
 			n = -EFAULT;
 			PERR("Error: Copy_to_user failed\n");
-			goto out;
+			goto put;
 		}
 	}
 
 	*f_pos += count;
 	n = count;
 
+put:
+	hv_arena_put(hfile, off, count);
 out:
 	mutex_unlock(&priv->cmutex);
 
 	return n;
 }
 
-static ssize_t hv_cdev_write(struct file *filp,
+static ssize_t hv_cdev_write_slice(struct file *filp,
 	const char __user *ubuff, size_t count, loff_t *f_pos)
 {
-	int n = 0;
-	hv_cdev_private *priv = filp->private_data;
+	ssize_t n = 0;
+	ssize_t done = 0;
+	u64 off;
+	hv_cdev_file *hfile = filp->private_data;
+	hv_cdev_private *priv = hfile->priv;
 
 	PINFO("%s:\n", __func__);
 
@@ -175,41 +350,152 @@ static ssize_t hv_cdev_write(struct file *filp,
 	if ((*f_pos + count) > priv->dev_size)
 		count = priv->dev_size - *f_pos;
 
+	/* Held so HV_MMLS_FREE cannot pass it on while we copy */
+	n = hv_arena_get(hfile, *f_pos, count);
+	if (n)
+		goto out;
+	off = *f_pos;
+
+	hv_scrub_wait(priv, *f_pos, count);
+
+	/* Save what an open snapshot still needs */
+	hv_snap_write(priv, *f_pos, count);
+	hv_heat_io(priv, *f_pos, count);
+
 	/* Copy from user buffer to kernel buff */
 	if (use_static_buff) {
 		if (__copy_from_user_nocache(priv->buff + *f_pos, ubuff, count)) {
 			n = -EFAULT;
 			PERR("Error: Copy_from_user failed\n");
-			goto out;
+			goto put;
+		}
+	} else if (priv->comp) {
+		/* Stores and writes back each chunk itself */
+		n = hv_comp_write(priv, *f_pos, ubuff, count);
+		if (n) {
+			PERR("Error: compressed write failed\n");
+			goto put;
 		}
 	} else {
-		if (__copy_from_user_nocache(priv->mmls_iomem + *f_pos, ubuff, count)) {
+		/* Large writes are copied by several CPUs */
+		if (hv_par_want(count)) {
+			done = hv_par_copy_user(priv, *f_pos,
+					(unsigned long)ubuff, count, false);
+			if (done < 0) {
+				n = done;
+				PERR("Error: parallel copy failed\n");
+				goto put;
+			}
+		}
+
+		if (priv->csum) {
+			/* Checksum each block as it is copied */
+			n = hv_csum_copy_from_user(priv, *f_pos + done,
+					ubuff + done, count - done);
+			if (n) {
+				PERR("Error: checksummed copy failed\n");
+				goto put;
+			}
+		} else if (__copy_from_user_nocache(
+					priv->mmls_iomem + *f_pos + done,
+					ubuff + done, count - done)) {
 			n = -EFAULT;
 			PERR("Error: Copy_from_user failed\n");
-			goto out;
+			goto put;
 		}
-		mmls_write_command(1, count/512, (*f_pos)/512, (unsigned long)priv->mmls_iomem, 0, NULL);
+		hv_cdev_backend_write(priv, *f_pos, count);
 	}
 
 	*f_pos += count;
 	n = count;
 
+put:
+	hv_arena_put(hfile, off, count);
 out:
 	mutex_unlock(&priv->cmutex);
 
 	return n;
 }
 
+/*
+ * read() and write() run in slices sized by the file's QoS class;
+ * cmutex is taken per slice so latency-class I/O can get in between.
+ * Without a latency-class file open there is one slice.
+ */
+static ssize_t hv_cdev_read(struct file *filp,
+	char __user *ubuff, size_t count, loff_t *f_pos)
+{
+	hv_cdev_file *hfile = filp->private_data;
+	u64 t0 = hv_trace_clock(hfile->priv);
+	loff_t pos = *f_pos;
+	ssize_t done = 0;
+	ssize_t slice, n;
+	bool lat;
+
+	do {
+		slice = hv_qos_begin(hfile, count - done, !done, &lat);
+		if (slice < 0) {
+			n = slice;
+			break;
+		}
+
+		n = hv_cdev_read_slice(filp, ubuff + done, slice, f_pos);
+		hv_qos_end(hfile, n, lat);
+		if (n < 0)
+			break;
+
+		done += n;
+	} while (n == slice && done < count);
+
+	if (done || n >= 0)
+		n = done;
+	hv_trace_rec(hfile->priv, HV_MMLS_TRACE_READ, pos, count, 0, n, t0);
+
+	return n;
+}
+
+static ssize_t hv_cdev_write(struct file *filp,
+	const char __user *ubuff, size_t count, loff_t *f_pos)
+{
+	hv_cdev_file *hfile = filp->private_data;
+	u64 t0 = hv_trace_clock(hfile->priv);
+	loff_t pos = *f_pos;
+	ssize_t done = 0;
+	ssize_t slice, n;
+	bool lat;
+
+	do {
+		slice = hv_qos_begin(hfile, count - done, !done, &lat);
+		if (slice < 0) {
+			n = slice;
+			break;
+		}
+
+		n = hv_cdev_write_slice(filp, ubuff + done, slice, f_pos);
+		hv_qos_end(hfile, n, lat);
+		if (n < 0)
+			break;
+
+		done += n;
+	} while (n == slice && done < count);
+
+	if (done || n >= 0)
+		n = done;
+	hv_trace_rec(hfile->priv, HV_MMLS_TRACE_WRITE, pos, count, 0, n, t0);
+
+	return n;
+}
+
 static long hv_cdev_ioctl(
 		struct file *filp, unsigned int cmd , unsigned long arg)
 {
-	hv_cdev_private *priv;
+	hv_cdev_file *hfile = filp->private_data;
+	hv_cdev_private *priv = hfile->priv;
+	u64 t0 = hv_trace_clock(priv);
 	int i;
 
 	PINFO("%s:\n", __func__);
 
-	priv = filp->private_data;
-
 	switch (cmd) {
 	case HV_MMLS_SIZE:
 		return put_user(priv->dev_size, (u64 __user *)arg);
@@ -232,16 +518,11 @@ static long hv_cdev_ioctl(
 		if (mutex_lock_interruptible(&priv->cmutex))
 			return -ERESTARTSYS;
 
-		if (use_static_buff) {
-			/*  parm: virtual start address, size */
-			clflush_cache_range(priv->buff + range.offset, range.size);
-		} else {
-			clflush_cache_range(
-				priv->mmls_iomem + range.offset,
-				range.size);
-		}
+		hv_cdev_flush(priv, range.offset, range.size);
 
 		mutex_unlock(&priv->cmutex);
+		hv_trace_rec(priv, HV_MMLS_TRACE_FLUSH, range.offset,
+				range.size, 0, 0, t0);
 		break;
 	}
 
@@ -254,12 +535,17 @@ static long hv_cdev_ioctl(
 					sizeof(struct hv_mmls_range)))
 			return -EFAULT;
 
+		if (priv->comp)
+			return -EOPNOTSUPP;
+
 		if (range.offset >= priv->dev_size)
 			return -EINVAL;
 
 		if (range.offset + range.size > priv->dev_size)
 			range.size = priv->dev_size - range.offset;
 
+		hv_scrub_wait(priv, range.offset, range.size);
+
 		PDEBUG("mmls_iomem=%p, offset=%llu, size=%llu\n",
 				priv->mmls_iomem,
 				range.offset,
@@ -275,6 +561,363 @@ static long hv_cdev_ioctl(
 		break;
 	}
 
+	case HV_MMLS_ADVISE:
+	{
+		struct hv_mmls_advise adv;
+
+		if (copy_from_user(&adv,
+					(struct hv_mmls_advise __user *)arg,
+					sizeof(struct hv_mmls_advise)))
+			return -EFAULT;
+
+		if (adv.offset >= priv->dev_size)
+			return -EINVAL;
+
+		if (adv.size == 0 || adv.offset + adv.size > priv->dev_size)
+			adv.size = priv->dev_size - adv.offset;
+
+		/* Compressed reads fetch exactly the slots they need */
+		if (priv->comp)
+			return 0;
+
+		return hv_ra_advise(hfile, adv.offset, adv.size, adv.advice);
+	}
+
+	case HV_MMLS_FILL:
+	{
+		struct hv_mmls_fill fill;
+		int res;
+
+		if (copy_from_user(&fill,
+					(struct hv_mmls_fill __user *)arg,
+					sizeof(struct hv_mmls_fill)))
+			return -EFAULT;
+
+		res = hv_cdev_get_range(hfile, fill.offset, fill.size);
+		if (res)
+			return res;
+
+		if (mutex_lock_interruptible(&priv->cmutex)) {
+			hv_cdev_put_range(hfile, fill.offset, fill.size);
+			return -ERESTARTSYS;
+		}
+
+		res = hv_ops_fill(priv, fill.offset, fill.size, fill.pattern);
+
+		mutex_unlock(&priv->cmutex);
+		hv_cdev_put_range(hfile, fill.offset, fill.size);
+		hv_trace_rec(priv, HV_MMLS_TRACE_FILL, fill.offset, fill.size,
+				fill.pattern, res, t0);
+		return res;
+	}
+
+	case HV_MMLS_COPY:
+	{
+		struct hv_mmls_copy copy;
+		int res;
+
+		if (copy_from_user(&copy,
+					(struct hv_mmls_copy __user *)arg,
+					sizeof(struct hv_mmls_copy)))
+			return -EFAULT;
+
+		res = hv_cdev_get_range2(hfile, copy.src, copy.dst, copy.size);
+		if (res)
+			return res;
+
+		if (mutex_lock_interruptible(&priv->cmutex)) {
+			hv_cdev_put_range2(hfile, copy.src, copy.dst, copy.size);
+			return -ERESTARTSYS;
+		}
+
+		res = hv_ops_copy(priv, copy.src, copy.dst, copy.size);
+
+		mutex_unlock(&priv->cmutex);
+		hv_cdev_put_range2(hfile, copy.src, copy.dst, copy.size);
+		hv_trace_rec(priv, HV_MMLS_TRACE_COPY, copy.src, copy.size,
+				copy.dst, res, t0);
+		return res;
+	}
+
+	case HV_MMLS_CRC:
+	{
+		struct hv_mmls_crc crc;
+		int res;
+
+		if (copy_from_user(&crc,
+					(struct hv_mmls_crc __user *)arg,
+					sizeof(struct hv_mmls_crc)))
+			return -EFAULT;
+
+		res = hv_cdev_get_range(hfile, crc.offset, crc.size);
+		if (res)
+			return res;
+
+		if (mutex_lock_interruptible(&priv->cmutex)) {
+			hv_cdev_put_range(hfile, crc.offset, crc.size);
+			return -ERESTARTSYS;
+		}
+
+		crc.crc = crc.seed;
+		res = hv_ops_crc(priv, crc.offset, crc.size, &crc.crc);
+
+		mutex_unlock(&priv->cmutex);
+		hv_cdev_put_range(hfile, crc.offset, crc.size);
+		hv_trace_rec(priv, HV_MMLS_TRACE_CRC, crc.offset, crc.size, 0,
+				res, t0);
+		if (res)
+			return res;
+
+		return put_user(crc.crc, &((struct hv_mmls_crc __user *)arg)->crc);
+	}
+
+	case HV_MMLS_COMPARE:
+	{
+		struct hv_mmls_compare cmp;
+		int res;
+
+		if (copy_from_user(&cmp,
+					(struct hv_mmls_compare __user *)arg,
+					sizeof(struct hv_mmls_compare)))
+			return -EFAULT;
+
+		res = hv_cdev_get_range2(hfile, cmp.offset1, cmp.offset2,
+				cmp.size);
+		if (res)
+			return res;
+
+		if (mutex_lock_interruptible(&priv->cmutex)) {
+			hv_cdev_put_range2(hfile, cmp.offset1, cmp.offset2,
+					cmp.size);
+			return -ERESTARTSYS;
+		}
+
+		res = hv_ops_compare(priv, cmp.offset1, cmp.offset2, cmp.size,
+					&cmp.result);
+
+		mutex_unlock(&priv->cmutex);
+		hv_cdev_put_range2(hfile, cmp.offset1, cmp.offset2, cmp.size);
+		hv_trace_rec(priv, HV_MMLS_TRACE_COMPARE, cmp.offset1, cmp.size,
+				cmp.offset2, res, t0);
+		if (res)
+			return res;
+
+		return put_user(cmp.result,
+				&((struct hv_mmls_compare __user *)arg)->result);
+	}
+
+	case HV_MMLS_CSUM_GET:
+	{
+		struct hv_mmls_csum csum;
+		int res;
+
+		if (copy_from_user(&csum,
+					(struct hv_mmls_csum __user *)arg,
+					sizeof(struct hv_mmls_csum)))
+			return -EFAULT;
+
+		if (mutex_lock_interruptible(&priv->cmutex))
+			return -ERESTARTSYS;
+
+		res = hv_csum_get(priv, csum.offset, csum.nblocks,
+				(u32 __user *)(unsigned long)csum.table);
+
+		mutex_unlock(&priv->cmutex);
+		if (res)
+			return res;
+
+		csum.block_size = HV_BLOCK_SIZE;
+		csum.errors = atomic64_read(&priv->csum_errors);
+
+		if (copy_to_user((struct hv_mmls_csum __user *)arg, &csum,
+					sizeof(struct hv_mmls_csum)))
+			return -EFAULT;
+		break;
+	}
+
+	case HV_MMLS_ALLOC:
+	{
+		struct hv_mmls_alloc req;
+		int res;
+
+		if (copy_from_user(&req,
+					(struct hv_mmls_alloc __user *)arg,
+					sizeof(struct hv_mmls_alloc)))
+			return -EFAULT;
+
+		res = hv_arena_alloc(hfile, &req);
+		if (res)
+			return res;
+
+		if (copy_to_user((struct hv_mmls_alloc __user *)arg, &req,
+					sizeof(struct hv_mmls_alloc))) {
+			hv_arena_free(hfile, req.offset);
+			return -EFAULT;
+		}
+		break;
+	}
+
+	case HV_MMLS_FREE:
+	{
+		u64 offset;
+
+		if (get_user(offset, (u64 __user *)arg))
+			return -EFAULT;
+
+		return hv_arena_free(hfile, offset);
+	}
+
+	case HV_MMLS_ASYNC:
+	{
+		struct hv_mmls_async async;
+		int res;
+
+		if (copy_from_user(&async,
+					(struct hv_mmls_async __user *)arg,
+					sizeof(struct hv_mmls_async)))
+			return -EFAULT;
+
+		switch (async.op) {
+		case HV_MMLS_ASYNC_FLUSH:
+			res = hv_cdev_check_range(hfile, async.range.offset,
+					async.range.size);
+			break;
+		case HV_MMLS_ASYNC_FILL:
+			res = hv_cdev_check_range(hfile, async.fill.offset,
+					async.fill.size);
+			break;
+		case HV_MMLS_ASYNC_COPY:
+			res = hv_cdev_check_range(hfile, async.copy.src,
+					async.copy.size);
+			if (!res)
+				res = hv_cdev_check_range(hfile, async.copy.dst,
+						async.copy.size);
+			break;
+		default:
+			res = -EINVAL;
+			break;
+		}
+
+		if (res)
+			return res;
+
+		return hv_async_submit(hfile, &async);
+	}
+
+	case HV_MMLS_GET_EVENT:
+	{
+		struct hv_mmls_event ev;
+		int res;
+
+		res = hv_event_get(hfile, &ev);
+		if (res)
+			return res;
+
+		if (copy_to_user((struct hv_mmls_event __user *)arg, &ev,
+					sizeof(struct hv_mmls_event)))
+			return -EFAULT;
+		break;
+	}
+
+	case HV_MMLS_SET_EVENTFD:
+	{
+		s32 fd;
+
+		if (get_user(fd, (s32 __user *)arg))
+			return -EFAULT;
+
+		return hv_event_set_eventfd(hfile, fd);
+	}
+
+	case HV_MMLS_SNAPSHOT:
+	{
+		struct hv_mmls_snapshot snap;
+
+		if (copy_from_user(&snap,
+					(struct hv_mmls_snapshot __user *)arg,
+					sizeof(struct hv_mmls_snapshot)))
+			return -EFAULT;
+
+		return hv_snap_create(priv, &snap,
+				(struct hv_mmls_snapshot __user *)arg);
+	}
+
+	case HV_MMLS_SET_QOS:
+	{
+		struct hv_mmls_qos qos;
+
+		if (copy_from_user(&qos, (struct hv_mmls_qos __user *)arg,
+					sizeof(struct hv_mmls_qos)))
+			return -EFAULT;
+
+		return hv_qos_set(hfile, &qos);
+	}
+
+	case HV_MMLS_QOS_STATS:
+	{
+		struct hv_mmls_qos_stats st;
+
+		hv_qos_get_stats(hfile, &st);
+
+		if (copy_to_user((struct hv_mmls_qos_stats __user *)arg, &st,
+					sizeof(struct hv_mmls_qos_stats)))
+			return -EFAULT;
+		break;
+	}
+
+	case HV_MMLS_HEAT:
+		return hv_heat_get_fd(priv);
+
+	case HV_MMLS_TRACE:
+	{
+		struct hv_mmls_trace tr;
+
+		if (copy_from_user(&tr, (struct hv_mmls_trace __user *)arg,
+					sizeof(struct hv_mmls_trace)))
+			return -EFAULT;
+
+		return hv_trace_start(priv, &tr,
+				(struct hv_mmls_trace __user *)arg);
+	}
+
+	case HV_MMLS_TXN:
+	{
+		struct hv_mmls_txn txn;
+		int res;
+
+		if (copy_from_user(&txn, (struct hv_mmls_txn __user *)arg,
+					sizeof(struct hv_mmls_txn)))
+			return -EFAULT;
+
+		res = hv_txn_run(hfile, &txn, t0);
+
+		if (copy_to_user((struct hv_mmls_txn __user *)arg, &txn,
+					sizeof(struct hv_mmls_txn)))
+			return -EFAULT;
+
+		return res;
+	}
+
+	case HV_MMLS_COMP_STATS:
+	{
+		struct hv_mmls_comp_stats st;
+
+		if (!priv->comp)
+			return -EOPNOTSUPP;
+
+		if (mutex_lock_interruptible(&priv->cmutex))
+			return -ERESTARTSYS;
+
+		hv_comp_get_stats(priv, &st);
+
+		mutex_unlock(&priv->cmutex);
+
+		if (copy_to_user((struct hv_mmls_comp_stats __user *)arg, &st,
+					sizeof(struct hv_mmls_comp_stats)))
+			return -EFAULT;
+		break;
+	}
+
 	default:
 		return -ENOTTY;
 	}
@@ -283,18 +926,15 @@ static long hv_cdev_ioctl(
 }
 
 /* Asynchronous notification will be used to send SIGIO signal to user process
-   Add kill_fasync(struct fasync_struct ** , int signo , int band); used
-   to send signal along with the operation to be performed in the user process
-   e.g, use in read or write signo will be SIGIO and band is POLL_IN for read
-   POLL_OUT for write
+   kill_fasync(struct fasync_struct ** , int signo , int band) is called
+   with SIGIO and POLL_IN when an HV_MMLS_ASYNC op of this file completes
+   (see hv_cdev_event.c)
  */
 static int hv_cdev_fasync(int fd , struct file *filp , int mode)
 {
-	hv_cdev_private *priv;
-
-	priv = filp->private_data;
+	hv_cdev_file *hfile = filp->private_data;
 
-	return fasync_helper(fd , filp , mode , &priv->fasync);
+	return fasync_helper(fd , filp , mode , &hfile->fasync);
 }
 
 static loff_t hv_cdev_llseek(struct file *filp, loff_t off, int whence)
@@ -344,13 +984,42 @@ hv_cdev_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return VM_FAULT_SIGBUS;
 }
 
+/*
+ * Writable mappings are counted so snapshots can refuse them, and
+ * every mapping holds its arena extent
+ */
+void hv_cdev_vm_open(struct vm_area_struct *vma)
+{
+	hv_cdev_file *hfile = vma->vm_file->private_data;
+
+	if (vma->vm_flags & VM_MAYWRITE)
+		atomic_inc(&hfile->priv->mmap_writers);
+
+	hv_arena_get(hfile, vma->vm_pgoff << PAGE_SHIFT,
+			vma->vm_end - vma->vm_start);
+}
+
+void hv_cdev_vm_close(struct vm_area_struct *vma)
+{
+	hv_cdev_file *hfile = vma->vm_file->private_data;
+
+	if (vma->vm_flags & VM_MAYWRITE)
+		atomic_dec(&hfile->priv->mmap_writers);
+
+	hv_arena_put(hfile, vma->vm_pgoff << PAGE_SHIFT,
+			vma->vm_end - vma->vm_start);
+}
+
 static struct vm_operations_struct hv_cdev_vm_ops = {
+	.open = hv_cdev_vm_open,
+	.close = hv_cdev_vm_close,
 	.fault = hv_cdev_fault,
 };
 
 static int hv_cdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	hv_cdev_private *priv = filp->private_data;
+	hv_cdev_file *hfile = filp->private_data;
+	hv_cdev_private *priv = hfile->priv;
 
 	int res;
 
@@ -373,6 +1042,45 @@ static int hv_cdev_mmap(struct file *filp, struct vm_area_struct *vma)
 		return -EINVAL;
 	}
 
+	if (priv->comp) {
+		PERR("%s: not available in compressed mode\n", __func__);
+		return -EOPNOTSUPP;
+	}
+
+	/* Held until hv_cdev_vm_close(), so the extent is not freed */
+	if (hv_arena_get(hfile, off, vsize)) {
+		PERR("%s: mapping is outside the file's extents\n", __func__);
+		return -EACCES;
+	}
+
+	/* Stores through the mapping would never be checksummed */
+	if ((vma->vm_flags & VM_WRITE) && priv->csum) {
+		PERR("%s: no writable mappings with checksums\n", __func__);
+		hv_arena_put(hfile, off, vsize);
+		return -EACCES;
+	}
+
+	/* Stores through the mapping bypass snapshot copy-on-write */
+	if (vma->vm_flags & VM_WRITE) {
+		if (hv_snap_map(priv)) {
+			PERR("%s: a snapshot is open\n", __func__);
+			hv_arena_put(hfile, off, vsize);
+			return -EBUSY;
+		}
+	} else {
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/* The mapping reaches the memory without further checks */
+	hv_scrub_wait(priv, off, vsize);
+
+	hv_trace_rec(priv, HV_MMLS_TRACE_MMAP, off, vsize,
+			!!(vma->vm_flags & VM_WRITE), 0, hv_trace_clock(priv));
+
+	/* Page-backed mapping, filled in on fault */
+	if (priv->pgmap)
+		return hv_pgmap_mmap(priv, vma);
+
 	vma->vm_ops = &hv_cdev_vm_ops;
 
 	switch (hv_mmap_type) {
@@ -387,6 +1095,10 @@ static int hv_cdev_mmap(struct file *filp, struct vm_area_struct *vma)
 		break;
 	}
 
+	/* Filled in on fault so mmap access can be sampled */
+	if (priv->heat)
+		return hv_heat_mmap(priv, vma);
+
 	vma->vm_flags |= VM_LOCKED;	/* locked from swap */
 
 	PDEBUG("phys_start=%p, page_frame_num=%d\n",
@@ -401,6 +1113,7 @@ static int hv_cdev_mmap(struct file *filp, struct vm_area_struct *vma)
 
 	if (res) {
 		PERR("%s: error from remap_pfn_range()/n", __func__);
+		hv_cdev_vm_close(vma);
 		return -EAGAIN;
 	} else
 		PDEBUG("%s: Physical mem remapped to user VA\n", __func__);
@@ -416,6 +1129,7 @@ static const struct file_operations hv_cdev_fops = {
 	.write				= hv_cdev_write,
 	.unlocked_ioctl			= hv_cdev_ioctl,
 	.fasync				= hv_cdev_fasync,
+	.poll				= hv_event_poll,
 	.llseek				= hv_cdev_llseek,
 	.mmap				= hv_cdev_mmap,
 };
@@ -463,6 +1177,10 @@ static int __init hv_cdev_init(void)
 		goto not_using_cdev;
 	}
 
+	res = hv_par_init();
+	if (res)
+		goto not_using_cdev;
+
 	/* Get dev major number assignment from kernel.	*/
 	/* Returned in hv_cdev_device_num		*/
 	res = alloc_chrdev_region(&hv_cdev_device_num,
@@ -471,6 +1189,7 @@ static int __init hv_cdev_init(void)
 				DRIVER_NAME);
 	if (res) {
 		PERR("register device no failed\n");
+		hv_par_exit();
 		return -1;
 	}
 
@@ -479,6 +1198,9 @@ static int __init hv_cdev_init(void)
 
 	/* Create just 1 char dev as HV_CDEV_N_MINORS=1 as now */
 	for (i = 0; i < HV_CDEV_N_MINORS; i++) {
+		mutex_init(&devices[i].backend_lock);
+		hv_qos_init(&devices[i]);
+
 		/* First, init mmls device to get size and addr */
 		if (mmls_init()) {
 			PERR("%s: mmls size module parm is 0.\n", __func__);
@@ -500,7 +1222,83 @@ static int __init hv_cdev_init(void)
 			devices[i].dev_size = mmls_io_data.m_size;
 			devices[i].phys_start = mmls_io_data.phys_start;
 			devices[i].mmls_iomem = mmls_io_data.m_iomem;
+			devices[i].pfn = mmls_io_data.phys_start >> PAGE_SHIFT;
 			use_static_buff = 0;
+
+			/* Run parallel copies next to the memory */
+			hv_par_set_node(pfn_valid(devices[i].pfn) ?
+					pfn_to_nid(devices[i].pfn) : NUMA_NO_NODE);
+
+			/* Before anything sized by dev_size */
+			res = hv_comp_init(&devices[i]);
+			if (res)
+				goto failed_classreg;
+
+			/* Rolls back an interrupted transaction */
+			res = hv_txn_init(&devices[i]);
+			if (res) {
+				hv_comp_exit(&devices[i]);
+				goto failed_classreg;
+			}
+
+			res = hv_csum_init(&devices[i]);
+			if (res) {
+				hv_txn_exit(&devices[i]);
+				hv_comp_exit(&devices[i]);
+				goto failed_classreg;
+			}
+
+			res = hv_pgmap_init(&devices[i]);
+			if (res) {
+				hv_csum_exit(&devices[i]);
+				hv_txn_exit(&devices[i]);
+				hv_comp_exit(&devices[i]);
+				goto failed_classreg;
+			}
+
+			/* Runs once the node is up; I/O waits per chunk */
+			res = hv_scrub_init(&devices[i]);
+			if (res) {
+				hv_pgmap_exit(&devices[i]);
+				hv_csum_exit(&devices[i]);
+				hv_txn_exit(&devices[i]);
+				hv_comp_exit(&devices[i]);
+				goto failed_classreg;
+			}
+		}
+
+		res = hv_arena_init(&devices[i]);
+		if (res) {
+			hv_scrub_exit(&devices[i]);
+			hv_pgmap_exit(&devices[i]);
+			hv_csum_exit(&devices[i]);
+			hv_txn_exit(&devices[i]);
+			hv_comp_exit(&devices[i]);
+			goto failed_classreg;
+		}
+
+		res = hv_heat_init(&devices[i]);
+		if (res) {
+			hv_arena_exit(&devices[i]);
+			hv_scrub_exit(&devices[i]);
+			hv_pgmap_exit(&devices[i]);
+			hv_csum_exit(&devices[i]);
+			hv_txn_exit(&devices[i]);
+			hv_comp_exit(&devices[i]);
+			goto failed_classreg;
+		}
+
+		res = hv_blk_init(&devices[i], i);
+		if (res) {
+			PERR("%s: block device failed, res=%d\n", __func__, res);
+			hv_heat_exit(&devices[i]);
+			hv_arena_exit(&devices[i]);
+			hv_scrub_exit(&devices[i]);
+			hv_pgmap_exit(&devices[i]);
+			hv_csum_exit(&devices[i]);
+			hv_txn_exit(&devices[i]);
+			hv_comp_exit(&devices[i]);
+			goto failed_classreg;
 		}
 
 		hv_cdev_device_num = MKDEV(hv_cdev_major, HV_CDEV_FIRST_MINOR+i);
@@ -534,7 +1332,7 @@ static int __init hv_cdev_init(void)
 					devices[i].hv_cdev_class,
 					NULL,
 					MKDEV(hv_cdev_major, i),
-					NULL,
+					&devices[i],
 					HV_CDEV_DEVICE_FILENAME "%d",
 					i);
 
@@ -547,7 +1345,15 @@ static int __init hv_cdev_init(void)
 			goto failed_devreg;
 		}
 
+		/* QoS tunables; the device works without them */
+		if (hv_qos_sysfs_add(&devices[i]))
+			PERR("%s: Failed to add qos sysfs attributes\n", __func__);
+		if (hv_scrub_sysfs_add(&devices[i]))
+			PERR("%s: Failed to add scrub sysfs attribute\n", __func__);
+
 		mutex_init(&devices[i].cmutex);
+
+		hv_scrub_start(&devices[i]);
 	}
 
 	PINFO("INIT\n");
@@ -565,6 +1371,7 @@ failed_devreg:
 
 failed_classreg:
 	unregister_chrdev(hv_cdev_major, HV_CDEV_CLASS_NAME);
+	hv_par_exit();
 
 not_using_cdev:
 	return res;
@@ -583,16 +1390,30 @@ static void __exit hv_cdev_exit(void)
 
 	for (i = 0; i < HV_CDEV_N_MINORS; i++) {
 		hv_cdev_device_num = MKDEV(hv_cdev_major, HV_CDEV_FIRST_MINOR+i);
+		hv_scrub_sysfs_remove(&devices[i]);
+		hv_qos_sysfs_remove(&devices[i]);
 		device_destroy(devices[i].hv_cdev_class, hv_cdev_device_num);
 		class_unregister(devices[i].hv_cdev_class);
 		class_destroy(devices[i].hv_cdev_class);
 		cdev_del(&devices[i].cdev);
+		hv_blk_exit(&devices[i]);
+		hv_scrub_exit(&devices[i]);
+		hv_pgmap_exit(&devices[i]);
+		hv_csum_exit(&devices[i]);
+		hv_arena_exit(&devices[i]);
+		hv_txn_exit(&devices[i]);
+		hv_comp_exit(&devices[i]);
+		hv_snap_exit(&devices[i]);
+		hv_heat_exit(&devices[i]);
 	}
 
 	unregister_chrdev_region(hv_cdev_device_num, HV_CDEV_N_MINORS);
 
 	mmls_iomem_release();
 
+	hv_par_exit();
+	hv_trace_exit();
+
 not_using_cdev:
 	return;
 }
@@ -1,3 +1,6 @@
+#ifndef _HV_CDEV_H_
+#define _HV_CDEV_H_
+
 #define DRIVER_NAME "hv_cdev"
 
 /* Debug logs toggle from lower importance to higher */
@@ -31,3 +34,279 @@
 
 /* Use RAMDISK? */
 #define USE_RAMDISK 0
+
+#include<linux/kfifo.h>
+#include<linux/ktime.h>
+#include<linux/mutex.h>
+#include<linux/poll.h>
+#include<linux/rcupdate.h>
+#include<linux/string.h>
+#include<linux/version.h>
+#include<linux/workqueue.h>
+#include<asm/cacheflush.h>
+#include "hv_cdev_uapi.h"
+
+#define HV_CDEV_BUFF_SIZE		(4096 * 8)
+
+/* Backend commands are issued in 512-byte sectors */
+#define HV_CDEV_SECTOR_SHIFT	9
+#define HV_CDEV_SECTOR_SIZE	(1 << HV_CDEV_SECTOR_SHIFT)
+
+/* Async ops queued plus completions unread, per file. Power of 2. */
+#define HV_EVENT_DEPTH		64
+
+typedef struct privatedata {
+	int nminor;
+	char buff[HV_CDEV_BUFF_SIZE];
+	struct cdev cdev;
+	struct class *hv_cdev_class;
+	struct mutex cmutex;
+	struct device *hv_cdev_device;
+	u64 dev_size;			/* bytes */
+					/* phys_addr_t is word size of any arch */
+	phys_addr_t phys_start;		/* physical address of mmls (mmls_start) */
+	void __iomem *mmls_iomem;	/* kernel virtual address ptr of iomem   */
+	unsigned long pfn;		/* page frame number of physical mem */
+	unsigned long mmls_nsectors;	/* num of sectors */
+	u32 *csum;			/* crc32c per block, NULL = off */
+	atomic64_t csum_errors;		/* blocks that failed verify */
+	struct hv_buddy *arena;		/* extent allocator, NULL = off */
+	struct mutex arena_lock;	/* arena and every file's extents */
+	struct hv_comp *comp;		/* LZ4 mode state, NULL = off */
+	struct hv_snap *snap;		/* open snapshot, NULL = none */
+	unsigned long *snap_dirty;	/* blocks written since last snapshot */
+	bool snap_all_dirty;		/* untracked writes happened */
+	atomic_t mmap_writers;		/* live writable mappings */
+	struct hv_blk *blk;		/* block device, NULL = off */
+	struct mutex backend_lock;	/* mmls_*_command() calls */
+	struct dev_pagemap *pgmap;	/* ZONE_DEVICE pages, NULL = off */
+	wait_queue_head_t qos_wq;	/* slices waiting on latency I/O */
+	atomic_t lat_files;		/* open latency-class files */
+	atomic_t lat_inflight;		/* latency-class read/write running */
+	atomic64_t qos_throttled_ns;
+	atomic64_t qos_preemptions;
+	size_t qos_slice;		/* bytes, sysfs qos_slice_kb */
+	u64 qos_bulk_bps;		/* bulk class default, 0 = unlimited */
+	struct hv_heat *heat;		/* access heat, NULL = off */
+	struct hv_scrub *scrub;		/* load-time pass, NULL = none */
+	struct hv_trace __rcu *trace;	/* I/O capture, NULL = off */
+	struct hv_txn *txn;		/* undo log, NULL = off */
+} hv_cdev_private;
+
+/*
+ * Per-open readahead state. [start, end) is the range already brought
+ * in by mmls_read_command(); [async_start, async_start + async_len) is
+ * queued to the readahead work. All fields are protected by cmutex.
+ */
+struct hv_ra_state {
+	loff_t prev_end;		/* end of the previous read() */
+	loff_t start;
+	loff_t end;
+	loff_t async_start;
+	size_t async_len;
+	size_t size;			/* current window, bytes */
+	int advice;			/* HV_MMLS_ADV_* */
+	struct work_struct work;
+};
+
+/* Token bucket; rate 0 = unlimited */
+struct hv_qos_bucket {
+	u64 rate;			/* tokens per second */
+	u64 burst;
+	u64 tokens;
+	u64 last_ns;
+};
+
+/* Per-open QoS class and limits, see hv_cdev_qos.c */
+struct hv_qos_state {
+	spinlock_t lock;		/* buckets and stats */
+	u32 qos_class;		/* HV_MMLS_QOS_* */
+	struct hv_qos_bucket bw;	/* bytes */
+	struct hv_qos_bucket ops;	/* read/write calls */
+	struct hv_mmls_qos_stats stats;
+};
+
+/* Per-open file data, stored in filp->private_data */
+typedef struct hv_cdev_filedata {
+	hv_cdev_private *priv;
+	struct hv_ra_state ra;
+	struct list_head extents;	/* hv_arena_extent owned by file */
+	struct fasync_struct *fasync;
+	wait_queue_head_t event_wq;	/* poll, and release waiting on work */
+	spinlock_t event_lock;		/* events and evfd */
+	DECLARE_KFIFO(events, struct hv_mmls_event, HV_EVENT_DEPTH);
+	atomic_t async_inflight;
+	struct eventfd_ctx *evfd;
+	struct hv_qos_state qos;
+} hv_cdev_file;
+
+/* 1 = if cmd drv reports no hv hw or ramdisk	*/
+/* driver will use privatedata.buff[] as buffer	*/
+extern int use_static_buff;
+
+void hv_cdev_backend_read(hv_cdev_private *priv, u64 off, u64 len);
+void hv_cdev_backend_write(hv_cdev_private *priv, u64 off, u64 len);
+void hv_cdev_flush(hv_cdev_private *priv, u64 off, u64 size);
+int hv_cdev_check_range(hv_cdev_file *hfile, u64 off, u64 size);
+int hv_cdev_get_range(hv_cdev_file *hfile, u64 off, u64 size);
+void hv_cdev_put_range(hv_cdev_file *hfile, u64 off, u64 size);
+void hv_cdev_vm_open(struct vm_area_struct *vma);
+void hv_cdev_vm_close(struct vm_area_struct *vma);
+
+/* Kernel virtual address of a device offset, in either buffer mode */
+static inline void *hv_cdev_vaddr(hv_cdev_private *priv, u64 off)
+{
+	if (use_static_buff)
+		return priv->buff + off;
+
+	return (void __force *)priv->mmls_iomem + off;
+}
+
+/*
+ * Copy into the device bypassing the CPU cache. Caller issues wmb()
+ * once all copies are done to order them before returning to user.
+ */
+static inline void hv_cdev_memcpy_nt(void *dst, const void *src, size_t n)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	memcpy_flushcache(dst, src, n);
+#else
+	memcpy(dst, src, n);
+	clflush_cache_range(dst, n);
+#endif
+}
+
+/* hv_cdev_par.c */
+typedef int (*hv_par_fn)(void *ctx, u64 off, u64 len);
+
+int hv_par_init(void);
+void hv_par_exit(void);
+int hv_par_run(u64 off, u64 len, hv_par_fn fn, void *ctx);
+void hv_par_set_node(int node);
+bool hv_par_want(size_t count);
+ssize_t hv_par_copy_user(hv_cdev_private *priv, u64 dev_off,
+		unsigned long uaddr, size_t count, bool to_user);
+
+/* hv_cdev_comp.c */
+struct hv_mmls_comp_stats;
+int hv_comp_init(hv_cdev_private *priv);
+void hv_comp_exit(hv_cdev_private *priv);
+int hv_comp_read(hv_cdev_private *priv, char __user *ubuff, u64 pos,
+		size_t count);
+int hv_comp_write(hv_cdev_private *priv, u64 pos, const char __user *ubuff,
+		size_t count);
+void hv_comp_get_stats(hv_cdev_private *priv, struct hv_mmls_comp_stats *st);
+
+/* hv_cdev_trace.c */
+struct hv_mmls_trace;
+int hv_trace_start(hv_cdev_private *priv, struct hv_mmls_trace *req,
+		struct hv_mmls_trace __user *ureq);
+void hv_trace_exit(void);
+void hv_trace_rec(hv_cdev_private *priv, u8 op, u64 off, u64 len, u64 arg,
+		long res, u64 t0);
+
+/* Start time for hv_trace_rec(), 0 when no capture is running */
+static inline u64 hv_trace_clock(hv_cdev_private *priv)
+{
+	return rcu_access_pointer(priv->trace) ? ktime_get_ns() : 0;
+}
+
+/* hv_cdev_txn.c */
+struct hv_mmls_txn;
+int hv_txn_init(hv_cdev_private *priv);
+void hv_txn_exit(hv_cdev_private *priv);
+int hv_txn_run(hv_cdev_file *hfile, struct hv_mmls_txn *req, u64 t0);
+
+/* hv_cdev_scrub.c */
+int hv_scrub_init(hv_cdev_private *priv);
+void hv_scrub_start(hv_cdev_private *priv);
+void hv_scrub_exit(hv_cdev_private *priv);
+void hv_scrub_wait(hv_cdev_private *priv, u64 off, u64 len);
+int hv_scrub_sysfs_add(hv_cdev_private *priv);
+void hv_scrub_sysfs_remove(hv_cdev_private *priv);
+
+/* hv_cdev_heat.c */
+int hv_heat_init(hv_cdev_private *priv);
+void hv_heat_exit(hv_cdev_private *priv);
+void hv_heat_io(hv_cdev_private *priv, u64 off, u64 len);
+void hv_heat_open(hv_cdev_private *priv, struct file *filp);
+void hv_heat_fault(hv_cdev_private *priv, u64 off);
+int hv_heat_mmap(hv_cdev_private *priv, struct vm_area_struct *vma);
+int hv_heat_get_fd(hv_cdev_private *priv);
+
+/* hv_cdev_qos.c */
+void hv_qos_init(hv_cdev_private *priv);
+void hv_qos_open(hv_cdev_file *hfile);
+void hv_qos_release(hv_cdev_file *hfile);
+int hv_qos_set(hv_cdev_file *hfile, const struct hv_mmls_qos *req);
+void hv_qos_get_stats(hv_cdev_file *hfile, struct hv_mmls_qos_stats *st);
+ssize_t hv_qos_begin(hv_cdev_file *hfile, size_t count, bool first, bool *lat);
+void hv_qos_end(hv_cdev_file *hfile, ssize_t n, bool lat);
+int hv_qos_sysfs_add(hv_cdev_private *priv);
+void hv_qos_sysfs_remove(hv_cdev_private *priv);
+
+/* hv_cdev_pgmap.c */
+int hv_pgmap_init(hv_cdev_private *priv);
+void hv_pgmap_exit(hv_cdev_private *priv);
+int hv_pgmap_mmap(hv_cdev_private *priv, struct vm_area_struct *vma);
+
+/* hv_blk.c */
+int hv_blk_init(hv_cdev_private *priv, int index);
+void hv_blk_exit(hv_cdev_private *priv);
+
+/* hv_cdev_snap.c */
+struct hv_mmls_snapshot;
+int hv_snap_create(hv_cdev_private *priv, struct hv_mmls_snapshot *req,
+		struct hv_mmls_snapshot __user *ureq);
+void hv_snap_write(hv_cdev_private *priv, u64 off, u64 len);
+int hv_snap_map(hv_cdev_private *priv);
+void hv_snap_exit(hv_cdev_private *priv);
+
+/* hv_cdev_csum.c */
+int hv_csum_init(hv_cdev_private *priv);
+void hv_csum_exit(hv_cdev_private *priv);
+void hv_csum_update(hv_cdev_private *priv, u64 off, u64 len);
+int hv_csum_verify(hv_cdev_private *priv, u64 off, u64 len);
+u64 hv_csum_step(u64 off, u64 len);
+int hv_csum_copy_to_user(hv_cdev_private *priv, char __user *ubuff,
+		u64 off, size_t count);
+int hv_csum_copy_from_user(hv_cdev_private *priv, u64 off,
+		const char __user *ubuff, size_t count);
+int hv_csum_get(hv_cdev_private *priv, u64 off, u64 nblocks,
+		u32 __user *table);
+
+/* hv_cdev_arena.c */
+struct hv_mmls_alloc;
+int hv_arena_init(hv_cdev_private *priv);
+void hv_arena_exit(hv_cdev_private *priv);
+void hv_arena_open(hv_cdev_file *hfile);
+void hv_arena_release(hv_cdev_file *hfile);
+int hv_arena_alloc(hv_cdev_file *hfile, struct hv_mmls_alloc *req);
+int hv_arena_free(hv_cdev_file *hfile, u64 offset);
+int hv_arena_check(hv_cdev_file *hfile, u64 off, u64 len);
+int hv_arena_get(hv_cdev_file *hfile, u64 off, u64 len);
+void hv_arena_put(hv_cdev_file *hfile, u64 off, u64 len);
+
+/* hv_cdev_event.c */
+void hv_event_open(hv_cdev_file *hfile);
+void hv_event_release(struct file *filp);
+int hv_async_submit(hv_cdev_file *hfile, const struct hv_mmls_async *args);
+int hv_event_get(hv_cdev_file *hfile, struct hv_mmls_event *ev);
+int hv_event_set_eventfd(hv_cdev_file *hfile, int fd);
+unsigned int hv_event_poll(struct file *filp, poll_table *wait);
+
+/* hv_cdev_ops.c */
+int hv_ops_fill(hv_cdev_private *priv, u64 off, u64 size, u64 pattern);
+int hv_ops_copy(hv_cdev_private *priv, u64 src, u64 dst, u64 size);
+int hv_ops_crc(hv_cdev_private *priv, u64 off, u64 size, u32 *crc);
+int hv_ops_compare(hv_cdev_private *priv, u64 off1, u64 off2, u64 size,
+		u64 *result);
+
+/* hv_cdev_ra.c */
+void hv_ra_init(hv_cdev_file *hfile);
+void hv_ra_release(hv_cdev_file *hfile);
+void hv_ra_wait(hv_cdev_file *hfile, loff_t pos, size_t count);
+void hv_ra_read(hv_cdev_file *hfile, loff_t pos, size_t count);
+int hv_ra_advise(hv_cdev_file *hfile, u64 offset, u64 size, int advice);
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ *
+ *  Per-file extent allocation over the device.
+ *
+ *  With hv_arena=1 the device is handed out in extents through
+ *  HV_MMLS_ALLOC/HV_MMLS_FREE. An extent belongs to the file that
+ *  allocated it and is freed when that file is released. read(),
+ *  write(), mmap() and the device-side ops are then only allowed
+ *  inside extents owned by the calling file, so tenants sharing the
+ *  device cannot touch each other's data. New extents are zeroed.
+ *
+ *  read(), write(), the device-side ops and transactions hold their
+ *  extent while they run, and mappings and queued async ops for as long
+ *  as they exist. HV_MMLS_FREE of a held extent fails with -EBUSY, so
+ *  its pages cannot be handed to another file while the old owner can
+ *  still reach them.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cdev_uapi.h"
+#include "hv_buddy.h"
+#include <linux/sizes.h>
+#include <linux/slab.h>
+
+static bool hv_arena;
+module_param(hv_arena, bool, S_IRUGO);
+MODULE_PARM_DESC(hv_arena, "Partition the device into per-file extents (default 0)");
+
+struct hv_arena_extent {
+	struct list_head list;
+	u64 offset;
+	u64 size;
+	unsigned int users;		/* running ops, mappings, async ops */
+};
+
+/* The file's extent holding [off, off + len). Called with arena_lock. */
+static struct hv_arena_extent *hv_arena_find(hv_cdev_file *hfile, u64 off,
+		u64 len)
+{
+	struct hv_arena_extent *ext;
+
+	list_for_each_entry(ext, &hfile->extents, list) {
+		if (off >= ext->offset && off + len <= ext->offset + ext->size)
+			return ext;
+	}
+
+	return NULL;
+}
+
+int hv_arena_init(hv_cdev_private *priv)
+{
+	int res;
+
+	mutex_init(&priv->arena_lock);
+
+	if (!hv_arena)
+		return 0;
+
+	/* Extents are zeroed through raw offsets */
+	if (priv->comp) {
+		PERR("%s: not available in compressed mode\n", __func__);
+		return 0;
+	}
+
+	priv->arena = kzalloc(sizeof(*priv->arena), GFP_KERNEL);
+	if (!priv->arena)
+		return -ENOMEM;
+
+	res = hv_buddy_init(priv->arena, priv->dev_size, PAGE_SHIFT);
+	if (res) {
+		PERR("%s: buddy init failed, res=%d\n", __func__, res);
+		kfree(priv->arena);
+		priv->arena = NULL;
+		return res;
+	}
+
+	PINFO("%s: %u pages available for extents\n", __func__,
+		priv->arena->nunits);
+
+	return 0;
+}
+
+void hv_arena_exit(hv_cdev_private *priv)
+{
+	if (!priv->arena)
+		return;
+
+	hv_buddy_destroy(priv->arena);
+	kfree(priv->arena);
+	priv->arena = NULL;
+}
+
+void hv_arena_open(hv_cdev_file *hfile)
+{
+	INIT_LIST_HEAD(&hfile->extents);
+}
+
+/* Return every extent of the file to the allocator */
+void hv_arena_release(hv_cdev_file *hfile)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_arena_extent *ext, *tmp;
+
+	mutex_lock(&priv->arena_lock);
+
+	list_for_each_entry_safe(ext, tmp, &hfile->extents, list) {
+		hv_buddy_free(priv->arena, ext->offset);
+		list_del(&ext->list);
+		kfree(ext);
+	}
+
+	mutex_unlock(&priv->arena_lock);
+}
+
+int hv_arena_alloc(hv_cdev_file *hfile, struct hv_mmls_alloc *req)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_arena_extent *ext;
+	u64 align = req->align;
+	int res;
+
+	if (!priv->arena)
+		return -EOPNOTSUPP;
+
+	if (req->flags & HV_MMLS_ALLOC_HUGE)
+		align = max_t(u64, align, SZ_2M);
+
+	ext = kmalloc(sizeof(*ext), GFP_KERNEL);
+	if (!ext)
+		return -ENOMEM;
+
+	ext->users = 0;
+
+	mutex_lock(&priv->arena_lock);
+	res = hv_buddy_alloc(priv->arena, req->size, align,
+			&ext->offset, &ext->size);
+	mutex_unlock(&priv->arena_lock);
+
+	if (res) {
+		kfree(ext);
+		return res;
+	}
+
+	/*
+	 * Don't hand out the previous owner's data: zero before the extent
+	 * goes on the file's list, where read() and mmap() can find it
+	 */
+	if (mutex_lock_interruptible(&priv->cmutex)) {
+		res = -ERESTARTSYS;
+	} else {
+		res = hv_ops_fill(priv, ext->offset, ext->size, 0);
+		mutex_unlock(&priv->cmutex);
+	}
+
+	mutex_lock(&priv->arena_lock);
+	if (res)
+		hv_buddy_free(priv->arena, ext->offset);
+	else
+		list_add(&ext->list, &hfile->extents);
+	mutex_unlock(&priv->arena_lock);
+
+	if (res) {
+		kfree(ext);
+		return res;
+	}
+
+	req->offset = ext->offset;
+	req->alloc_size = ext->size;
+
+	PDEBUG("%s: offset=%llu, size=%llu\n", __func__, ext->offset, ext->size);
+
+	return 0;
+}
+
+int hv_arena_free(hv_cdev_file *hfile, u64 offset)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_arena_extent *ext;
+	int res = -EINVAL;
+
+	if (!priv->arena)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&priv->arena_lock);
+
+	list_for_each_entry(ext, &hfile->extents, list) {
+		if (ext->offset == offset) {
+			/* In use by an op, a mapping or a queued async op */
+			if (ext->users) {
+				res = -EBUSY;
+				break;
+			}
+			res = hv_buddy_free(priv->arena, offset);
+			list_del(&ext->list);
+			kfree(ext);
+			break;
+		}
+	}
+
+	mutex_unlock(&priv->arena_lock);
+
+	return res;
+}
+
+/*
+ * 0 if [off, off + len) lies inside one extent owned by the file, or
+ * the arena is off. -EACCES otherwise.
+ */
+int hv_arena_check(hv_cdev_file *hfile, u64 off, u64 len)
+{
+	hv_cdev_private *priv = hfile->priv;
+	int res = 0;
+
+	if (!priv->arena)
+		return 0;
+
+	mutex_lock(&priv->arena_lock);
+	if (!hv_arena_find(hfile, off, len))
+		res = -EACCES;
+	mutex_unlock(&priv->arena_lock);
+
+	return res;
+}
+
+/* As hv_arena_check(), and holds the extent until hv_arena_put() */
+int hv_arena_get(hv_cdev_file *hfile, u64 off, u64 len)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_arena_extent *ext;
+	int res = 0;
+
+	if (!priv->arena)
+		return 0;
+
+	mutex_lock(&priv->arena_lock);
+	ext = hv_arena_find(hfile, off, len);
+	if (ext)
+		ext->users++;
+	else
+		res = -EACCES;
+	mutex_unlock(&priv->arena_lock);
+
+	return res;
+}
+
+void hv_arena_put(hv_cdev_file *hfile, u64 off, u64 len)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_arena_extent *ext;
+
+	if (!priv->arena)
+		return;
+
+	mutex_lock(&priv->arena_lock);
+	ext = hv_arena_find(hfile, off, len);
+	if (!WARN_ON(!ext || !ext->users))
+		ext->users--;
+	mutex_unlock(&priv->arena_lock);
+}
@@ -0,0 +1,454 @@
+/*
+ *
+ *  Transparent LZ4 compression for read()/write().
+ *
+ *  With hv_compress=1 the device is presented as hv_comp_factor times
+ *  its physical size. The logical space is cut into chunks of
+ *  HV_COMP_BLOCKS blocks; each chunk is compressed with LZ4 on write
+ *  and stored in 512-byte slots anywhere in the physical area. A chunk
+ *  that does not shrink by at least one slot is stored raw.
+ *
+ *  The indirection table (one u64 per chunk: first slot and stored
+ *  length) lives at the start of the physical area, so data survives
+ *  a module reload. A chunk is always rewritten to freshly allocated
+ *  slots and the table entry is switched with a single 8-byte store
+ *  after the data is flushed, so an entry points at either the old or
+ *  the new data, never at a torn mix. Entries read back at load that
+ *  run past the slot area or overlap another are marked bad; reading
+ *  such a chunk fails with -EIO until it is rewritten in full.
+ *
+ *  mmap() and the raw-offset ioctls are refused in this mode.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cmd.h"
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static bool hv_compress;
+module_param(hv_compress, bool, S_IRUGO);
+MODULE_PARM_DESC(hv_compress, "Compress read()/write() data with LZ4 (default 0)");
+
+static unsigned int hv_comp_factor = 2;
+module_param(hv_comp_factor, uint, S_IRUGO);
+MODULE_PARM_DESC(hv_comp_factor, "Logical size as a multiple of physical size in compressed mode");
+
+#define HV_COMP_BLOCKS		4
+#define HV_COMP_CHUNK		(HV_COMP_BLOCKS * HV_BLOCK_SIZE)
+#define HV_COMP_SLOT_SHIFT	9
+#define HV_COMP_SLOT		(1 << HV_COMP_SLOT_SHIFT)
+#define HV_COMP_MAGIC		0x504d4f43534c4d4dULL	/* "MMLSCOMP" */
+
+/* Table entry: slot in the high half, stored length in the low half */
+#define HV_COMP_ENT(slot, len)	(((u64)(slot) << 32) | (len))
+#define HV_COMP_ENT_SLOT(e)	((u32)((e) >> 32))
+#define HV_COMP_ENT_LEN(e)	((u32)(e))
+
+/* Entry found damaged at load; reads fail until the chunk is rewritten */
+#define HV_COMP_ENT_BAD		HV_COMP_ENT(0, U32_MAX)
+
+struct hv_comp_hdr {
+	u64 magic;
+	u64 chunk_size;
+	u64 nchunks;
+	u64 reserved;
+};
+
+struct hv_comp {
+	struct hv_comp_hdr *hdr;	/* start of physical area */
+	u64 *table;			/* follows hdr */
+	u64 nchunks;
+	u64 data_off;			/* physical offset of slot 0 */
+	u32 nslots;
+	u32 hint;			/* next-fit search start */
+	unsigned long *used;		/* slot bitmap, rebuilt at load */
+
+	/* Scratch buffers, serialized by cmutex */
+	void *wrkmem;
+	u8 *raw;			/* one chunk, uncompressed */
+	u8 *cbuf;			/* HV_COMP_BOUND bytes */
+
+	struct hv_mmls_comp_stats stats;
+};
+
+static u32 hv_comp_nslots(u32 len)
+{
+	return DIV_ROUND_UP(len, HV_COMP_SLOT);
+}
+
+static void *hv_comp_slot_addr(hv_cdev_private *priv, u32 slot)
+{
+	return hv_cdev_vaddr(priv, priv->comp->data_off +
+			((u64)slot << HV_COMP_SLOT_SHIFT));
+}
+
+static int hv_comp_alloc(struct hv_comp *c, u32 n, u32 *slot)
+{
+	unsigned long s;
+
+	s = bitmap_find_next_zero_area(c->used, c->nslots, c->hint, n, 0);
+	if (s >= c->nslots)
+		s = bitmap_find_next_zero_area(c->used, c->nslots, 0, n, 0);
+	if (s >= c->nslots)
+		return -ENOSPC;
+
+	bitmap_set(c->used, s, n);
+	c->hint = s + n;
+	c->stats.used_bytes += (u64)n << HV_COMP_SLOT_SHIFT;
+	*slot = s;
+
+	return 0;
+}
+
+static void hv_comp_release(struct hv_comp *c, u64 ent)
+{
+	u32 n = hv_comp_nslots(HV_COMP_ENT_LEN(ent));
+
+	if (!n || HV_COMP_ENT_LEN(ent) > HV_COMP_CHUNK)
+		return;
+
+	bitmap_clear(c->used, HV_COMP_ENT_SLOT(ent), n);
+	c->stats.used_bytes -= (u64)n << HV_COMP_SLOT_SHIFT;
+}
+
+/* Switch a table entry once its data is durable */
+static void hv_comp_set_ent(hv_cdev_private *priv, u64 chunk, u64 ent)
+{
+	struct hv_comp *c = priv->comp;
+
+	WRITE_ONCE(c->table[chunk], ent);
+	clflush_cache_range(&c->table[chunk], sizeof(u64));
+	wmb();
+	hv_cdev_backend_write(priv, (u8 *)&c->table[chunk] - (u8 *)c->hdr,
+			sizeof(u64));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define HV_COMP_BOUND	LZ4_compressBound(HV_COMP_CHUNK)
+
+/* Stored length, or 0 if it does not fit in dlen */
+static u32 hv_lz4_compress(const u8 *src, u8 *dst, u32 dlen, void *wrkmem)
+{
+	return LZ4_compress_default((const char *)src, (char *)dst,
+			HV_COMP_CHUNK, dlen, wrkmem);
+}
+
+static int hv_lz4_decompress(const u8 *src, u32 slen, u8 *dst)
+{
+	return LZ4_decompress_safe((const char *)src, (char *)dst, slen,
+			HV_COMP_CHUNK);
+}
+#else
+#define HV_COMP_BOUND	lz4_compressbound(HV_COMP_CHUNK)
+
+static u32 hv_lz4_compress(const u8 *src, u8 *dst, u32 dlen, void *wrkmem)
+{
+	size_t len = dlen;
+
+	if (lz4_compress(src, HV_COMP_CHUNK, dst, &len, wrkmem) || len > dlen)
+		return 0;
+
+	return len;
+}
+
+static int hv_lz4_decompress(const u8 *src, u32 slen, u8 *dst)
+{
+	size_t len = HV_COMP_CHUNK;
+
+	if (lz4_decompress_unknownoutputsize(src, slen, dst, &len))
+		return -1;
+
+	return len;
+}
+#endif
+
+/* Load chunk into c->raw. Called with cmutex held. */
+static int hv_comp_load(hv_cdev_private *priv, u64 chunk)
+{
+	struct hv_comp *c = priv->comp;
+	u64 ent = READ_ONCE(c->table[chunk]);
+	u32 len = HV_COMP_ENT_LEN(ent);
+	void *src;
+	u64 t0;
+	int res;
+
+	if (!len) {
+		memset(c->raw, 0, HV_COMP_CHUNK);
+		return 0;
+	}
+
+	if (len > HV_COMP_CHUNK) {
+		PERR("%s: chunk %llu has a bad table entry\n", __func__, chunk);
+		return -EIO;
+	}
+
+	hv_cdev_backend_read(priv, c->data_off +
+			((u64)HV_COMP_ENT_SLOT(ent) << HV_COMP_SLOT_SHIFT), len);
+	src = hv_comp_slot_addr(priv, HV_COMP_ENT_SLOT(ent));
+
+	if (len == HV_COMP_CHUNK) {
+		memcpy(c->raw, src, HV_COMP_CHUNK);
+		return 0;
+	}
+
+	t0 = ktime_get_ns();
+	res = hv_lz4_decompress(src, len, c->raw);
+	c->stats.decompress_ns += ktime_get_ns() - t0;
+
+	if (res != HV_COMP_CHUNK) {
+		PERR("%s: chunk %llu is corrupt, res=%d\n", __func__, chunk, res);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Compress c->raw and store it as chunk. Called with cmutex held. */
+static int hv_comp_store(hv_cdev_private *priv, u64 chunk)
+{
+	struct hv_comp *c = priv->comp;
+	u64 old = READ_ONCE(c->table[chunk]);
+	const u8 *src = c->cbuf;
+	u32 slot, len;
+	u64 t0;
+	int res;
+
+	t0 = ktime_get_ns();
+	len = hv_lz4_compress(c->raw, c->cbuf, HV_COMP_BOUND, c->wrkmem);
+	c->stats.compress_ns += ktime_get_ns() - t0;
+
+	/* Not worth it unless at least one slot is saved */
+	if (!len || hv_comp_nslots(len) >= hv_comp_nslots(HV_COMP_CHUNK)) {
+		len = HV_COMP_CHUNK;
+		src = c->raw;
+		c->stats.raw_chunks++;
+	}
+
+	res = hv_comp_alloc(c, hv_comp_nslots(len), &slot);
+	if (res)
+		return res;
+
+	hv_cdev_memcpy_nt(hv_comp_slot_addr(priv, slot), src, len);
+	wmb();
+	hv_cdev_backend_write(priv, c->data_off +
+			((u64)slot << HV_COMP_SLOT_SHIFT), len);
+
+	hv_comp_set_ent(priv, chunk, HV_COMP_ENT(slot, len));
+	hv_comp_release(c, old);
+
+	c->stats.logical_bytes += HV_COMP_CHUNK;
+	c->stats.stored_bytes += len;
+
+	return 0;
+}
+
+int hv_comp_read(hv_cdev_private *priv, char __user *ubuff, u64 pos,
+		size_t count)
+{
+	struct hv_comp *c = priv->comp;
+	u64 chunk, in;
+	size_t n;
+	int res;
+
+	while (count) {
+		chunk = pos / HV_COMP_CHUNK;
+		in = pos % HV_COMP_CHUNK;
+		n = min_t(u64, count, HV_COMP_CHUNK - in);
+
+		res = hv_comp_load(priv, chunk);
+		if (res)
+			return res;
+
+		if (copy_to_user(ubuff, c->raw + in, n))
+			return -EFAULT;
+
+		ubuff += n;
+		pos += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int hv_comp_write(hv_cdev_private *priv, u64 pos, const char __user *ubuff,
+		size_t count)
+{
+	struct hv_comp *c = priv->comp;
+	u64 chunk, in;
+	size_t n;
+	int res;
+
+	while (count) {
+		chunk = pos / HV_COMP_CHUNK;
+		in = pos % HV_COMP_CHUNK;
+		n = min_t(u64, count, HV_COMP_CHUNK - in);
+
+		/* Partial chunk: merge with what is stored */
+		if (n != HV_COMP_CHUNK) {
+			res = hv_comp_load(priv, chunk);
+			if (res)
+				return res;
+		}
+
+		if (copy_from_user(c->raw + in, ubuff, n))
+			return -EFAULT;
+
+		res = hv_comp_store(priv, chunk);
+		if (res)
+			return res;
+
+		ubuff += n;
+		pos += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+void hv_comp_get_stats(hv_cdev_private *priv, struct hv_mmls_comp_stats *st)
+{
+	*st = priv->comp->stats;
+	st->physical_bytes = (u64)priv->comp->nslots << HV_COMP_SLOT_SHIFT;
+}
+
+/*
+ * An entry from the device is only trusted if its length fits a chunk
+ * and its slots lie inside the slot area, clear of earlier entries
+ */
+static bool hv_comp_ent_ok(struct hv_comp *c, u64 ent)
+{
+	u32 len = HV_COMP_ENT_LEN(ent);
+	u64 slot = HV_COMP_ENT_SLOT(ent);
+	u64 n = hv_comp_nslots(len);
+
+	if (len > HV_COMP_CHUNK || slot + n > c->nslots)
+		return false;
+
+	return find_next_bit(c->used, slot + n, slot) >= slot + n;
+}
+
+/* Format an empty table, or rebuild the slot bitmap from an existing one */
+static void hv_comp_load_table(hv_cdev_private *priv)
+{
+	struct hv_comp *c = priv->comp;
+	u64 i, ent, bad = 0;
+
+	if (c->hdr->magic == HV_COMP_MAGIC &&
+	    c->hdr->chunk_size == HV_COMP_CHUNK &&
+	    c->hdr->nchunks == c->nchunks) {
+		for (i = 0; i < c->nchunks; i++) {
+			ent = c->table[i];
+			if (!HV_COMP_ENT_LEN(ent))
+				continue;
+			if (ent == HV_COMP_ENT_BAD) {
+				bad++;
+				continue;
+			}
+			if (!hv_comp_ent_ok(c, ent)) {
+				PERR("%s: chunk %llu has a bad table entry\n",
+					__func__, i);
+				hv_comp_set_ent(priv, i, HV_COMP_ENT_BAD);
+				bad++;
+				continue;
+			}
+			bitmap_set(c->used, HV_COMP_ENT_SLOT(ent),
+				hv_comp_nslots(HV_COMP_ENT_LEN(ent)));
+		}
+		c->stats.used_bytes =
+			(u64)bitmap_weight(c->used, c->nslots) << HV_COMP_SLOT_SHIFT;
+		PINFO("%s: existing table, %llu bytes in use, %llu bad chunks\n",
+			__func__, c->stats.used_bytes, bad);
+		return;
+	}
+
+	memset(c->table, 0, c->nchunks * sizeof(u64));
+	c->hdr->chunk_size = HV_COMP_CHUNK;
+	c->hdr->nchunks = c->nchunks;
+	clflush_cache_range(c->hdr, c->data_off);
+	wmb();
+	c->hdr->magic = HV_COMP_MAGIC;
+	clflush_cache_range(c->hdr, sizeof(*c->hdr));
+	wmb();
+	hv_cdev_backend_write(priv, 0, c->data_off);
+
+	PINFO("%s: formatted new table\n", __func__);
+}
+
+/*
+ * Called at init before anything else looks at dev_size. On success
+ * dev_size becomes the logical size.
+ */
+int hv_comp_init(hv_cdev_private *priv)
+{
+	struct hv_comp *c;
+	u64 phys = priv->dev_size;
+	u64 logical = phys * max(hv_comp_factor, 1U);
+
+	if (!hv_compress || use_static_buff)
+		return 0;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	c->nchunks = logical / HV_COMP_CHUNK;
+	c->data_off = round_up(sizeof(struct hv_comp_hdr) +
+			c->nchunks * sizeof(u64), PAGE_SIZE);
+	if (c->data_off >= phys) {
+		kfree(c);
+		return -EINVAL;
+	}
+	c->nslots = (phys - c->data_off) >> HV_COMP_SLOT_SHIFT;
+
+	c->used = vzalloc(BITS_TO_LONGS(c->nslots) * sizeof(long));
+	c->wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	c->raw = kmalloc(HV_COMP_CHUNK, GFP_KERNEL);
+	c->cbuf = kmalloc(HV_COMP_BOUND, GFP_KERNEL);
+	if (!c->used || !c->wrkmem || !c->raw || !c->cbuf) {
+		priv->comp = c;
+		hv_comp_exit(priv);
+		return -ENOMEM;
+	}
+
+	c->hdr = hv_cdev_vaddr(priv, 0);
+	c->table = (u64 *)(c->hdr + 1);
+	priv->comp = c;
+
+	hv_cdev_backend_read(priv, 0, c->data_off);
+	hv_comp_load_table(priv);
+
+	priv->dev_size = c->nchunks * HV_COMP_CHUNK;
+
+	PINFO("%s: %llu logical bytes over %llu physical, chunk %u\n",
+		__func__, priv->dev_size, phys, (unsigned int)HV_COMP_CHUNK);
+
+	return 0;
+}
+
+void hv_comp_exit(hv_cdev_private *priv)
+{
+	struct hv_comp *c = priv->comp;
+
+	if (!c)
+		return;
+
+	vfree(c->used);
+	vfree(c->wrkmem);
+	kfree(c->raw);
+	kfree(c->cbuf);
+	kfree(c);
+	priv->comp = NULL;
+}
@@ -0,0 +1,206 @@
+/*
+ *
+ *  End-to-end checksums for data moving through the hv char driver.
+ *
+ *  With hv_csum=1 every HV_BLOCK_SIZE block of the device has a crc32c
+ *  in a side table. Writes copy one block at a time and checksum it
+ *  while it is still in cache; reads verify a block and then copy it
+ *  out of cache, so the slow memory is only touched once per block.
+ *  crc32c() goes through the crypto API and uses the SSE4.2 crc32
+ *  instruction when crc32c-intel is available.
+ *
+ *  write(), the device-side ops and transactions keep the table current,
+ *  but stores through mmap() would not, so only read-only mappings are
+ *  allowed while checksums are on; a writable one fails with -EACCES. A read that finds a block not matching its
+ *  checksum fails with -EIO and is counted in csum_errors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cmd.h"
+#include <linux/crc32c.h>
+#include <linux/vmalloc.h>
+
+static bool hv_csum;
+module_param(hv_csum, bool, S_IRUGO);
+MODULE_PARM_DESC(hv_csum, "Keep a crc32c per block, verified on read (default 0)");
+
+#define HV_CSUM_BLOCK		HV_BLOCK_SIZE
+#define HV_CSUM_SEED		(~0U)
+
+/* The last block may be cut short by dev_size */
+static u64 hv_csum_block_len(hv_cdev_private *priv, u64 blk)
+{
+	return min_t(u64, HV_CSUM_BLOCK, priv->dev_size - blk * HV_CSUM_BLOCK);
+}
+
+static u32 hv_csum_block(hv_cdev_private *priv, u64 blk)
+{
+	return crc32c(HV_CSUM_SEED, hv_cdev_vaddr(priv, blk * HV_CSUM_BLOCK),
+			hv_csum_block_len(priv, blk));
+}
+
+/* Recompute the checksum of every block overlapping [off, off + len) */
+void hv_csum_update(hv_cdev_private *priv, u64 off, u64 len)
+{
+	u64 blk, last;
+
+	if (!priv->csum || !len)
+		return;
+
+	last = (off + len - 1) / HV_CSUM_BLOCK;
+	for (blk = off / HV_CSUM_BLOCK; blk <= last; blk++)
+		priv->csum[blk] = hv_csum_block(priv, blk);
+}
+
+/* Verify every block overlapping [off, off + len) */
+int hv_csum_verify(hv_cdev_private *priv, u64 off, u64 len)
+{
+	u64 blk, last;
+	u32 crc;
+
+	if (!priv->csum || !len)
+		return 0;
+
+	last = (off + len - 1) / HV_CSUM_BLOCK;
+	for (blk = off / HV_CSUM_BLOCK; blk <= last; blk++) {
+		crc = hv_csum_block(priv, blk);
+		if (crc != priv->csum[blk]) {
+			PERR("%s: block %llu crc 0x%08x, expected 0x%08x\n",
+				__func__, blk, crc, priv->csum[blk]);
+			atomic64_inc(&priv->csum_errors);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/* Length from off to the end of its block, capped at len */
+u64 hv_csum_step(u64 off, u64 len)
+{
+	return min_t(u64, len, HV_CSUM_BLOCK - (off % HV_CSUM_BLOCK));
+}
+
+/*
+ * read() path: verify each block, then copy it to user while it is
+ * still in cache. Returns 0, -EIO or -EFAULT.
+ */
+int hv_csum_copy_to_user(hv_cdev_private *priv, char __user *ubuff,
+		u64 off, size_t count)
+{
+	u64 n;
+	int res;
+
+	while (count) {
+		n = hv_csum_step(off, count);
+
+		res = hv_csum_verify(priv, off, n);
+		if (res)
+			return res;
+
+		if (copy_to_user(ubuff, hv_cdev_vaddr(priv, off), n))
+			return -EFAULT;
+
+		ubuff += n;
+		off += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * write() path: copy each block through the cache, checksum it and
+ * then flush it out. Returns 0 or -EFAULT.
+ */
+int hv_csum_copy_from_user(hv_cdev_private *priv, u64 off,
+		const char __user *ubuff, size_t count)
+{
+	u64 n, blk;
+
+	while (count) {
+		n = hv_csum_step(off, count);
+
+		if (__copy_from_user(hv_cdev_vaddr(priv, off), ubuff, n))
+			return -EFAULT;
+
+		hv_csum_update(priv, off, n);
+
+		blk = off / HV_CSUM_BLOCK;
+		clflush_cache_range(hv_cdev_vaddr(priv, blk * HV_CSUM_BLOCK),
+				hv_csum_block_len(priv, blk));
+
+		ubuff += n;
+		off += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* Copy nblocks checksums starting at the block of off to user */
+int hv_csum_get(hv_cdev_private *priv, u64 off, u64 nblocks,
+		u32 __user *table)
+{
+	u64 first = off / HV_CSUM_BLOCK;
+	u64 total = DIV_ROUND_UP(priv->dev_size, HV_CSUM_BLOCK);
+
+	if (!priv->csum)
+		return -EOPNOTSUPP;
+
+	if (first >= total)
+		return -EINVAL;
+
+	if (nblocks > total - first)
+		nblocks = total - first;
+
+	if (copy_to_user(table, priv->csum + first, nblocks * sizeof(u32)))
+		return -EFAULT;
+
+	return 0;
+}
+
+int hv_csum_init(hv_cdev_private *priv)
+{
+	u64 nblocks = DIV_ROUND_UP(priv->dev_size, HV_CSUM_BLOCK);
+
+	if (!hv_csum)
+		return 0;
+
+	/* Blocks are stored compressed; LZ4 already rejects corrupt ones */
+	if (priv->comp) {
+		PERR("%s: not available in compressed mode\n", __func__);
+		return 0;
+	}
+
+	priv->csum = vzalloc(nblocks * sizeof(u32));
+	if (!priv->csum) {
+		PERR("%s: no memory for %llu checksums\n", __func__, nblocks);
+		return -ENOMEM;
+	}
+
+	atomic64_set(&priv->csum_errors, 0);
+
+	/* Seeded from current contents by the pass in hv_cdev_scrub.c */
+
+	PINFO("%s: %llu blocks of %u bytes\n", __func__, nblocks,
+		(unsigned int)HV_CSUM_BLOCK);
+
+	return 0;
+}
+
+void hv_csum_exit(hv_cdev_private *priv)
+{
+	vfree(priv->csum);
+	priv->csum = NULL;
+}
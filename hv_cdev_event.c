@@ -0,0 +1,275 @@
+/*
+ *
+ *  Asynchronous operations and completion notification.
+ *
+ *  HV_MMLS_ASYNC queues a flush, fill or copy to run in the background
+ *  and returns at once. When it finishes, a completion record (the
+ *  caller's tag and the result) is queued on the file and the file is
+ *  signalled three ways: poll()/epoll() reports POLLIN, the eventfd
+ *  registered with HV_MMLS_SET_EVENTFD is bumped, and SIGIO is sent to
+ *  fasync owners. HV_MMLS_GET_EVENT pops the records.
+ *
+ *  A file may have at most HV_EVENT_DEPTH operations queued or
+ *  unread, so a completion record is never dropped. A queued op holds
+ *  the arena extents it works on until it completes.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cdev_uapi.h"
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+
+struct hv_async_req {
+	struct work_struct work;
+	hv_cdev_file *hfile;
+	struct hv_mmls_async args;
+};
+
+void hv_event_open(hv_cdev_file *hfile)
+{
+	init_waitqueue_head(&hfile->event_wq);
+	spin_lock_init(&hfile->event_lock);
+	INIT_KFIFO(hfile->events);
+	atomic_set(&hfile->async_inflight, 0);
+}
+
+void hv_event_release(struct file *filp)
+{
+	hv_cdev_file *hfile = filp->private_data;
+
+	/* Queued work still points at the file */
+	wait_event(hfile->event_wq, !atomic_read(&hfile->async_inflight));
+
+	/* The last worker may still be inside hv_async_put(); wait it out */
+	spin_lock_irq(&hfile->event_lock);
+	spin_unlock_irq(&hfile->event_lock);
+
+	if (hfile->evfd)
+		eventfd_ctx_put(hfile->evfd);
+	hfile->evfd = NULL;
+
+	fasync_helper(-1, filp, 0, &hfile->fasync);
+}
+
+static void hv_event_complete(hv_cdev_file *hfile, struct hv_mmls_event *ev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hfile->event_lock, flags);
+
+	kfifo_put(&hfile->events, *ev);
+
+	if (hfile->evfd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(hfile->evfd);
+#else
+		eventfd_signal(hfile->evfd, 1);
+#endif
+	}
+
+	spin_unlock_irqrestore(&hfile->event_lock, flags);
+
+	wake_up_interruptible(&hfile->event_wq);
+	kill_fasync(&hfile->fasync, SIGIO, POLL_IN);
+}
+
+/*
+ * Drop one in-flight op. The count and the wake-up change together
+ * under event_lock, which hv_event_release() takes before the file
+ * can be freed, so nothing here touches a freed hfile.
+ */
+static void hv_async_put(hv_cdev_file *hfile)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hfile->event_lock, flags);
+	if (atomic_dec_and_test(&hfile->async_inflight))
+		wake_up(&hfile->event_wq);
+	spin_unlock_irqrestore(&hfile->event_lock, flags);
+}
+
+/* Hold or release the arena extents an op works on */
+static int hv_async_hold(hv_cdev_file *hfile, const struct hv_mmls_async *a,
+		bool get)
+{
+	int res;
+
+	switch (a->op) {
+	case HV_MMLS_ASYNC_FLUSH:
+		if (!get) {
+			hv_arena_put(hfile, a->range.offset, a->range.size);
+			return 0;
+		}
+		return hv_arena_get(hfile, a->range.offset, a->range.size);
+
+	case HV_MMLS_ASYNC_FILL:
+		if (!get) {
+			hv_arena_put(hfile, a->fill.offset, a->fill.size);
+			return 0;
+		}
+		return hv_arena_get(hfile, a->fill.offset, a->fill.size);
+
+	case HV_MMLS_ASYNC_COPY:
+		if (!get) {
+			hv_arena_put(hfile, a->copy.src, a->copy.size);
+			hv_arena_put(hfile, a->copy.dst, a->copy.size);
+			return 0;
+		}
+		res = hv_arena_get(hfile, a->copy.src, a->copy.size);
+		if (res)
+			return res;
+		res = hv_arena_get(hfile, a->copy.dst, a->copy.size);
+		if (res)
+			hv_arena_put(hfile, a->copy.src, a->copy.size);
+		return res;
+	}
+
+	return -EINVAL;
+}
+
+static void hv_async_work_fn(struct work_struct *work)
+{
+	struct hv_async_req *req = container_of(work, struct hv_async_req, work);
+	hv_cdev_file *hfile = req->hfile;
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_mmls_async *a = &req->args;
+	struct hv_mmls_event ev;
+
+	ev.tag = a->tag;
+	ev.op = a->op;
+
+	mutex_lock(&priv->cmutex);
+
+	switch (a->op) {
+	case HV_MMLS_ASYNC_FLUSH:
+		hv_cdev_flush(priv, a->range.offset, a->range.size);
+		ev.result = 0;
+		break;
+
+	case HV_MMLS_ASYNC_FILL:
+		ev.result = hv_ops_fill(priv, a->fill.offset, a->fill.size,
+				a->fill.pattern);
+		break;
+
+	case HV_MMLS_ASYNC_COPY:
+		ev.result = hv_ops_copy(priv, a->copy.src, a->copy.dst,
+				a->copy.size);
+		break;
+
+	default:
+		ev.result = -EINVAL;
+		break;
+	}
+
+	mutex_unlock(&priv->cmutex);
+
+	hv_async_hold(hfile, a, false);
+
+	/* Record first, so a poller woken for it always finds it */
+	hv_event_complete(hfile, &ev);
+
+	kfree(req);
+
+	hv_async_put(hfile);
+}
+
+/* Ranges in args were checked by the caller */
+int hv_async_submit(hv_cdev_file *hfile, const struct hv_mmls_async *args)
+{
+	struct hv_async_req *req;
+	unsigned int used;
+	int res;
+
+	used = atomic_inc_return(&hfile->async_inflight) +
+		kfifo_len(&hfile->events);
+	if (used > HV_EVENT_DEPTH) {
+		hv_async_put(hfile);
+		return -EBUSY;
+	}
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req) {
+		hv_async_put(hfile);
+		return -ENOMEM;
+	}
+
+	/* HV_MMLS_FREE of the extents waits until the op is done */
+	res = hv_async_hold(hfile, args, true);
+	if (res) {
+		kfree(req);
+		hv_async_put(hfile);
+		return res;
+	}
+
+	req->hfile = hfile;
+	req->args = *args;
+	INIT_WORK(&req->work, hv_async_work_fn);
+
+	queue_work(system_unbound_wq, &req->work);
+
+	return 0;
+}
+
+/* Pop one completion record, -EAGAIN if there is none */
+int hv_event_get(hv_cdev_file *hfile, struct hv_mmls_event *ev)
+{
+	unsigned long flags;
+	int n;
+
+	spin_lock_irqsave(&hfile->event_lock, flags);
+	n = kfifo_get(&hfile->events, ev);
+	spin_unlock_irqrestore(&hfile->event_lock, flags);
+
+	return n ? 0 : -EAGAIN;
+}
+
+/* fd < 0 unregisters */
+int hv_event_set_eventfd(hv_cdev_file *hfile, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irqsave(&hfile->event_lock, flags);
+	old = hfile->evfd;
+	hfile->evfd = ctx;
+	spin_unlock_irqrestore(&hfile->event_lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/*
+ * read() and write() never block on this device, so POLLOUT is always
+ * set and POLLIN means completion records are waiting.
+ */
+unsigned int hv_event_poll(struct file *filp, poll_table *wait)
+{
+	hv_cdev_file *hfile = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(filp, &hfile->event_wq, wait);
+
+	if (!kfifo_is_empty(&hfile->events))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
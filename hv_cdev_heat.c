@@ -0,0 +1,329 @@
+/*
+ *
+ *  Access heat tracking.
+ *
+ *  With hv_heat=1 the device is split into hv_heat_region_kb regions,
+ *  each with two counters: read()/write() calls that touched it, and
+ *  page faults taken in it through mmap(). Every hv_heat_interval_ms
+ *  the counters are halved, so they follow recent access frequency.
+ *
+ *  Mappings are filled in page by page on fault instead of up front.
+ *  Each interval the next hv_heat_scan_mb of the device is unmapped
+ *  from every process, so pages still in use fault again and are
+ *  counted; this is the sampling NUMA balancing does with its hinting
+ *  faults, and it costs one minor fault per page per pass. Every open
+ *  file of the device shares one address_space, as /dev/mem does, so
+ *  the pass reaches mappings made through any device node, hv_pgmap
+ *  ones included.
+ *
+ *  HV_MMLS_HEAT returns a read-only fd; mmap() of it gives the table,
+ *  struct hv_mmls_heat_hdr followed by the regions, updated in place.
+ *  userspace_app/hv_tierd.c is a tiering daemon built on it.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/anon_inodes.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static bool hv_heat;
+module_param(hv_heat, bool, S_IRUGO);
+MODULE_PARM_DESC(hv_heat, "Track access heat per region (default 0)");
+
+static unsigned int hv_heat_region_kb = 2048;
+module_param(hv_heat_region_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(hv_heat_region_kb, "Heat region size in KB, rounded up to a power of 2");
+
+static unsigned int hv_heat_interval_ms = 1000;
+module_param(hv_heat_interval_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_heat_interval_ms, "Time between decay and mmap sampling passes (ms)");
+
+static unsigned int hv_heat_scan_mb = 256;
+module_param(hv_heat_scan_mb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_heat_scan_mb, "Mapped range unmapped per pass to sample mmap access, 0 = off");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+
+struct hv_heat {
+	struct hv_mmls_heat_hdr *hdr;	/* vmalloc_user, mapped by heat fds */
+	struct hv_mmls_heat_region *regions;
+	unsigned long size;		/* bytes, page aligned */
+	struct inode *inode;		/* its i_mapping is every file's f_mapping */
+	u64 scan_pos;
+	struct delayed_work work;
+};
+
+static inline struct hv_mmls_heat_region *hv_heat_region(struct hv_heat *h,
+		u64 off)
+{
+	return &h->regions[off >> h->hdr->region_shift];
+}
+
+/* Lost increments between CPUs are fine for a sampled counter */
+static inline void hv_heat_inc(u32 *count)
+{
+	u32 v = READ_ONCE(*count);
+
+	if (v != U32_MAX)
+		WRITE_ONCE(*count, v + 1);
+}
+
+/* Called for each read()/write() slice, offsets already checked */
+void hv_heat_io(hv_cdev_private *priv, u64 off, u64 len)
+{
+	struct hv_heat *h = priv->heat;
+	unsigned int shift;
+	u64 r, last;
+
+	if (!h || !len)
+		return;
+
+	shift = h->hdr->region_shift;
+	last = (off + len - 1) >> shift;
+	for (r = off >> shift; r <= last; r++)
+		hv_heat_inc(&h->regions[r].io);
+}
+
+void hv_heat_fault(hv_cdev_private *priv, u64 off)
+{
+	struct hv_heat *h = priv->heat;
+
+	if (h)
+		hv_heat_inc(&hv_heat_region(h, off)->map);
+}
+
+static vm_fault_t hv_heat_vm_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	hv_cdev_file *hfile = vma->vm_file->private_data;
+	hv_cdev_private *priv = hfile->priv;
+	u64 off = (u64)vmf->pgoff << PAGE_SHIFT;
+
+	if (off >= priv->dev_size)
+		return VM_FAULT_SIGBUS;
+
+	hv_heat_fault(priv, off);
+
+	return vmf_insert_pfn(vma, vmf->address,
+			PHYS_PFN(priv->phys_start + off));
+}
+
+static const struct vm_operations_struct hv_heat_vm_ops = {
+	.open = hv_cdev_vm_open,
+	.close = hv_cdev_vm_close,
+	.fault = hv_heat_vm_fault,
+};
+
+/* Called from hv_cdev_open(), before the file can be mapped */
+void hv_heat_open(hv_cdev_private *priv, struct file *filp)
+{
+	struct hv_heat *h = priv->heat;
+	struct inode *inode;
+
+	if (!h)
+		return;
+
+	/* The first opener's inode stands in for the device */
+	if (!READ_ONCE(h->inode)) {
+		inode = igrab(file_inode(filp));
+		if (inode && cmpxchg(&h->inode, NULL, inode))
+			iput(inode);
+	}
+
+	/* The sampling pass unmaps through this one address_space */
+	inode = READ_ONCE(h->inode);
+	if (inode)
+		filp->f_mapping = inode->i_mapping;
+}
+
+/* Called from hv_cdev_mmap() in place of remap_pfn_range() */
+int hv_heat_mmap(hv_cdev_private *priv, struct vm_area_struct *vma)
+{
+	vma->vm_ops = &hv_heat_vm_ops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+	return 0;
+}
+
+static void hv_heat_work(struct work_struct *work)
+{
+	struct hv_heat *h = container_of(to_delayed_work(work),
+			struct hv_heat, work);
+	struct inode *inode = READ_ONCE(h->inode);
+	u64 nregions = h->hdr->nregions;
+	u64 dev_size = nregions << h->hdr->region_shift;
+	u64 i, span;
+
+	/* Halve, so the counts weigh recent intervals most */
+	for (i = 0; i < nregions; i++) {
+		struct hv_mmls_heat_region *r = &h->regions[i];
+
+		WRITE_ONCE(r->io, READ_ONCE(r->io) >> 1);
+		WRITE_ONCE(r->map, READ_ONCE(r->map) >> 1);
+
+		if (!(i & 0xffff))
+			cond_resched();
+	}
+
+	smp_wmb();
+	WRITE_ONCE(h->hdr->epoch, h->hdr->epoch + 1);
+	WRITE_ONCE(h->hdr->interval_ms, hv_heat_interval_ms);
+
+	/* Drop the next window's PTEs; pages in use fault back in */
+	span = (u64)READ_ONCE(hv_heat_scan_mb) << 20;
+	if (inode && span) {
+		if (h->scan_pos >= dev_size)
+			h->scan_pos = 0;
+		span = min(span, dev_size - h->scan_pos);
+		unmap_mapping_range(inode->i_mapping, h->scan_pos, span, 0);
+		h->scan_pos += span;
+	}
+
+	schedule_delayed_work(&h->work,
+		msecs_to_jiffies(max(READ_ONCE(hv_heat_interval_ms), 10U)));
+}
+
+static int hv_heat_fd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct hv_heat *h = filp->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, h->hdr, vma->vm_pgoff);
+}
+
+static const struct file_operations hv_heat_fops = {
+	.owner		= THIS_MODULE,
+	.mmap		= hv_heat_fd_mmap,
+};
+
+/* Returns a read-only fd whose mmap() is the heat table */
+int hv_heat_get_fd(hv_cdev_private *priv)
+{
+	if (!priv->heat)
+		return -EOPNOTSUPP;
+
+	/* The table is freed at module exit, which this fd's mappings hold off */
+	return anon_inode_getfd("[hv_heat]", &hv_heat_fops, priv->heat,
+			O_RDONLY | O_CLOEXEC);
+}
+
+int hv_heat_init(hv_cdev_private *priv)
+{
+	struct hv_heat *h;
+	unsigned int shift;
+	u64 nregions;
+
+	if (!hv_heat)
+		return 0;
+
+	shift = max_t(unsigned int, PAGE_SHIFT,
+		order_base_2((u64)max(hv_heat_region_kb, 1U) << 10));
+	nregions = DIV_ROUND_UP(priv->dev_size, 1ULL << shift);
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return -ENOMEM;
+
+	h->size = PAGE_ALIGN(sizeof(*h->hdr) + nregions * sizeof(*h->regions));
+	h->hdr = vmalloc_user(h->size);
+	if (!h->hdr) {
+		kfree(h);
+		return -ENOMEM;
+	}
+
+	h->regions = (struct hv_mmls_heat_region *)(h->hdr + 1);
+	h->hdr->magic = HV_MMLS_HEAT_MAGIC;
+	h->hdr->version = 1;
+	h->hdr->region_shift = shift;
+	h->hdr->nregions = nregions;
+	h->hdr->interval_ms = hv_heat_interval_ms;
+
+	INIT_DELAYED_WORK(&h->work, hv_heat_work);
+	priv->heat = h;
+	schedule_delayed_work(&h->work,
+		msecs_to_jiffies(max(hv_heat_interval_ms, 10U)));
+
+	PINFO("%s: %llu regions of %u KB\n", __func__, nregions,
+		1U << (shift - 10));
+
+	return 0;
+}
+
+void hv_heat_exit(hv_cdev_private *priv)
+{
+	struct hv_heat *h = priv->heat;
+
+	if (!h)
+		return;
+
+	cancel_delayed_work_sync(&h->work);
+	if (h->inode)
+		iput(h->inode);
+	vfree(h->hdr);
+	kfree(h);
+	priv->heat = NULL;
+}
+
+#else
+
+void hv_heat_io(hv_cdev_private *priv, u64 off, u64 len)
+{
+}
+
+void hv_heat_open(hv_cdev_private *priv, struct file *filp)
+{
+}
+
+void hv_heat_fault(hv_cdev_private *priv, u64 off)
+{
+}
+
+int hv_heat_mmap(hv_cdev_private *priv, struct vm_area_struct *vma)
+{
+	return -EOPNOTSUPP;
+}
+
+int hv_heat_get_fd(hv_cdev_private *priv)
+{
+	return -EOPNOTSUPP;
+}
+
+int hv_heat_init(hv_cdev_private *priv)
+{
+	if (hv_heat)
+		PERR("%s: needs Linux 4.17 or later\n", __func__);
+
+	return 0;
+}
+
+void hv_heat_exit(hv_cdev_private *priv)
+{
+}
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ *
+ *  Device-side fill, copy, checksum and compare.
+ *
+ *  These back the HV_MMLS_FILL/COPY/CRC/COMPARE ioctls so user space
+ *  can initialize, move and verify device data without moving it
+ *  across the user/kernel boundary. Writes use non-temporal copies and
+ *  large ranges are spread across CPUs with hv_par_run().
+ *  Callers hold cmutex and have checked the ranges.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cdev_uapi.h"
+#include <linux/crc32c.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/* Unit of work between cond_resched() calls */
+#define HV_OPS_STEP	(64 * 1024)
+
+struct hv_fill_ctx {
+	hv_cdev_private *priv;
+	u64 start;		/* fill start, for pattern phase */
+	u8 *pat;		/* PAGE_SIZE + 8 bytes of pattern */
+};
+
+static int hv_fill_fn(void *data, u64 off, u64 len)
+{
+	struct hv_fill_ctx *ctx = data;
+	u8 *dst = hv_cdev_vaddr(ctx->priv, off);
+	const u8 *src = ctx->pat + ((off - ctx->start) & 7);
+	u64 start = off, total = len;
+	size_t n;
+
+	/* Steps are a multiple of 8 so the phase stays put */
+	while (len) {
+		n = min_t(u64, len, PAGE_SIZE);
+		hv_cdev_memcpy_nt(dst, src, n);
+		dst += n;
+		len -= n;
+		cond_resched();
+	}
+
+	hv_csum_update(ctx->priv, start, total);
+
+	return 0;
+}
+
+int hv_ops_fill(hv_cdev_private *priv, u64 off, u64 size, u64 pattern)
+{
+	struct hv_fill_ctx ctx;
+	unsigned int i;
+	int res;
+
+	ctx.pat = kmalloc(PAGE_SIZE + sizeof(u64), GFP_KERNEL);
+	if (!ctx.pat)
+		return -ENOMEM;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(u64) + 1; i++)
+		memcpy(ctx.pat + i * sizeof(u64), &pattern, sizeof(u64));
+
+	hv_snap_write(priv, off, size);
+
+	ctx.priv = priv;
+	ctx.start = off;
+
+	res = hv_par_run(off, size, hv_fill_fn, &ctx);
+	wmb();
+
+	hv_cdev_backend_write(priv, off, size);
+
+	kfree(ctx.pat);
+
+	return res;
+}
+
+struct hv_copy_ctx {
+	hv_cdev_private *priv;
+	u64 src;
+	u64 dst;
+};
+
+/* Runs over the destination range */
+static int hv_copy_fn(void *data, u64 off, u64 len)
+{
+	struct hv_copy_ctx *ctx = data;
+	u8 *dst = hv_cdev_vaddr(ctx->priv, off);
+	const u8 *src = hv_cdev_vaddr(ctx->priv, ctx->src + (off - ctx->dst));
+	u64 start = off, total = len;
+	size_t n;
+
+	while (len) {
+		n = min_t(u64, len, HV_OPS_STEP);
+		hv_cdev_memcpy_nt(dst, src, n);
+		dst += n;
+		src += n;
+		len -= n;
+		cond_resched();
+	}
+
+	hv_csum_update(ctx->priv, start, total);
+
+	return 0;
+}
+
+int hv_ops_copy(hv_cdev_private *priv, u64 src, u64 dst, u64 size)
+{
+	struct hv_copy_ctx ctx;
+	int res = 0;
+
+	if (src == dst || !size)
+		return 0;
+
+	hv_cdev_backend_read(priv, src, size);
+	hv_snap_write(priv, dst, size);
+
+	if (src < dst + size && dst < src + size) {
+		/* Overlapping ranges need memmove order, single thread */
+		memmove(hv_cdev_vaddr(priv, dst), hv_cdev_vaddr(priv, src), size);
+		clflush_cache_range(hv_cdev_vaddr(priv, dst), size);
+		hv_csum_update(priv, dst, size);
+	} else {
+		ctx.priv = priv;
+		ctx.src = src;
+		ctx.dst = dst;
+		res = hv_par_run(dst, size, hv_copy_fn, &ctx);
+	}
+	wmb();
+
+	hv_cdev_backend_write(priv, dst, size);
+
+	return res;
+}
+
+int hv_ops_crc(hv_cdev_private *priv, u64 off, u64 size, u32 *crc)
+{
+	const u8 *p = hv_cdev_vaddr(priv, off);
+	u32 c = *crc;
+	size_t n;
+
+	hv_cdev_backend_read(priv, off, size);
+
+	while (size) {
+		n = min_t(u64, size, HV_OPS_STEP);
+		c = crc32c(c, p, n);
+		p += n;
+		size -= n;
+		cond_resched();
+	}
+
+	*crc = c;
+
+	return 0;
+}
+
+struct hv_cmp_ctx {
+	hv_cdev_private *priv;
+	u64 off1;
+	u64 off2;
+	spinlock_t lock;
+	u64 result;		/* lowest mismatch seen, relative */
+};
+
+/* Runs over the first range */
+static int hv_cmp_fn(void *data, u64 off, u64 len)
+{
+	struct hv_cmp_ctx *ctx = data;
+	u64 rel = off - ctx->off1;
+	const u8 *a = hv_cdev_vaddr(ctx->priv, off);
+	const u8 *b = hv_cdev_vaddr(ctx->priv, ctx->off2 + rel);
+	size_t n, i;
+
+	while (len) {
+		n = min_t(u64, len, HV_OPS_STEP);
+
+		if (memcmp(a, b, n)) {
+			for (i = 0; a[i] == b[i]; i++)
+				;
+
+			spin_lock(&ctx->lock);
+			ctx->result = min(ctx->result, rel + i);
+			spin_unlock(&ctx->lock);
+			break;
+		}
+
+		/* A lower chunk already found one, nothing to improve */
+		if (READ_ONCE(ctx->result) < rel)
+			break;
+
+		a += n;
+		b += n;
+		rel += n;
+		len -= n;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+int hv_ops_compare(hv_cdev_private *priv, u64 off1, u64 off2, u64 size,
+		u64 *result)
+{
+	struct hv_cmp_ctx ctx;
+	int res;
+
+	hv_cdev_backend_read(priv, off1, size);
+	hv_cdev_backend_read(priv, off2, size);
+
+	ctx.priv = priv;
+	ctx.off1 = off1;
+	ctx.off2 = off2;
+	ctx.result = HV_MMLS_CMP_EQUAL;
+	spin_lock_init(&ctx.lock);
+
+	res = hv_par_run(off1, size, hv_cmp_fn, &ctx);
+
+	*result = ctx.result;
+
+	return res;
+}
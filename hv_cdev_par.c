@@ -0,0 +1,327 @@
+/*
+ *
+ *  Parallel execution of large device operations.
+ *
+ *  hv_par_run() splits a device range into chunks and runs a callback
+ *  on each chunk from a dedicated workqueue, one chunk per CPU. The
+ *  calling thread runs the first chunk itself and then waits for the
+ *  rest. Chunk boundaries are aligned to HV_PAR_ALIGN in device offset
+ *  so no two workers ever touch the same block.
+ *
+ *  Workers are placed on the CPUs of the device's NUMA node when it is
+ *  known. hv_par_copy_user() uses this for large read()/write() calls:
+ *  the user buffer is pinned window by window and each worker copies
+ *  its chunk through kmap, so one request is not capped at the memcpy
+ *  bandwidth of a single core.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/vmalloc.h>
+
+#define HV_PAR_ALIGN	(1UL << 20)
+
+static unsigned int hv_par_threads;
+module_param(hv_par_threads, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_par_threads, "Max CPUs per parallel op, 0 = all online CPUs");
+
+static unsigned int hv_par_chunk_kb = 4096;
+module_param(hv_par_chunk_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_par_chunk_kb, "Min chunk size in KB handed to one CPU");
+
+static unsigned int hv_par_io_kb = 16384;
+module_param(hv_par_io_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_par_io_kb, "read()/write() size in KB from which the copy is parallel, 0 = never");
+
+/* User buffer pinned at a time by hv_par_copy_user() */
+#define HV_PAR_PIN_WINDOW	(64UL << 20)
+
+static struct workqueue_struct *hv_par_wq;
+
+/* NUMA node of the device memory, NUMA_NO_NODE = any CPU */
+static int hv_par_node = NUMA_NO_NODE;
+
+struct hv_par_job {
+	hv_par_fn fn;
+	void *ctx;
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+struct hv_par_chunk {
+	struct work_struct work;
+	struct hv_par_job *job;
+	u64 off;
+	u64 len;
+};
+
+static void hv_par_chunk_done(struct hv_par_job *job, int err)
+{
+	if (err)
+		cmpxchg(&job->error, 0, err);
+
+	if (atomic_dec_and_test(&job->pending))
+		complete(&job->done);
+}
+
+static void hv_par_work_fn(struct work_struct *work)
+{
+	struct hv_par_chunk *chunk =
+		container_of(work, struct hv_par_chunk, work);
+	struct hv_par_job *job = chunk->job;
+
+	hv_par_chunk_done(job, job->fn(job->ctx, chunk->off, chunk->len));
+}
+
+static const struct cpumask *hv_par_cpumask(void)
+{
+	if (hv_par_node != NUMA_NO_NODE &&
+	    cpumask_intersects(cpumask_of_node(hv_par_node), cpu_online_mask))
+		return cpumask_of_node(hv_par_node);
+
+	return cpu_online_mask;
+}
+
+/* Next online CPU in mask after cpu, wrapping around */
+static unsigned int hv_par_next_cpu(const struct cpumask *mask, unsigned int cpu)
+{
+	do {
+		cpu = cpumask_next(cpu, mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(mask);
+	} while (!cpu_online(cpu));
+
+	return cpu;
+}
+
+int hv_par_run(u64 off, u64 len, hv_par_fn fn, void *ctx)
+{
+	const struct cpumask *mask = hv_par_cpumask();
+	struct hv_par_job job;
+	struct hv_par_chunk *chunks;
+	u64 min_chunk = max_t(u64, (u64)hv_par_chunk_kb << 10, HV_PAR_ALIGN);
+	u64 per, start, end;
+	unsigned int n, i, cpu;
+
+	n = hv_par_threads ? hv_par_threads : cpumask_weight(mask);
+	n = min_t(u64, n, DIV_ROUND_UP(len, min_chunk));
+
+	if (n <= 1 || !hv_par_wq)
+		return fn(ctx, off, len);
+
+	chunks = kcalloc(n, sizeof(*chunks), GFP_KERNEL);
+	if (!chunks)
+		return fn(ctx, off, len);
+
+	job.fn = fn;
+	job.ctx = ctx;
+	job.error = 0;
+	atomic_set(&job.pending, 1);
+	init_completion(&job.done);
+
+	per = DIV_ROUND_UP(len, n);
+	start = off;
+	cpu = raw_smp_processor_id();
+
+	for (i = 0; i < n && start < off + len; i++) {
+		end = (i == n - 1) ? off + len :
+			min(round_up(start + per, HV_PAR_ALIGN), off + len);
+
+		chunks[i].job = &job;
+		chunks[i].off = start;
+		chunks[i].len = end - start;
+		start = end;
+
+		/* Chunk 0 runs on the calling thread below */
+		if (i == 0)
+			continue;
+
+		cpu = hv_par_next_cpu(mask, cpu);
+
+		INIT_WORK(&chunks[i].work, hv_par_work_fn);
+		atomic_inc(&job.pending);
+		queue_work_on(cpu, hv_par_wq, &chunks[i].work);
+	}
+
+	hv_par_chunk_done(&job, fn(ctx, chunks[0].off, chunks[0].len));
+	wait_for_completion(&job.done);
+
+	kfree(chunks);
+
+	return job.error;
+}
+
+struct hv_par_xfer {
+	hv_cdev_private *priv;
+	struct page **pages;
+	u64 dev_off;		/* device offset matching page_off */
+	unsigned long page_off;	/* user buffer offset in pages[0] */
+	bool to_user;
+};
+
+static void hv_par_xfer_pages(struct hv_par_xfer *x, u64 off, u64 len,
+		bool nt)
+{
+	unsigned long pos = x->page_off + (off - x->dev_off);
+	u8 *dev = hv_cdev_vaddr(x->priv, off);
+	unsigned long idx, pofs, n;
+	u8 *kaddr;
+
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		pofs = pos & ~PAGE_MASK;
+		n = min_t(u64, len, PAGE_SIZE - pofs);
+
+		kaddr = kmap(x->pages[idx]);
+		if (x->to_user)
+			memcpy(kaddr + pofs, dev, n);
+		else if (nt)
+			hv_cdev_memcpy_nt(dev, kaddr + pofs, n);
+		else
+			memcpy(dev, kaddr + pofs, n);
+		kunmap(x->pages[idx]);
+
+		dev += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+static int hv_par_xfer_fn(void *data, u64 off, u64 len)
+{
+	struct hv_par_xfer *x = data;
+	hv_cdev_private *priv = x->priv;
+	u64 seg;
+	int res;
+
+	if (!priv->csum) {
+		hv_par_xfer_pages(x, off, len, true);
+		return 0;
+	}
+
+	/* One checksum block at a time, verified/summed while hot */
+	while (len) {
+		seg = hv_csum_step(off, len);
+
+		if (x->to_user) {
+			res = hv_csum_verify(priv, off, seg);
+			if (res)
+				return res;
+			hv_par_xfer_pages(x, off, seg, false);
+		} else {
+			hv_par_xfer_pages(x, off, seg, false);
+			hv_csum_update(priv, off, seg);
+			clflush_cache_range(hv_cdev_vaddr(priv, off), seg);
+		}
+
+		off += seg;
+		len -= seg;
+	}
+
+	return 0;
+}
+
+bool hv_par_want(size_t count)
+{
+	return hv_par_io_kb && hv_par_wq && !use_static_buff &&
+		count >= ((size_t)hv_par_io_kb << 10);
+}
+
+/*
+ * Copy count bytes between the device at dev_off and the user buffer
+ * at uaddr, in parallel. Returns bytes copied; stops early (and the
+ * caller finishes with a plain copy) if the buffer cannot be pinned,
+ * e.g. when it is itself a PFN mapping of this device. Returns -EIO
+ * if a block fails checksum verify.
+ * Called with cmutex held.
+ */
+ssize_t hv_par_copy_user(hv_cdev_private *priv, u64 dev_off,
+		unsigned long uaddr, size_t count, bool to_user)
+{
+	struct hv_par_xfer x;
+	size_t done = 0, win;
+	int nr, pinned, i;
+	int res = 0;
+
+	x.pages = vmalloc((HV_PAR_PIN_WINDOW / PAGE_SIZE + 1) * sizeof(struct page *));
+	if (!x.pages)
+		return 0;
+
+	x.priv = priv;
+	x.to_user = to_user;
+
+	while (done < count) {
+		win = min_t(size_t, count - done, HV_PAR_PIN_WINDOW);
+		x.page_off = (uaddr + done) & ~PAGE_MASK;
+		x.dev_off = dev_off + done;
+		nr = DIV_ROUND_UP(x.page_off + win, PAGE_SIZE);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+		pinned = get_user_pages_fast((uaddr + done) & PAGE_MASK, nr,
+				to_user ? FOLL_WRITE : 0, x.pages);
+#else
+		pinned = get_user_pages_fast((uaddr + done) & PAGE_MASK, nr,
+				to_user, x.pages);
+#endif
+		if (pinned == nr)
+			res = hv_par_run(x.dev_off, win, hv_par_xfer_fn, &x);
+
+		for (i = 0; i < pinned; i++) {
+			if (to_user && pinned == nr)
+				set_page_dirty_lock(x.pages[i]);
+			put_page(x.pages[i]);
+		}
+
+		if (pinned != nr || res)
+			break;
+
+		done += win;
+	}
+
+	if (!to_user)
+		wmb();
+
+	vfree(x.pages);
+
+	return res ? res : done;
+}
+
+void hv_par_set_node(int node)
+{
+	hv_par_node = node;
+	PINFO("%s: parallel copies on node %d\n", __func__, node);
+}
+
+int hv_par_init(void)
+{
+	hv_par_wq = alloc_workqueue("hv_cdev_par", WQ_CPU_INTENSIVE, 0);
+	if (!hv_par_wq) {
+		PERR("%s: failed to create workqueue\n", __func__);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void hv_par_exit(void)
+{
+	if (hv_par_wq)
+		destroy_workqueue(hv_par_wq);
+	hv_par_wq = NULL;
+}
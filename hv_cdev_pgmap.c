@@ -0,0 +1,165 @@
+/*
+ *
+ *  struct page backed mmap() through ZONE_DEVICE.
+ *
+ *  remap_pfn_range() gives VM_PFNMAP mappings without struct pages, so
+ *  get_user_pages()/pin_user_pages() fail on them and the mapped region
+ *  cannot be the buffer of O_DIRECT, vmsplice() or MSG_ZEROCOPY.
+ *
+ *  With hv_pgmap=1 the MMLS range is registered with memremap_pages()
+ *  as MEMORY_DEVICE_GENERIC, the way device-dax does it, and mmap()
+ *  builds a VM_MIXEDMAP mapping filled in page by page on fault. The
+ *  pages can then be pinned and handed to disks and sockets without a
+ *  bounce copy.
+ *
+ *  Needs CONFIG_ZONE_DEVICE and Linux 5.10 or later, and the range must
+ *  be aligned to a memory subsection. The cmd driver's own mapping of
+ *  the range has to be write-back (memremap) for the two to coexist.
+ *  If registration fails the driver keeps using remap_pfn_range().
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+static bool hv_pgmap;
+module_param(hv_pgmap, bool, S_IRUGO);
+MODULE_PARM_DESC(hv_pgmap, "Back mmap() with ZONE_DEVICE struct pages (default 0)");
+
+#if IS_ENABLED(CONFIG_ZONE_DEVICE) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+
+#include <linux/memremap.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 15, 0)
+#include <linux/pfn_t.h>
+#endif
+
+static vm_fault_t hv_pgmap_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	hv_cdev_file *hfile = vma->vm_file->private_data;
+	hv_cdev_private *priv = hfile->priv;
+	u64 off = (u64)vmf->pgoff << PAGE_SHIFT;
+	phys_addr_t phys = priv->phys_start + off;
+
+	if (off >= priv->dev_size)
+		return VM_FAULT_SIGBUS;
+
+	hv_heat_fault(priv, off);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	return vmf_insert_page_mkwrite(vmf, pfn_to_page(PHYS_PFN(phys)),
+			vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_mixed(vma, vmf->address,
+			phys_to_pfn_t(phys, PFN_DEV | PFN_MAP));
+#endif
+}
+
+static const struct vm_operations_struct hv_pgmap_vm_ops = {
+	.open = hv_cdev_vm_open,
+	.close = hv_cdev_vm_close,
+	.fault = hv_pgmap_fault,
+};
+
+/* Called from hv_cdev_mmap() once the range has been checked */
+int hv_pgmap_mmap(hv_cdev_private *priv, struct vm_area_struct *vma)
+{
+	vma->vm_ops = &hv_pgmap_vm_ops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND);
+#else
+	vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND;
+#endif
+
+	return 0;
+}
+
+int hv_pgmap_init(hv_cdev_private *priv)
+{
+	struct dev_pagemap *pgmap;
+	void *addr;
+
+	if (!hv_pgmap)
+		return 0;
+
+	if (use_static_buff || priv->comp) {
+		PERR("%s: needs the mmls region and no compression\n", __func__);
+		return 0;
+	}
+
+	if (!IS_ALIGNED(priv->phys_start | priv->dev_size,
+			PAGES_PER_SUBSECTION << PAGE_SHIFT)) {
+		PERR("%s: range is not subsection aligned\n", __func__);
+		return 0;
+	}
+
+	pgmap = kzalloc(sizeof(*pgmap), GFP_KERNEL);
+	if (!pgmap)
+		return -ENOMEM;
+
+	pgmap->type = MEMORY_DEVICE_GENERIC;
+	pgmap->range.start = priv->phys_start;
+	pgmap->range.end = priv->phys_start + priv->dev_size - 1;
+	pgmap->nr_range = 1;
+
+	addr = memremap_pages(pgmap, pfn_valid(priv->pfn) ?
+			pfn_to_nid(priv->pfn) : NUMA_NO_NODE);
+	if (IS_ERR(addr)) {
+		PERR("%s: memremap_pages failed, res=%ld; using remap_pfn_range\n",
+			__func__, PTR_ERR(addr));
+		kfree(pgmap);
+		return 0;
+	}
+
+	priv->pgmap = pgmap;
+
+	PINFO("%s: %llu bytes backed by struct pages\n", __func__,
+		priv->dev_size);
+
+	return 0;
+}
+
+/* Waits for pages still pinned by O_DIRECT or zero-copy sends */
+void hv_pgmap_exit(hv_cdev_private *priv)
+{
+	if (!priv->pgmap)
+		return;
+
+	memunmap_pages(priv->pgmap);
+	kfree(priv->pgmap);
+	priv->pgmap = NULL;
+}
+
+#else
+
+int hv_pgmap_mmap(hv_cdev_private *priv, struct vm_area_struct *vma)
+{
+	return -EOPNOTSUPP;
+}
+
+int hv_pgmap_init(hv_cdev_private *priv)
+{
+	if (hv_pgmap)
+		PERR("%s: needs CONFIG_ZONE_DEVICE and Linux 5.10 or later\n",
+			__func__);
+
+	return 0;
+}
+
+void hv_pgmap_exit(hv_cdev_private *priv)
+{
+}
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ *
+ *  Per-file QoS for read() and write().
+ *
+ *  Each open file has a class, set with HV_MMLS_SET_QOS:
+ *
+ *    HV_MMLS_QOS_LATENCY  never sliced or held back
+ *    HV_MMLS_QOS_NORMAL   default
+ *    HV_MMLS_QOS_BULK     streams; rate limited by qos_bulk_bps
+ *
+ *  and optionally its own token buckets for bytes/s and ops/s.
+ *
+ *  While a latency-class file is open, normal and bulk transfers are
+ *  cut into qos_slice_kb slices and cmutex is dropped between slices.
+ *  Before taking cmutex for a slice they wait for every latency-class
+ *  read()/write() in flight, so those jump ahead of a streaming job
+ *  instead of queueing behind all of it. With no latency-class file
+ *  open nothing is sliced and the I/O path is unchanged.
+ *
+ *  Per-file throttling stats come from HV_MMLS_QOS_STATS; device
+ *  totals and the tunables are in sysfs next to the device node.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/sizes.h>
+#include <linux/wait.h>
+
+#define HV_QOS_MIN_BURST	SZ_64K
+
+/*
+ * Limits that keep the bucket math in 64 bits: refill multiplies the
+ * rate by up to 1e8 us, a wait multiplies up to a burst by NSEC_PER_SEC
+ */
+#define HV_QOS_MAX_RATE		(1ULL << 50)	/* per second */
+#define HV_QOS_MAX_BURST	(16ULL << 30)
+
+void hv_qos_init(hv_cdev_private *priv)
+{
+	init_waitqueue_head(&priv->qos_wq);
+	atomic_set(&priv->lat_files, 0);
+	atomic_set(&priv->lat_inflight, 0);
+	atomic64_set(&priv->qos_throttled_ns, 0);
+	atomic64_set(&priv->qos_preemptions, 0);
+	priv->qos_slice = SZ_1M;
+	priv->qos_bulk_bps = 0;
+}
+
+void hv_qos_open(hv_cdev_file *hfile)
+{
+	spin_lock_init(&hfile->qos.lock);
+	hfile->qos.qos_class = HV_MMLS_QOS_NORMAL;
+}
+
+void hv_qos_release(hv_cdev_file *hfile)
+{
+	if (hfile->qos.qos_class == HV_MMLS_QOS_LATENCY)
+		atomic_dec(&hfile->priv->lat_files);
+}
+
+/* Burst defaults to 100ms worth of rate */
+static void hv_qos_bucket_set(struct hv_qos_bucket *b, u64 rate, u64 burst)
+{
+	b->rate = min(rate, HV_QOS_MAX_RATE);
+	b->burst = min(burst ? burst : max_t(u64, b->rate / 10, 1),
+			HV_QOS_MAX_BURST);
+	b->tokens = b->burst;
+	b->last_ns = ktime_get_ns();
+}
+
+static void hv_qos_bucket_refill(struct hv_qos_bucket *b, u64 now)
+{
+	/* Microseconds, capped at 100s so they fit the 32-bit multiplier */
+	u32 us = min_t(u64, div64_u64(now - b->last_ns, NSEC_PER_USEC),
+			100 * USEC_PER_SEC);
+	u64 add = mul_u64_u32_div(b->rate, us, USEC_PER_SEC);
+
+	if (!add)
+		return;
+
+	b->tokens = min(b->tokens + add, b->burst);
+	b->last_ns = now;
+}
+
+/* Nanoseconds until n tokens are available, 0 if they are now */
+static u64 hv_qos_bucket_wait(struct hv_qos_bucket *b, u64 n, u64 now)
+{
+	if (!b->rate)
+		return 0;
+
+	hv_qos_bucket_refill(b, now);
+	if (b->tokens >= n)
+		return 0;
+
+	/* n is at most the burst, so this stays under 2^64 */
+	return div64_u64((n - b->tokens) * NSEC_PER_SEC, b->rate) + 1;
+}
+
+static void hv_qos_bucket_take(struct hv_qos_bucket *b, u64 n)
+{
+	if (b->rate)
+		b->tokens -= min(b->tokens, n);
+}
+
+int hv_qos_set(hv_cdev_file *hfile, const struct hv_mmls_qos *req)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_qos_state *q = &hfile->qos;
+	u64 bps = req->bw_bps;
+
+	if (req->qos_class > HV_MMLS_QOS_BULK)
+		return -EINVAL;
+
+	if (req->qos_class == HV_MMLS_QOS_LATENCY && (req->bw_bps || req->iops))
+		return -EINVAL;
+
+	if (!bps && req->qos_class == HV_MMLS_QOS_BULK)
+		bps = READ_ONCE(priv->qos_bulk_bps);
+
+	spin_lock(&q->lock);
+
+	if (q->qos_class == HV_MMLS_QOS_LATENCY)
+		atomic_dec(&priv->lat_files);
+	if (req->qos_class == HV_MMLS_QOS_LATENCY)
+		atomic_inc(&priv->lat_files);
+
+	WRITE_ONCE(q->qos_class, req->qos_class);
+	hv_qos_bucket_set(&q->bw, bps,
+		req->burst ? req->burst : max_t(u64, bps / 10, HV_QOS_MIN_BURST));
+	hv_qos_bucket_set(&q->ops, req->iops, 0);
+
+	spin_unlock(&q->lock);
+
+	PDEBUG("%s: class=%u, bps=%llu, iops=%llu\n", __func__, q->qos_class,
+		bps, req->iops);
+
+	return 0;
+}
+
+void hv_qos_get_stats(hv_cdev_file *hfile, struct hv_mmls_qos_stats *st)
+{
+	spin_lock(&hfile->qos.lock);
+	*st = hfile->qos.stats;
+	spin_unlock(&hfile->qos.lock);
+}
+
+/*
+ * Called before each slice of a read()/write() without cmutex held.
+ * first is true for the first slice of the call. Sleeps for the rate
+ * limits and, for non-latency classes, until no latency-class I/O is
+ * pending. Returns the length of the next slice or -errno. *lat tells
+ * hv_qos_end() whether the slice counted as latency I/O, as the class
+ * may change in between.
+ */
+ssize_t hv_qos_begin(hv_cdev_file *hfile, size_t count, bool first, bool *lat)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_qos_state *q = &hfile->qos;
+	u64 now, wait, t0;
+	size_t slice = count;
+
+	*lat = READ_ONCE(q->qos_class) == HV_MMLS_QOS_LATENCY;
+	if (*lat) {
+		atomic_inc(&priv->lat_inflight);
+		return count;
+	}
+
+	if (atomic_read(&priv->lat_files))
+		slice = min_t(size_t, slice, READ_ONCE(priv->qos_slice));
+	if (q->bw.rate)
+		slice = min_t(size_t, slice, q->bw.burst);
+
+	t0 = ktime_get_ns();
+	for (;;) {
+		spin_lock(&q->lock);
+		now = ktime_get_ns();
+		wait = max(hv_qos_bucket_wait(&q->bw, slice, now),
+			first ? hv_qos_bucket_wait(&q->ops, 1, now) : 0);
+		if (!wait) {
+			/* Take while still locked so threads cannot overdraw */
+			hv_qos_bucket_take(&q->bw, slice);
+			if (first)
+				hv_qos_bucket_take(&q->ops, 1);
+			spin_unlock(&q->lock);
+			break;
+		}
+		spin_unlock(&q->lock);
+
+		if (schedule_timeout_interruptible(
+				max_t(unsigned long, nsecs_to_jiffies(wait), 1)))
+			return -ERESTARTSYS;
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+
+	now = ktime_get_ns();
+	wait = now - t0;
+
+	/* Let pending latency-class I/O go first */
+	if (atomic_read(&priv->lat_inflight)) {
+		atomic64_inc(&priv->qos_preemptions);
+		spin_lock(&q->lock);
+		q->stats.preempted++;
+		spin_unlock(&q->lock);
+		if (wait_event_interruptible(priv->qos_wq,
+				!atomic_read(&priv->lat_inflight)))
+			return -ERESTARTSYS;
+	}
+
+	spin_lock(&q->lock);
+	if (wait > NSEC_PER_USEC) {
+		q->stats.throttled_ns += wait;
+		q->stats.throttled++;
+		atomic64_add(wait, &priv->qos_throttled_ns);
+	}
+	if (slice < count)
+		q->stats.slices++;
+	spin_unlock(&q->lock);
+
+	return slice;
+}
+
+/* Called after each slice, with the bytes it moved or -errno */
+void hv_qos_end(hv_cdev_file *hfile, ssize_t n, bool lat)
+{
+	hv_cdev_private *priv = hfile->priv;
+
+	if (n > 0) {
+		spin_lock(&hfile->qos.lock);
+		hfile->qos.stats.bytes += n;
+		spin_unlock(&hfile->qos.lock);
+	}
+
+	if (lat && atomic_dec_and_test(&priv->lat_inflight))
+		wake_up_all(&priv->qos_wq);
+}
+
+/*
+ * sysfs, on the hv_cdevN device
+ */
+
+static ssize_t qos_slice_kb_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	hv_cdev_private *priv = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", READ_ONCE(priv->qos_slice) >> 10);
+}
+
+static ssize_t qos_slice_kb_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	hv_cdev_private *priv = dev_get_drvdata(dev);
+	unsigned int kb;
+	int res;
+
+	res = kstrtouint(buf, 0, &kb);
+	if (res)
+		return res;
+	if (kb < 4)
+		return -EINVAL;
+
+	WRITE_ONCE(priv->qos_slice, (size_t)kb << 10);
+
+	return count;
+}
+static DEVICE_ATTR_RW(qos_slice_kb);
+
+static ssize_t qos_bulk_bps_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	hv_cdev_private *priv = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(priv->qos_bulk_bps));
+}
+
+/* Applies to files that switch to the bulk class afterwards */
+static ssize_t qos_bulk_bps_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	hv_cdev_private *priv = dev_get_drvdata(dev);
+	u64 bps;
+	int res;
+
+	res = kstrtou64(buf, 0, &bps);
+	if (res)
+		return res;
+
+	WRITE_ONCE(priv->qos_bulk_bps, bps);
+
+	return count;
+}
+static DEVICE_ATTR_RW(qos_bulk_bps);
+
+static ssize_t qos_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	hv_cdev_private *priv = dev_get_drvdata(dev);
+
+	return sprintf(buf, "latency_files %d\nthrottled_ns %lld\npreemptions %lld\n",
+		atomic_read(&priv->lat_files),
+		(long long)atomic64_read(&priv->qos_throttled_ns),
+		(long long)atomic64_read(&priv->qos_preemptions));
+}
+static DEVICE_ATTR_RO(qos_stats);
+
+static struct attribute *hv_qos_attrs[] = {
+	&dev_attr_qos_slice_kb.attr,
+	&dev_attr_qos_bulk_bps.attr,
+	&dev_attr_qos_stats.attr,
+	NULL,
+};
+
+static const struct attribute_group hv_qos_group = {
+	.attrs = hv_qos_attrs,
+};
+
+int hv_qos_sysfs_add(hv_cdev_private *priv)
+{
+	return sysfs_create_group(&priv->hv_cdev_device->kobj, &hv_qos_group);
+}
+
+void hv_qos_sysfs_remove(hv_cdev_private *priv)
+{
+	sysfs_remove_group(&priv->hv_cdev_device->kobj, &hv_qos_group);
+}
@@ -0,0 +1,189 @@
+/*
+ *
+ *  Readahead for sequential read() streams on the hv char driver.
+ *
+ *  Each open file tracks where its previous read() ended. Once reads
+ *  are seen to be sequential, mmls_read_command() is issued ahead of
+ *  the file position from a work item, so the next read() finds its
+ *  sectors already fetched from the backend. The window doubles on
+ *  every sequential hit up to hv_ra_max_kb and collapses on a seek.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cdev_uapi.h"
+
+static unsigned int hv_ra_min_kb = 128;
+module_param(hv_ra_min_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_ra_min_kb, "Initial readahead window in KB");
+
+static unsigned int hv_ra_max_kb = 4096;
+module_param(hv_ra_max_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_ra_max_kb, "Max readahead window in KB, 0 = disable readahead");
+
+static void hv_ra_work_fn(struct work_struct *work)
+{
+	struct hv_ra_state *ra = container_of(work, struct hv_ra_state, work);
+	hv_cdev_file *hfile = container_of(ra, hv_cdev_file, ra);
+	hv_cdev_private *priv = hfile->priv;
+
+	mutex_lock(&priv->cmutex);
+
+	if (ra->async_len) {
+		hv_cdev_backend_read(priv, ra->async_start, ra->async_len);
+
+		/* Extend the window if contiguous, else start a new one */
+		if (ra->async_start >= ra->start && ra->async_start <= ra->end) {
+			ra->end = max_t(loff_t, ra->end,
+					ra->async_start + ra->async_len);
+		} else {
+			ra->start = ra->async_start;
+			ra->end = ra->async_start + ra->async_len;
+		}
+		ra->async_len = 0;
+	}
+
+	mutex_unlock(&priv->cmutex);
+}
+
+/* Queue [start, start + len) to the work. Called with cmutex held. */
+static void hv_ra_submit(hv_cdev_file *hfile, loff_t start, size_t len)
+{
+	struct hv_ra_state *ra = &hfile->ra;
+	u64 dev_size = hfile->priv->dev_size;
+
+	if (ra->async_len || start >= dev_size)
+		return;
+
+	if (start + len > dev_size)
+		len = dev_size - start;
+
+	ra->async_start = start;
+	ra->async_len = len;
+
+	queue_work(system_unbound_wq, &ra->work);
+}
+
+void hv_ra_init(hv_cdev_file *hfile)
+{
+	struct hv_ra_state *ra = &hfile->ra;
+
+	ra->prev_end = -1;
+	ra->advice = HV_MMLS_ADV_NORMAL;
+	INIT_WORK(&ra->work, hv_ra_work_fn);
+}
+
+void hv_ra_release(hv_cdev_file *hfile)
+{
+	cancel_work_sync(&hfile->ra.work);
+}
+
+/*
+ * Called before taking cmutex. If the range is being prefetched right
+ * now, wait for it instead of issuing the same backend read twice.
+ * The fields are read unlocked; a stale view only costs a duplicate
+ * mmls_read_command(), never wrong data.
+ */
+void hv_ra_wait(hv_cdev_file *hfile, loff_t pos, size_t count)
+{
+	struct hv_ra_state *ra = &hfile->ra;
+	loff_t astart = READ_ONCE(ra->async_start);
+	size_t alen = READ_ONCE(ra->async_len);
+
+	if (alen && pos < astart + alen && pos + count > astart)
+		flush_work(&ra->work);
+}
+
+/*
+ * Read-side hook, called with cmutex held in place of a plain
+ * mmls_read_command(). Skips the backend read when the range has
+ * already been prefetched, then grows the window and queues the next
+ * prefetch if the stream is sequential.
+ */
+void hv_ra_read(hv_cdev_file *hfile, loff_t pos, size_t count)
+{
+	struct hv_ra_state *ra = &hfile->ra;
+	size_t max = (size_t)hv_ra_max_kb << 10;
+	size_t min = min_t(size_t, (size_t)hv_ra_min_kb << 10, max);
+	loff_t end = pos + count;
+	bool seq;
+
+	if (pos >= ra->start && end <= ra->end) {
+		PDEBUG("%s: hit [%lld, %lld)\n", __func__, pos, end);
+	} else {
+		hv_cdev_backend_read(hfile->priv, pos, count);
+		ra->start = pos;
+		ra->end = end;
+	}
+
+	seq = (pos == ra->prev_end);
+	ra->prev_end = end;
+
+	/* Drop what is behind the reader from the window */
+	if (ra->start < pos && pos <= ra->end)
+		ra->start = pos;
+
+	if (!max || ra->advice == HV_MMLS_ADV_RANDOM)
+		return;
+
+	if (ra->advice == HV_MMLS_ADV_SEQUENTIAL) {
+		ra->size = max;
+	} else if (!seq) {
+		ra->size = 0;
+		return;
+	} else {
+		ra->size = ra->size ? min_t(size_t, ra->size * 2, max) : min;
+	}
+
+	/* Refill once less than half a window is left ahead of the reader */
+	if (ra->end - end < ra->size / 2)
+		hv_ra_submit(hfile, ra->end, ra->size);
+}
+
+int hv_ra_advise(hv_cdev_file *hfile, u64 offset, u64 size, int advice)
+{
+	struct hv_ra_state *ra = &hfile->ra;
+	hv_cdev_private *priv = hfile->priv;
+
+	if (advice < HV_MMLS_ADV_NORMAL || advice > HV_MMLS_ADV_DONTNEED)
+		return -EINVAL;
+
+	/* Any queued prefetch is stale once the pattern changes */
+	flush_work(&ra->work);
+
+	if (mutex_lock_interruptible(&priv->cmutex))
+		return -ERESTARTSYS;
+
+	switch (advice) {
+	case HV_MMLS_ADV_NORMAL:
+	case HV_MMLS_ADV_RANDOM:
+	case HV_MMLS_ADV_SEQUENTIAL:
+		ra->advice = advice;
+		ra->size = 0;
+		break;
+
+	case HV_MMLS_ADV_WILLNEED:
+		if (!use_static_buff)
+			hv_ra_submit(hfile, offset, size);
+		break;
+
+	case HV_MMLS_ADV_DONTNEED:
+		/* Forget a window that overlaps the range */
+		if (offset < ra->end && offset + size > ra->start)
+			ra->start = ra->end = 0;
+		break;
+	}
+
+	mutex_unlock(&priv->cmutex);
+
+	return 0;
+}
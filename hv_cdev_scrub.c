@@ -0,0 +1,294 @@
+/*
+ *
+ *  Background zeroing, scrubbing and checksum seeding.
+ *
+ *  The device node is registered before the region has been touched;
+ *  one pass over it then runs on the hv_par workers, on the CPUs of the
+ *  device's NUMA node, in HV_SCRUB_CHUNK chunks:
+ *
+ *    hv_scrub=1  zero the region
+ *    hv_scrub=2  read every byte with machine-check recovery, so ECC
+ *                errors are found (and corrected by the memory
+ *                controller where possible) before data is served
+ *
+ *  With hv_csum=1 the same pass seeds the checksum table, which used to
+ *  hold up module load for a full read of the device.
+ *
+ *  I/O does not wait for the whole pass. A read, write, op or mmap of a
+ *  chunk nobody has started runs that chunk itself; one a worker is on
+ *  waits for that chunk only. Progress is in the scrub_status sysfs
+ *  attribute of the device.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+static unsigned int hv_scrub;
+module_param(hv_scrub, uint, S_IRUGO);
+MODULE_PARM_DESC(hv_scrub, "Background pass at load: 0 = none, 1 = zero, 2 = ECC read scrub (default 0)");
+
+#define HV_SCRUB_NONE	0
+#define HV_SCRUB_ZERO	1
+#define HV_SCRUB_READ	2
+
+/* Unit of claim and wait; matches the hv_par chunk alignment */
+#define HV_SCRUB_SHIFT	20
+#define HV_SCRUB_CHUNK	(1ULL << HV_SCRUB_SHIFT)
+
+struct hv_scrub {
+	hv_cdev_private *priv;
+	unsigned int mode;		/* HV_SCRUB_* */
+	u64 nchunks;
+	unsigned long *claimed;		/* someone is on it or finished it */
+	unsigned long *done;
+	atomic64_t ndone;
+	atomic64_t errors;		/* poisoned lines found */
+	bool complete;
+	bool stop;
+	u64 start_ns;
+	u64 end_ns;
+	wait_queue_head_t wq;
+	struct work_struct work;
+};
+
+static const char * const hv_scrub_names[] = { "csum", "zero", "read" };
+
+/* Read a range through copy_mc so a poisoned line fails the copy */
+static void hv_scrub_read(struct hv_scrub *s, u64 off, u64 len)
+{
+	u8 bounce[256];
+	u8 *p = hv_cdev_vaddr(s->priv, off);
+	size_t n;
+
+	while (len) {
+		n = min_t(u64, len, sizeof(bounce));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+		if (copy_mc_to_kernel(bounce, p, n)) {
+			atomic64_inc(&s->errors);
+			PERR("%s: uncorrectable error at %llu\n", __func__, off);
+		}
+#else
+		memcpy(bounce, p, n);
+#endif
+		p += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* Returns false if another thread had claimed chunk c */
+static bool hv_scrub_chunk(struct hv_scrub *s, u64 c)
+{
+	hv_cdev_private *priv = s->priv;
+	u64 off = c << HV_SCRUB_SHIFT;
+	u64 len = min(HV_SCRUB_CHUNK, priv->dev_size - off);
+
+	if (test_and_set_bit(c, s->claimed))
+		return false;
+
+	switch (s->mode) {
+	case HV_SCRUB_ZERO:
+		memset(hv_cdev_vaddr(priv, off), 0, len);
+		clflush_cache_range(hv_cdev_vaddr(priv, off), len);
+		hv_cdev_backend_write(priv, off, len);
+		break;
+	case HV_SCRUB_READ:
+		hv_cdev_backend_read(priv, off, len);
+		hv_scrub_read(s, off, len);
+		break;
+	default:
+		hv_cdev_backend_read(priv, off, len);
+		break;
+	}
+
+	hv_csum_update(priv, off, len);
+
+	smp_mb__before_atomic();
+	set_bit(c, s->done);
+
+	if (atomic64_inc_return(&s->ndone) == s->nchunks) {
+		s->end_ns = ktime_get_ns();
+		smp_store_release(&s->complete, true);
+	}
+
+	if (wq_has_sleeper(&s->wq))
+		wake_up_all(&s->wq);
+
+	return true;
+}
+
+/*
+ * Called before I/O to [off, off + len). Runs the unstarted chunks of
+ * the range and waits for ones a worker has in hand.
+ */
+void hv_scrub_wait(hv_cdev_private *priv, u64 off, u64 len)
+{
+	struct hv_scrub *s = priv->scrub;
+	u64 c, last;
+
+	if (!s || !len || smp_load_acquire(&s->complete))
+		return;
+
+	last = (off + len - 1) >> HV_SCRUB_SHIFT;
+	for (c = off >> HV_SCRUB_SHIFT; c <= last; c++) {
+		if (test_bit(c, s->done))
+			continue;
+		if (!hv_scrub_chunk(s, c))
+			wait_event(s->wq, test_bit(c, s->done));
+	}
+}
+
+static int hv_scrub_fn(void *data, u64 off, u64 len)
+{
+	struct hv_scrub *s = data;
+	u64 c, last = (off + len - 1) >> HV_SCRUB_SHIFT;
+
+	for (c = off >> HV_SCRUB_SHIFT; c <= last; c++) {
+		if (READ_ONCE(s->stop))
+			break;
+		hv_scrub_chunk(s, c);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static void hv_scrub_work(struct work_struct *work)
+{
+	struct hv_scrub *s = container_of(work, struct hv_scrub, work);
+	int res;
+
+	res = hv_par_run(0, s->priv->dev_size, hv_scrub_fn, s);
+	if (res)
+		PERR("%s: pass failed, res=%d; I/O finishes it\n", __func__, res);
+
+	if (smp_load_acquire(&s->complete))
+		PINFO("%s: %s pass done in %llu ms, %lld errors\n", __func__,
+			hv_scrub_names[s->mode],
+			div_u64(s->end_ns - s->start_ns, NSEC_PER_MSEC),
+			(long long)atomic64_read(&s->errors));
+}
+
+static ssize_t scrub_status_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	hv_cdev_private *priv = dev_get_drvdata(dev);
+	struct hv_scrub *s = priv->scrub;
+	u64 done, end;
+
+	if (!s)
+		return sprintf(buf, "mode none\n");
+
+	done = atomic64_read(&s->ndone);
+	end = smp_load_acquire(&s->complete) ? s->end_ns : ktime_get_ns();
+
+	return sprintf(buf, "mode %s\ndone %llu\ntotal %llu\npercent %llu\n"
+			"errors %lld\nelapsed_ms %llu\n",
+		hv_scrub_names[s->mode], done, s->nchunks,
+		div64_u64(done * 100, s->nchunks),
+		(long long)atomic64_read(&s->errors),
+		div_u64(end - s->start_ns, NSEC_PER_MSEC));
+}
+static DEVICE_ATTR_RO(scrub_status);
+
+int hv_scrub_sysfs_add(hv_cdev_private *priv)
+{
+	return device_create_file(priv->hv_cdev_device, &dev_attr_scrub_status);
+}
+
+void hv_scrub_sysfs_remove(hv_cdev_private *priv)
+{
+	device_remove_file(priv->hv_cdev_device, &dev_attr_scrub_status);
+}
+
+/* Called after hv_csum_init(), before anything else reads the region */
+int hv_scrub_init(hv_cdev_private *priv)
+{
+	struct hv_scrub *s;
+	unsigned int mode = hv_scrub;
+
+	if (mode > HV_SCRUB_READ) {
+		PERR("%s: unknown hv_scrub=%u\n", __func__, mode);
+		mode = HV_SCRUB_NONE;
+	}
+
+	/* The compressed layout is in raw offsets the pass does not see */
+	if (priv->comp && mode != HV_SCRUB_NONE) {
+		PERR("%s: not available in compressed mode\n", __func__);
+		mode = HV_SCRUB_NONE;
+	}
+
+	if (mode == HV_SCRUB_NONE && !priv->csum)
+		return 0;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	s->priv = priv;
+	s->mode = mode;
+	s->nchunks = DIV_ROUND_UP(priv->dev_size, HV_SCRUB_CHUNK);
+	s->claimed = vzalloc(BITS_TO_LONGS(s->nchunks) * sizeof(long));
+	s->done = vzalloc(BITS_TO_LONGS(s->nchunks) * sizeof(long));
+	if (!s->claimed || !s->done) {
+		vfree(s->claimed);
+		vfree(s->done);
+		kfree(s);
+		return -ENOMEM;
+	}
+
+	atomic64_set(&s->ndone, 0);
+	atomic64_set(&s->errors, 0);
+	init_waitqueue_head(&s->wq);
+	INIT_WORK(&s->work, hv_scrub_work);
+	s->start_ns = ktime_get_ns();
+
+	priv->scrub = s;
+
+	return 0;
+}
+
+/* Called once the device node exists */
+void hv_scrub_start(hv_cdev_private *priv)
+{
+	struct hv_scrub *s = priv->scrub;
+
+	if (!s)
+		return;
+
+	PINFO("%s: %s pass over %llu chunks in background\n", __func__,
+		hv_scrub_names[s->mode], s->nchunks);
+
+	queue_work(system_unbound_wq, &s->work);
+}
+
+void hv_scrub_exit(hv_cdev_private *priv)
+{
+	struct hv_scrub *s = priv->scrub;
+
+	if (!s)
+		return;
+
+	WRITE_ONCE(s->stop, true);
+	cancel_work_sync(&s->work);
+
+	vfree(s->claimed);
+	vfree(s->done);
+	kfree(s);
+	priv->scrub = NULL;
+}
@@ -0,0 +1,420 @@
+/*
+ *
+ *  Copy-on-write snapshots with incremental export.
+ *
+ *  HV_MMLS_SNAPSHOT freezes a point-in-time view of the device and
+ *  returns it as a new read-only file descriptor. Taking it only swaps
+ *  a bitmap under cmutex; after that every write path calls
+ *  hv_snap_write() first, which saves the old contents of each block
+ *  the first time it is touched. Reads of the snapshot fd return the
+ *  saved copy when there is one and the live block otherwise.
+ *
+ *  Blocks written since the previous snapshot are tracked in a bitmap.
+ *  With HV_MMLS_SNAP_INCR the snapshot exports only those: SEEK_DATA
+ *  and SEEK_HOLE on the snapshot fd walk the changed blocks.
+ *
+ *  Stores through a writable mmap() cannot be intercepted, so a
+ *  snapshot is refused while one exists, such a mapping is refused
+ *  while a snapshot is open, and the next snapshot after one is full.
+ *  For the same reason snapshots are not offered with hv_blk.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include "hv_cmd.h"
+#include <linux/anon_inodes.h>
+#include <linux/bitmap.h>
+#include <linux/file.h>
+#include <linux/radix-tree.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static unsigned int hv_snap_max_mb = 1024;
+module_param(hv_snap_max_mb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hv_snap_max_mb, "Memory a snapshot may use for saved blocks (MB)");
+
+#define HV_SNAP_BLOCK	HV_BLOCK_SIZE
+
+struct hv_snap_copy {
+	struct list_head list;
+	u64 block;
+	u8 data[HV_SNAP_BLOCK];
+};
+
+struct hv_snap {
+	hv_cdev_private *priv;
+	u64 size;
+	u64 nblocks;
+	unsigned long *export;		/* blocks to emit, NULL = all */
+	struct radix_tree_root copies;	/* block -> hv_snap_copy */
+	struct list_head list;		/* every hv_snap_copy, for freeing */
+	u64 saved;			/* bytes in copies */
+	int error;			/* copy-on-write gave up */
+};
+
+static u64 hv_snap_nblocks(hv_cdev_private *priv)
+{
+	return DIV_ROUND_UP(priv->dev_size, HV_SNAP_BLOCK);
+}
+
+static int hv_snap_save(hv_cdev_private *priv, struct hv_snap *s, u64 b)
+{
+	u64 off = b * HV_SNAP_BLOCK;
+	size_t n = min_t(u64, HV_SNAP_BLOCK, priv->dev_size - off);
+	struct hv_snap_copy *copy;
+	int res;
+
+	if (s->saved + n > (u64)hv_snap_max_mb << 20)
+		return -ENOSPC;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	hv_cdev_backend_read(priv, off, n);
+	memcpy(copy->data, hv_cdev_vaddr(priv, off), n);
+	copy->block = b;
+
+	res = radix_tree_insert(&s->copies, b, copy);
+	if (res) {
+		kfree(copy);
+		return res;
+	}
+
+	list_add(&copy->list, &s->list);
+	s->saved += n;
+
+	return 0;
+}
+
+/*
+ * Called with cmutex held before [off, off + len) is modified. Never
+ * fails the write: if a block cannot be saved the snapshot is marked
+ * broken and its reads return the error.
+ */
+void hv_snap_write(hv_cdev_private *priv, u64 off, u64 len)
+{
+	struct hv_snap *s = priv->snap;
+	u64 first, last, b;
+	int res;
+
+	if (!len)
+		return;
+
+	first = off / HV_SNAP_BLOCK;
+	last = (off + len - 1) / HV_SNAP_BLOCK;
+
+	if (priv->snap_dirty)
+		bitmap_set(priv->snap_dirty, first, last - first + 1);
+
+	if (!s || s->error)
+		return;
+
+	for (b = first; b <= last; b++) {
+		if (radix_tree_lookup(&s->copies, b))
+			continue;
+
+		res = hv_snap_save(priv, s, b);
+		if (res) {
+			PERR("%s: snapshot dropped at block %llu, res=%d\n",
+				__func__, b, res);
+			s->error = res;
+			return;
+		}
+	}
+}
+
+/* A writable mapping of the device is being created */
+int hv_snap_map(hv_cdev_private *priv)
+{
+	int res = 0;
+
+	mutex_lock(&priv->cmutex);
+
+	if (priv->snap) {
+		res = -EBUSY;
+	} else {
+		atomic_inc(&priv->mmap_writers);
+		priv->snap_all_dirty = true;
+	}
+
+	mutex_unlock(&priv->cmutex);
+
+	return res;
+}
+
+static void hv_snap_free(struct hv_snap *s)
+{
+	struct hv_snap_copy *copy, *tmp;
+
+	list_for_each_entry_safe(copy, tmp, &s->list, list) {
+		radix_tree_delete(&s->copies, copy->block);
+		kfree(copy);
+	}
+
+	vfree(s->export);
+	kfree(s);
+}
+
+static ssize_t hv_snap_read(struct file *filp, char __user *ubuff,
+		size_t count, loff_t *f_pos)
+{
+	struct hv_snap *s = filp->private_data;
+	hv_cdev_private *priv = s->priv;
+	u64 pos = *f_pos;
+	struct hv_snap_copy *copy;
+	size_t done = 0, n;
+	void *src;
+	u64 b;
+	ssize_t res = 0;
+
+	if (pos >= s->size)
+		return 0;
+
+	count = min_t(u64, count, s->size - pos);
+
+	if (mutex_lock_interruptible(&priv->cmutex))
+		return -ERESTARTSYS;
+
+	if (s->error) {
+		res = s->error;
+		goto out;
+	}
+
+	while (done < count) {
+		b = pos / HV_SNAP_BLOCK;
+		n = min_t(u64, count - done,
+			HV_SNAP_BLOCK - pos % HV_SNAP_BLOCK);
+
+		copy = radix_tree_lookup(&s->copies, b);
+		if (copy) {
+			src = copy->data + pos % HV_SNAP_BLOCK;
+		} else {
+			/* Unchanged since the snapshot was taken */
+			hv_cdev_backend_read(priv, pos, n);
+			src = hv_cdev_vaddr(priv, pos);
+		}
+
+		if (copy_to_user(ubuff + done, src, n)) {
+			res = -EFAULT;
+			break;
+		}
+
+		done += n;
+		pos += n;
+	}
+
+out:
+	mutex_unlock(&priv->cmutex);
+
+	if (!done)
+		return res;
+
+	*f_pos = pos;
+
+	return done;
+}
+
+/* SEEK_DATA/SEEK_HOLE walk the exported blocks */
+static loff_t hv_snap_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct hv_snap *s = filp->private_data;
+	loff_t newposition;
+	u64 b;
+
+	switch (whence) {
+	case SEEK_SET:
+		newposition = off;
+		break;
+
+	case SEEK_CUR:
+		newposition = filp->f_pos + off;
+		break;
+
+	case SEEK_END:
+		newposition = s->size + off;
+		break;
+
+	case SEEK_DATA:
+		if (off < 0 || off >= s->size)
+			return -ENXIO;
+		if (!s->export) {
+			newposition = off;
+			break;
+		}
+		b = find_next_bit(s->export, s->nblocks, off / HV_SNAP_BLOCK);
+		if (b >= s->nblocks)
+			return -ENXIO;
+		newposition = max_t(u64, off, b * HV_SNAP_BLOCK);
+		break;
+
+	case SEEK_HOLE:
+		if (off < 0 || off >= s->size)
+			return -ENXIO;
+		if (!s->export) {
+			newposition = s->size;
+			break;
+		}
+		b = find_next_zero_bit(s->export, s->nblocks,
+				off / HV_SNAP_BLOCK);
+		newposition = min_t(u64, s->size,
+				max_t(u64, off, b * HV_SNAP_BLOCK));
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	if (newposition < 0)
+		return -EINVAL;
+
+	filp->f_pos = newposition;
+
+	return newposition;
+}
+
+static int hv_snap_release(struct inode *inode, struct file *filp)
+{
+	struct hv_snap *s = filp->private_data;
+	hv_cdev_private *priv = s->priv;
+
+	mutex_lock(&priv->cmutex);
+	priv->snap = NULL;
+	mutex_unlock(&priv->cmutex);
+
+	hv_snap_free(s);
+
+	PINFO("%s:\n", __func__);
+
+	return 0;
+}
+
+static const struct file_operations hv_snap_fops = {
+	.owner		= THIS_MODULE,
+	.read		= hv_snap_read,
+	.llseek		= hv_snap_llseek,
+	.release	= hv_snap_release,
+};
+
+/*
+ * Returns the snapshot fd; req->nblocks is set to the blocks exported
+ * and req is copied back to ureq before the fd is installed.
+ */
+int hv_snap_create(hv_cdev_private *priv, struct hv_mmls_snapshot *req,
+		struct hv_mmls_snapshot __user *ureq)
+{
+	struct hv_snap *s;
+	struct file *file;
+	unsigned long *fresh;
+	u64 nblocks = hv_snap_nblocks(priv);
+	int fd, res;
+
+	/* The block device writes without going through hv_snap_write() */
+	if (priv->comp || priv->blk)
+		return -EOPNOTSUPP;
+
+	if (req->flags & ~HV_MMLS_SNAP_INCR)
+		return -EINVAL;
+
+	/* The load-time pass changes blocks behind copy-on-write */
+	hv_scrub_wait(priv, 0, priv->dev_size);
+
+	/* Allocate outside cmutex so writers only wait for the swap */
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	fresh = vzalloc(BITS_TO_LONGS(nblocks) * sizeof(long));
+	if (!s || !fresh) {
+		kfree(s);
+		vfree(fresh);
+		return -ENOMEM;
+	}
+
+	s->priv = priv;
+	s->size = priv->dev_size;
+	s->nblocks = nblocks;
+	INIT_RADIX_TREE(&s->copies, GFP_KERNEL);
+	INIT_LIST_HEAD(&s->list);
+
+	if (mutex_lock_interruptible(&priv->cmutex)) {
+		kfree(s);
+		vfree(fresh);
+		return -ERESTARTSYS;
+	}
+
+	if (priv->snap || atomic_read(&priv->mmap_writers)) {
+		mutex_unlock(&priv->cmutex);
+		kfree(s);
+		vfree(fresh);
+		return -EBUSY;
+	}
+
+	/* Changes since the last snapshot, unless some were untracked */
+	if ((req->flags & HV_MMLS_SNAP_INCR) && priv->snap_dirty &&
+	    !priv->snap_all_dirty)
+		s->export = priv->snap_dirty;
+	else
+		vfree(priv->snap_dirty);
+
+	priv->snap_dirty = fresh;
+	priv->snap_all_dirty = false;
+	priv->snap = s;
+
+	mutex_unlock(&priv->cmutex);
+
+	req->nblocks = s->export ? bitmap_weight(s->export, nblocks) : nblocks;
+	req->block_size = HV_SNAP_BLOCK;
+
+	/* Nothing reaches the fd table until the caller has its copy */
+	res = get_unused_fd_flags(O_CLOEXEC);
+	if (res < 0)
+		goto undo;
+	fd = res;
+
+	if (copy_to_user(ureq, req, sizeof(*req))) {
+		res = -EFAULT;
+		goto put_fd;
+	}
+
+	file = anon_inode_getfile("[hv_snap]", &hv_snap_fops, s, O_RDONLY);
+	if (IS_ERR(file)) {
+		res = PTR_ERR(file);
+		goto put_fd;
+	}
+
+	fd_install(fd, file);
+
+	PINFO("%s: fd=%d, %llu of %llu blocks to export\n", __func__, fd,
+		req->nblocks, nblocks);
+
+	return fd;
+
+put_fd:
+	put_unused_fd(fd);
+undo:
+	/* Hand the changed blocks to the next snapshot */
+	mutex_lock(&priv->cmutex);
+	priv->snap = NULL;
+	if (s->export)
+		bitmap_or(priv->snap_dirty, priv->snap_dirty, s->export,
+			nblocks);
+	else
+		priv->snap_all_dirty = true;
+	mutex_unlock(&priv->cmutex);
+
+	hv_snap_free(s);
+	return res;
+}
+
+void hv_snap_exit(hv_cdev_private *priv)
+{
+	vfree(priv->snap_dirty);
+	priv->snap_dirty = NULL;
+}
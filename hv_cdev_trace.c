@@ -0,0 +1,233 @@
+/*
+ *
+ *  I/O trace capture.
+ *
+ *  HV_MMLS_TRACE starts a capture and returns its fd. mmap() of the fd
+ *  gives one ring per possible CPU, ring_bytes apart: a page holding
+ *  struct hv_mmls_trace_ring, then nrecs struct hv_mmls_trace_rec.
+ *  Each read(), write(), device-side op and mmap() of the device adds
+ *  a record to the ring of the CPU it finished on. The kernel advances
+ *  head, the reader advances tail; records that find a ring full are
+ *  counted in dropped instead.
+ *
+ *  Records hold the op, offsets, length, start time, latency and
+ *  thread id, never data. Closing the fd ends the capture. One capture
+ *  runs at a time. userspace_app/hv_trace.c records and replays them.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define HV_TRACE_DEF_KB		1024
+#define HV_TRACE_MAX_KB		(64 * 1024)
+
+struct hv_trace {
+	hv_cdev_private *priv;
+	void *area;			/* vmalloc_user, all rings */
+	unsigned long ring_bytes;
+	u32 nrecs;
+	struct rcu_head rcu;
+};
+
+static inline struct hv_mmls_trace_ring *hv_trace_ring(struct hv_trace *t,
+		int cpu)
+{
+	return t->area + (unsigned long)cpu * t->ring_bytes;
+}
+
+/* Called when an op completes; t0 is from hv_trace_clock() at its start */
+void hv_trace_rec(hv_cdev_private *priv, u8 op, u64 off, u64 len, u64 arg,
+		long res, u64 t0)
+{
+	struct hv_mmls_trace_ring *ring;
+	struct hv_mmls_trace_rec *rec;
+	struct hv_trace *t;
+	u64 head, now;
+
+	if (!t0)
+		return;
+
+	now = ktime_get_ns();
+
+	rcu_read_lock();
+	t = rcu_dereference(priv->trace);
+	if (!t)
+		goto out;
+
+	/* One writer per ring: this CPU, with preemption off */
+	ring = hv_trace_ring(t, get_cpu());
+	head = ring->head;
+	if (head - READ_ONCE(ring->tail) >= t->nrecs) {
+		ring->dropped++;
+		put_cpu();
+		goto out;
+	}
+
+	rec = (struct hv_mmls_trace_rec *)((void *)ring + PAGE_SIZE) +
+		(head & (t->nrecs - 1));
+	rec->ts_ns = t0;
+	rec->offset = off;
+	rec->arg = arg;
+	rec->len = min_t(u64, len, U32_MAX);
+	rec->lat_ns = min_t(u64, now - t0, U32_MAX);
+	rec->tid = task_pid_nr(current);
+	rec->op = op;
+	rec->flags = res < 0 ? HV_MMLS_TRACE_ERR : 0;
+
+	/* Record before head, for the reader on another CPU */
+	smp_wmb();
+	WRITE_ONCE(ring->head, head + 1);
+	put_cpu();
+out:
+	rcu_read_unlock();
+}
+
+static int hv_trace_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct hv_trace *t = filp->private_data;
+
+	return remap_vmalloc_range(vma, t->area, vma->vm_pgoff);
+}
+
+static void hv_trace_free(struct rcu_head *rcu)
+{
+	struct hv_trace *t = container_of(rcu, struct hv_trace, rcu);
+
+	vfree(t->area);
+	kfree(t);
+}
+
+static int hv_trace_release(struct inode *inode, struct file *filp)
+{
+	struct hv_trace *t = filp->private_data;
+	hv_cdev_private *priv = t->priv;
+
+	mutex_lock(&priv->cmutex);
+	rcu_assign_pointer(priv->trace, NULL);
+	mutex_unlock(&priv->cmutex);
+
+	/* Writers may still hold it under rcu_read_lock() */
+	call_rcu(&t->rcu, hv_trace_free);
+
+	PINFO("%s:\n", __func__);
+
+	return 0;
+}
+
+static const struct file_operations hv_trace_fops = {
+	.owner		= THIS_MODULE,
+	.mmap		= hv_trace_mmap,
+	.release	= hv_trace_release,
+};
+
+/*
+ * Returns the capture fd; req->nr_rings and req->ring_bytes are set
+ * and req is copied back to ureq before the fd is installed.
+ */
+int hv_trace_start(hv_cdev_private *priv, struct hv_mmls_trace *req,
+		struct hv_mmls_trace __user *ureq)
+{
+	struct hv_trace *t;
+	struct file *file;
+	unsigned int kb = req->ring_kb ? req->ring_kb : HV_TRACE_DEF_KB;
+	unsigned int cpu;
+	u32 nrecs;
+	int fd, res;
+
+	if (kb > HV_TRACE_MAX_KB)
+		return -EINVAL;
+
+	nrecs = rounddown_pow_of_two(max_t(u32,
+			((u32)kb << 10) / sizeof(struct hv_mmls_trace_rec), 64));
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	t->priv = priv;
+	t->nrecs = nrecs;
+	t->ring_bytes = PAGE_SIZE +
+		PAGE_ALIGN(nrecs * sizeof(struct hv_mmls_trace_rec));
+	t->area = vmalloc_user(t->ring_bytes * nr_cpu_ids);
+	if (!t->area) {
+		kfree(t);
+		return -ENOMEM;
+	}
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		hv_trace_ring(t, cpu)->nrecs = nrecs;
+		hv_trace_ring(t, cpu)->cpu = cpu;
+	}
+
+	req->nr_rings = nr_cpu_ids;
+	req->ring_bytes = t->ring_bytes;
+
+	/* Nothing reaches the fd table until the caller has its copy */
+	res = get_unused_fd_flags(O_CLOEXEC);
+	if (res < 0)
+		goto free;
+	fd = res;
+
+	/* Outside cmutex: the copy may fault */
+	if (copy_to_user(ureq, req, sizeof(*req))) {
+		res = -EFAULT;
+		goto put_fd;
+	}
+
+	if (mutex_lock_interruptible(&priv->cmutex)) {
+		res = -ERESTARTSYS;
+		goto put_fd;
+	}
+
+	if (rcu_access_pointer(priv->trace)) {
+		res = -EBUSY;
+		goto unlock;
+	}
+
+	file = anon_inode_getfile("[hv_trace]", &hv_trace_fops, t, O_RDWR);
+	if (IS_ERR(file)) {
+		res = PTR_ERR(file);
+		goto unlock;
+	}
+
+	/* Close of the fd from another thread waits for cmutex */
+	rcu_assign_pointer(priv->trace, t);
+	fd_install(fd, file);
+	mutex_unlock(&priv->cmutex);
+
+	PINFO("%s: %u rings of %u records\n", __func__, nr_cpu_ids, nrecs);
+
+	return fd;
+
+unlock:
+	mutex_unlock(&priv->cmutex);
+put_fd:
+	put_unused_fd(fd);
+free:
+	vfree(t->area);
+	kfree(t);
+	return res;
+}
+
+/* Let hv_trace_free() callbacks finish before the module goes */
+void hv_trace_exit(void)
+{
+	rcu_barrier();
+}
@@ -0,0 +1,360 @@
+/*
+ *
+ *  Crash-atomic multi-range updates with an undo log.
+ *
+ *  With hv_txn_log_kb set, the end of the device is kept back for an
+ *  undo log and dev_size shrinks to match. HV_MMLS_TXN then applies a
+ *  vector of (offset, data) updates in four steps, each ended by one
+ *  fence:
+ *
+ *    1. copy the old contents of every range into the log
+ *    2. store the record count in the log header: the log is open
+ *    3. copy the new data into place
+ *    4. store a record count of 0: the log is closed
+ *
+ *  All stores are non-temporal, so only the bytes that change are
+ *  written back, never whole ranges. If power is lost while the log is
+ *  open, loading the module puts the old contents back, newest record
+ *  first, before anything else reads the device.
+ *
+ *  The log sits at a fixed place for a given hv_txn_log_kb; change it
+ *  only after a clean unload. Not available in compressed mode.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "hv_cdev.h"
+#include <linux/crc32c.h>
+#include <linux/mm.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+
+static unsigned int hv_txn_log_kb;
+module_param(hv_txn_log_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(hv_txn_log_kb, "Undo log for HV_MMLS_TXN, taken from the end of the device (default 0 = off)");
+
+#define HV_TXN_MAGIC	0x4f444e55534c4d4dULL	/* "MMLSUNDO" */
+
+/* Keeps dev_size aligned for hv_pgmap and the block device */
+#define HV_TXN_ALIGN	SZ_2M
+
+/* Records start on their own cache line, away from the commit word */
+#define HV_TXN_REC_START	64
+
+struct hv_txn_hdr {
+	u64 magic;
+	u64 log_size;		/* bytes, header included */
+	u64 seq;		/* transactions committed */
+	u64 nrec;		/* != 0: updates in flight, roll back */
+};
+
+/* Followed by len bytes of old data, padded to 8 */
+struct hv_txn_rec {
+	u64 offset;
+	u32 len;
+	u32 crc;		/* crc32c of offset, len and data */
+};
+
+struct hv_txn {
+	struct hv_txn_hdr *hdr;		/* device memory at log_off */
+	u64 log_off;
+	u64 log_size;
+};
+
+static u64 hv_txn_rec_size(u64 len)
+{
+	return sizeof(struct hv_txn_rec) + round_up(len, 8);
+}
+
+static u32 hv_txn_rec_crc(const struct hv_txn_rec *rec, const void *data)
+{
+	u32 crc = crc32c(~0, rec, offsetof(struct hv_txn_rec, crc));
+
+	return crc32c(crc, data, rec->len);
+}
+
+/* A single 8-byte store, durable after the caller's wmb() */
+static void hv_txn_store(u64 *p, u64 v)
+{
+	hv_cdev_memcpy_nt(p, &v, sizeof(v));
+}
+
+static void hv_txn_sync_hdr(hv_cdev_private *priv)
+{
+	wmb();
+	hv_cdev_backend_write(priv, priv->txn->log_off,
+			sizeof(struct hv_txn_hdr));
+}
+
+/* Put back the old contents of an open log. Called at load. */
+static void hv_txn_recover(hv_cdev_private *priv)
+{
+	struct hv_txn *t = priv->txn;
+	u8 *log = (u8 *)t->hdr;
+	struct hv_txn_rec *rec;
+	u64 n = t->hdr->nrec;
+	u64 pos = HV_TXN_REC_START;
+	u64 i, bad = 0;
+	u64 *at;
+
+	if (!n)
+		return;
+
+	if (n > HV_MMLS_TXN_MAX_VEC) {
+		PERR("%s: log header is damaged, nothing rolled back\n",
+			__func__);
+		goto close;
+	}
+
+	at = kmalloc_array(n, sizeof(u64), GFP_KERNEL);
+	if (!at) {
+		PERR("%s: no memory, nothing rolled back\n", __func__);
+		goto close;
+	}
+
+	for (i = 0; i < n; i++) {
+		rec = (struct hv_txn_rec *)(log + pos);
+		if (pos + sizeof(*rec) > t->log_size ||
+		    hv_txn_rec_size(rec->len) > t->log_size - pos)
+			break;
+		at[i] = pos;
+		pos += hv_txn_rec_size(rec->len);
+	}
+	bad = n - i;
+	n = i;
+
+	/* Newest first, so overlapping updates unwind in order */
+	while (n--) {
+		rec = (struct hv_txn_rec *)(log + at[n]);
+
+		if (rec->offset >= priv->dev_size ||
+		    rec->len > priv->dev_size - rec->offset ||
+		    hv_txn_rec_crc(rec, rec + 1) != rec->crc) {
+			PERR("%s: undo record %llu is damaged, skipped\n",
+				__func__, n);
+			bad++;
+			continue;
+		}
+
+		hv_cdev_memcpy_nt(hv_cdev_vaddr(priv, rec->offset), rec + 1,
+				rec->len);
+		wmb();
+		hv_cdev_backend_write(priv, rec->offset, rec->len);
+	}
+
+	kfree(at);
+
+	PINFO("%s: rolled back an interrupted transaction, %llu records bad\n",
+		__func__, bad);
+close:
+	hv_txn_store(&t->hdr->nrec, 0);
+	hv_txn_sync_hdr(priv);
+}
+
+/*
+ * Called at load after hv_comp_init(), before anything else is sized
+ * by dev_size or reads the device. Shrinks dev_size by the log.
+ */
+int hv_txn_init(hv_cdev_private *priv)
+{
+	struct hv_txn *t;
+	u64 log_bytes = (u64)hv_txn_log_kb << 10;
+	u64 log_off;
+
+	if (!hv_txn_log_kb || use_static_buff)
+		return 0;
+
+	/* The log holds raw offsets, which compression remaps */
+	if (priv->comp) {
+		PERR("%s: not available in compressed mode\n", __func__);
+		return 0;
+	}
+
+	if (log_bytes >= priv->dev_size)
+		return -EINVAL;
+
+	log_off = round_down(priv->dev_size - log_bytes, HV_TXN_ALIGN);
+	if (!log_off) {
+		PERR("%s: device too small for a %u KB log\n", __func__,
+			hv_txn_log_kb);
+		return -EINVAL;
+	}
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	t->log_off = log_off;
+	t->log_size = priv->dev_size - log_off;
+	t->hdr = hv_cdev_vaddr(priv, log_off);
+
+	priv->txn = t;
+	priv->dev_size = log_off;
+
+	hv_cdev_backend_read(priv, log_off, t->log_size);
+
+	if (t->hdr->magic == HV_TXN_MAGIC && t->hdr->log_size == t->log_size) {
+		hv_txn_recover(priv);
+	} else {
+		memset(t->hdr, 0, sizeof(*t->hdr));
+		t->hdr->log_size = t->log_size;
+		clflush_cache_range(t->hdr, sizeof(*t->hdr));
+		wmb();
+		hv_txn_store(&t->hdr->magic, HV_TXN_MAGIC);
+		hv_txn_sync_hdr(priv);
+
+		PINFO("%s: formatted new log\n", __func__);
+	}
+
+	PINFO("%s: %llu byte undo log at %llu, %llu transactions so far\n",
+		__func__, t->log_size, t->log_off, t->hdr->seq);
+
+	return 0;
+}
+
+void hv_txn_exit(hv_cdev_private *priv)
+{
+	kfree(priv->txn);
+	priv->txn = NULL;
+}
+
+/* Steps 1 to 4 above. Called with cmutex held. */
+static void hv_txn_commit(hv_cdev_private *priv,
+		const struct hv_mmls_txn_vec *vec, u32 nvec, const u8 *data)
+{
+	struct hv_txn *t = priv->txn;
+	u8 *log = (u8 *)t->hdr;
+	struct hv_txn_rec rec;
+	u64 pos = HV_TXN_REC_START;
+	const u8 *p;
+	u32 i;
+
+	for (i = 0; i < nvec; i++) {
+		p = hv_cdev_vaddr(priv, vec[i].offset);
+
+		hv_cdev_backend_read(priv, vec[i].offset, vec[i].len);
+		hv_snap_write(priv, vec[i].offset, vec[i].len);
+
+		rec.offset = vec[i].offset;
+		rec.len = vec[i].len;
+		rec.crc = hv_txn_rec_crc(&rec, p);
+
+		hv_cdev_memcpy_nt(log + pos, &rec, sizeof(rec));
+		hv_cdev_memcpy_nt(log + pos + sizeof(rec), p, rec.len);
+		pos += hv_txn_rec_size(rec.len);
+	}
+	wmb();
+	hv_cdev_backend_write(priv, t->log_off + HV_TXN_REC_START,
+			pos - HV_TXN_REC_START);
+
+	hv_txn_store(&t->hdr->nrec, nvec);
+	hv_txn_sync_hdr(priv);
+
+	for (i = 0, p = data; i < nvec; p += vec[i].len, i++)
+		hv_cdev_memcpy_nt(hv_cdev_vaddr(priv, vec[i].offset), p,
+				vec[i].len);
+	wmb();
+
+	for (i = 0; i < nvec; i++) {
+		hv_cdev_backend_write(priv, vec[i].offset, vec[i].len);
+		hv_csum_update(priv, vec[i].offset, vec[i].len);
+		hv_heat_io(priv, vec[i].offset, vec[i].len);
+	}
+
+	hv_txn_store(&t->hdr->seq, t->hdr->seq + 1);
+	hv_txn_store(&t->hdr->nrec, 0);
+	hv_txn_sync_hdr(priv);
+}
+
+/* HV_MMLS_TXN; t0 is from hv_trace_clock() */
+int hv_txn_run(hv_cdev_file *hfile, struct hv_mmls_txn *req, u64 t0)
+{
+	hv_cdev_private *priv = hfile->priv;
+	struct hv_txn *t = priv->txn;
+	struct hv_mmls_txn_vec *vec;
+	u64 need = HV_TXN_REC_START, total = 0;
+	u8 *data = NULL, *p;
+	u32 i, held = 0;
+	int res;
+
+	if (!t)
+		return -EOPNOTSUPP;
+
+	if (req->flags || !req->nvec || req->nvec > HV_MMLS_TXN_MAX_VEC)
+		return -EINVAL;
+
+	req->log_bytes = t->log_size - HV_TXN_REC_START;
+
+	vec = kcalloc(req->nvec, sizeof(*vec), GFP_KERNEL);
+	if (!vec)
+		return -ENOMEM;
+
+	if (copy_from_user(vec, (void __user *)(unsigned long)req->vec,
+				req->nvec * sizeof(*vec))) {
+		res = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < req->nvec; i++) {
+		if (!vec[i].len || vec[i].len > U32_MAX) {
+			res = -EINVAL;
+			goto out;
+		}
+
+		/* Held until the commit is done, as for the other ops */
+		res = hv_cdev_get_range(hfile, vec[i].offset, vec[i].len);
+		if (res)
+			goto out;
+		held++;
+
+		need += hv_txn_rec_size(vec[i].len);
+		total += vec[i].len;
+	}
+
+	if (need > t->log_size) {
+		res = -ENOSPC;
+		goto out;
+	}
+
+	/* All user data in hand first; a fault must not stop it halfway */
+	data = kvmalloc(total, GFP_KERNEL);
+	if (!data) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, p = data; i < req->nvec; p += vec[i].len, i++) {
+		if (copy_from_user(p, (void __user *)(unsigned long)vec[i].data,
+					vec[i].len)) {
+			res = -EFAULT;
+			goto out;
+		}
+	}
+
+	if (mutex_lock_interruptible(&priv->cmutex)) {
+		res = -ERESTARTSYS;
+		goto out;
+	}
+
+	hv_txn_commit(priv, vec, req->nvec, data);
+
+	mutex_unlock(&priv->cmutex);
+	res = 0;
+out:
+	while (held--)
+		hv_cdev_put_range(hfile, vec[held].offset, vec[held].len);
+	hv_trace_rec(priv, HV_MMLS_TRACE_TXN, vec[0].offset, total,
+			req->nvec, res, t0);
+	kvfree(data);
+	kfree(vec);
+
+	return res;
+}
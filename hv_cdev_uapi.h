@@ -69,11 +69,272 @@ struct hv_mmls_range {
 	uint64_t size; 		/* size of memory to be flushed */
 };
 
+/* Same values as POSIX_FADV_* */
+#define HV_MMLS_ADV_NORMAL	0
+#define HV_MMLS_ADV_RANDOM	1
+#define HV_MMLS_ADV_SEQUENTIAL	2
+#define HV_MMLS_ADV_WILLNEED	3
+#define HV_MMLS_ADV_DONTNEED	4
+
+struct hv_mmls_advise {
+	uint64_t offset;
+	uint64_t size;		/* 0 = up to end of device */
+	uint32_t advice;	/* HV_MMLS_ADV_* */
+	uint32_t reserved;
+};
+
+struct hv_mmls_fill {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t pattern;	/* repeated every 8 bytes from offset */
+};
+
+struct hv_mmls_copy {
+	uint64_t src;		/* device offsets, may overlap */
+	uint64_t dst;
+	uint64_t size;
+};
+
+struct hv_mmls_crc {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t seed;		/* in: initial crc32c value */
+	uint32_t crc;		/* out */
+};
+
+/* hv_mmls_compare.result when both ranges are equal */
+#define HV_MMLS_CMP_EQUAL	(~(uint64_t)0)
+
+struct hv_mmls_compare {
+	uint64_t offset1;
+	uint64_t offset2;
+	uint64_t size;
+	uint64_t result;	/* out: first differing byte, relative */
+};
+
+struct hv_mmls_csum {
+	uint64_t offset;	/* first block is the one holding offset */
+	uint64_t nblocks;	/* entries in table */
+	uint64_t table;		/* user pointer to uint32_t[nblocks] */
+	uint32_t block_size;	/* out: bytes covered by one entry */
+	uint32_t reserved;
+	uint64_t errors;	/* out: blocks that failed verify so far */
+};
+
+/* hv_mmls_alloc.flags */
+#define HV_MMLS_ALLOC_HUGE	0x1	/* 2MB aligned */
+
+struct hv_mmls_alloc {
+	uint64_t size;		/* rounded up to a power-of-two of pages */
+	uint64_t align;		/* power of two, 0 = page */
+	uint32_t flags;		/* HV_MMLS_ALLOC_* */
+	uint32_t reserved;
+	uint64_t offset;	/* out: device offset, use as mmap offset */
+	uint64_t alloc_size;	/* out: real extent size */
+};
+
+/* hv_mmls_async.op */
+#define HV_MMLS_ASYNC_FLUSH	1
+#define HV_MMLS_ASYNC_FILL	2
+#define HV_MMLS_ASYNC_COPY	3
+
+struct hv_mmls_async {
+	uint32_t op;		/* HV_MMLS_ASYNC_* */
+	uint32_t reserved;
+	uint64_t tag;		/* echoed back in hv_mmls_event */
+	union {
+		struct hv_mmls_range range;
+		struct hv_mmls_fill fill;
+		struct hv_mmls_copy copy;
+	};
+};
+
+/* Completion record of an HV_MMLS_ASYNC op */
+struct hv_mmls_event {
+	uint64_t tag;
+	uint32_t op;
+	int32_t result;		/* 0 or -errno */
+};
+
+/*
+ * Compression statistics (hv_compress=1). Ratio of the data written
+ * so far is logical_bytes / stored_bytes; live space use is
+ * used_bytes out of physical_bytes.
+ */
+struct hv_mmls_comp_stats {
+	uint64_t logical_bytes;		/* chunk bytes written */
+	uint64_t stored_bytes;		/* bytes they took on the device */
+	uint64_t raw_chunks;		/* chunks stored uncompressed */
+	uint64_t compress_ns;
+	uint64_t decompress_ns;
+	uint64_t used_bytes;		/* slots in use now */
+	uint64_t physical_bytes;	/* slot area size */
+};
+
+/* Export only blocks written since the previous snapshot */
+#define HV_MMLS_SNAP_INCR	0x1
+
+/*
+ * HV_MMLS_SNAPSHOT returns a read-only fd holding a point-in-time copy
+ * of the device. SEEK_DATA/SEEK_HOLE on it find the exported blocks.
+ */
+struct hv_mmls_snapshot {
+	uint32_t flags;		/* HV_MMLS_SNAP_* */
+	uint32_t reserved;
+	uint64_t nblocks;	/* out: blocks exported */
+	uint64_t block_size;	/* out */
+};
+
+/* hv_mmls_qos.qos_class */
+#define HV_MMLS_QOS_LATENCY	0	/* never sliced or throttled */
+#define HV_MMLS_QOS_NORMAL	1	/* default */
+#define HV_MMLS_QOS_BULK	2	/* streaming, yields to latency */
+
+/*
+ * Per-file QoS for read()/write(). bw_bps and iops of 0 mean
+ * unlimited; for HV_MMLS_QOS_BULK a bw_bps of 0 takes the device
+ * default from sysfs qos_bulk_bps. burst is in bytes, 0 = 100ms.
+ * Rates are capped at 2^50 per second and bursts at 16 GB.
+ */
+struct hv_mmls_qos {
+	uint32_t qos_class;	/* HV_MMLS_QOS_* */
+	uint32_t reserved;
+	uint64_t bw_bps;
+	uint64_t iops;
+	uint64_t burst;
+};
+
+/* Per-file QoS counters */
+struct hv_mmls_qos_stats {
+	uint64_t bytes;		/* moved by read/write */
+	uint64_t slices;	/* extra slices calls were cut into */
+	uint64_t throttled;	/* slices held back by a rate limit */
+	uint64_t throttled_ns;
+	uint64_t preempted;	/* slices that waited for latency I/O */
+};
+
+/*
+ * Heat table, the mmap() of the fd from HV_MMLS_HEAT: this header,
+ * then nregions struct hv_mmls_heat_region. Counts are halved every
+ * interval_ms, after which epoch is bumped.
+ */
+#define HV_MMLS_HEAT_MAGIC	0x54414548534c4d4dULL	/* "MMLSHEAT" */
+
+struct hv_mmls_heat_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t region_shift;	/* region size is 1 << region_shift */
+	uint64_t nregions;
+	uint64_t epoch;
+	uint32_t interval_ms;
+	uint32_t reserved[7];
+};
+
+struct hv_mmls_heat_region {
+	uint32_t io;		/* read()/write() calls touching the region */
+	uint32_t map;		/* page faults through mmap() */
+};
+
+/* hv_mmls_trace_rec.op */
+#define HV_MMLS_TRACE_READ	1
+#define HV_MMLS_TRACE_WRITE	2
+#define HV_MMLS_TRACE_FLUSH	3
+#define HV_MMLS_TRACE_FILL	4	/* arg = pattern */
+#define HV_MMLS_TRACE_COPY	5	/* offset = src, arg = dst */
+#define HV_MMLS_TRACE_CRC	6
+#define HV_MMLS_TRACE_COMPARE	7	/* arg = offset2 */
+#define HV_MMLS_TRACE_MMAP	8	/* arg = 1 if writable */
+#define HV_MMLS_TRACE_TXN	9	/* offset = first update, arg = nvec */
+
+/* hv_mmls_trace_rec.flags */
+#define HV_MMLS_TRACE_ERR	0x1
+
+/*
+ * HV_MMLS_TRACE starts an I/O capture and returns its fd. Its mmap()
+ * holds nr_rings rings, ring_bytes apart, each a page with this header
+ * followed by nrecs records. Records from head - tail to head are
+ * valid; the reader advances tail.
+ */
+struct hv_mmls_trace {
+	uint32_t ring_kb;	/* records per CPU, in KB; 0 = 1024 */
+	uint32_t nr_rings;	/* out */
+	uint64_t ring_bytes;	/* out */
+};
+
+struct hv_mmls_trace_ring {
+	uint64_t head;		/* written by the driver */
+	uint64_t tail;		/* written by the reader */
+	uint64_t dropped;	/* records lost to a full ring */
+	uint32_t nrecs;		/* power of 2 */
+	uint32_t cpu;
+};
+
+struct hv_mmls_trace_rec {
+	uint64_t ts_ns;		/* CLOCK_MONOTONIC at start */
+	uint64_t offset;
+	uint64_t arg;		/* per op, see HV_MMLS_TRACE_* */
+	uint32_t len;
+	uint32_t lat_ns;
+	uint32_t tid;
+	uint8_t op;		/* HV_MMLS_TRACE_* */
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+/*
+ * HV_MMLS_TXN applies nvec updates so that after a power loss either
+ * all of them or none are on the device. Needs hv_txn_log_kb. Each
+ * update takes 16 bytes of the log plus its length rounded up to 8.
+ */
+#define HV_MMLS_TXN_MAX_VEC	256
+
+struct hv_mmls_txn_vec {
+	uint64_t offset;
+	uint64_t len;
+	uint64_t data;		/* user pointer to len bytes */
+};
+
+struct hv_mmls_txn {
+	uint32_t nvec;
+	uint32_t flags;		/* must be 0 */
+	uint64_t vec;		/* user pointer to hv_mmls_txn_vec[nvec] */
+	uint64_t log_bytes;	/* out: log capacity */
+};
+
 /* ADR device size */
 #define HV_MMLS_SIZE		_IOR('p', 0x01, unsigned long)
 /* ADR flush range */
 #define HV_MMLS_FLUSH_RANGE	_IOW('p', 0x02, struct hv_mmls_range)
 /* Dump n-bytes of mem */
 #define HV_MMLS_DUMP_MEM	_IOW('p', 0x03, struct hv_mmls_range)
+/* Access pattern hint for readahead, see HV_MMLS_ADV_* */
+#define HV_MMLS_ADVISE		_IOW('p', 0x04, struct hv_mmls_advise)
+/* Device-side fill, copy, checksum and compare */
+#define HV_MMLS_FILL		_IOW('p', 0x05, struct hv_mmls_fill)
+#define HV_MMLS_COPY		_IOW('p', 0x06, struct hv_mmls_copy)
+#define HV_MMLS_CRC		_IOWR('p', 0x07, struct hv_mmls_crc)
+#define HV_MMLS_COMPARE		_IOWR('p', 0x08, struct hv_mmls_compare)
+/* Per-block crc32c table, needs hv_csum=1 */
+#define HV_MMLS_CSUM_GET	_IOWR('p', 0x09, struct hv_mmls_csum)
+/* Per-file extents, needs hv_arena=1 */
+#define HV_MMLS_ALLOC		_IOWR('p', 0x0a, struct hv_mmls_alloc)
+#define HV_MMLS_FREE		_IOW('p', 0x0b, uint64_t)
+/* Background ops; completion via poll/eventfd/SIGIO + GET_EVENT */
+#define HV_MMLS_ASYNC		_IOW('p', 0x0c, struct hv_mmls_async)
+#define HV_MMLS_GET_EVENT	_IOR('p', 0x0d, struct hv_mmls_event)
+#define HV_MMLS_SET_EVENTFD	_IOW('p', 0x0e, int32_t)
+/* Compression statistics */
+#define HV_MMLS_COMP_STATS	_IOR('p', 0x0f, struct hv_mmls_comp_stats)
+/* Take a snapshot; returns its fd */
+#define HV_MMLS_SNAPSHOT	_IOWR('p', 0x10, struct hv_mmls_snapshot)
+/* Per-file QoS class and limits */
+#define HV_MMLS_SET_QOS		_IOW('p', 0x11, struct hv_mmls_qos)
+#define HV_MMLS_QOS_STATS	_IOR('p', 0x12, struct hv_mmls_qos_stats)
+/* Heat table fd, needs hv_heat=1 */
+#define HV_MMLS_HEAT		_IO('p', 0x13)
+/* Start an I/O trace capture; returns its fd */
+#define HV_MMLS_TRACE		_IOWR('p', 0x14, struct hv_mmls_trace)
+/* Crash-atomic multi-range update, needs hv_txn_log_kb */
+#define HV_MMLS_TXN		_IOWR('p', 0x15, struct hv_mmls_txn)
 
 #endif
@@ -0,0 +1,431 @@
+/*
+ *
+ *  In-kernel microbenchmark.
+ *
+ *  Runs once at insmod and prints one line per measurement:
+ *
+ *    hv_bench: <test> size=<bytes> ns/op=<n> cycles/byte=<n.nn>
+ *
+ *  Every test goes through the entry points of the driver at bench_dev:
+ *  read() and write(), the HV_MMLS_FLUSH_RANGE, FILL, COPY and CRC
+ *  ioctls, and mmap() with every page touched, so with hv_heat or
+ *  hv_pgmap loaded the per-page fault path is what is timed. read_mt
+ *  and write_mt run bench_threads threads at once on one file, so they
+ *  show the cost of waiting on cmutex. User buffers and ioctl
+ *  arguments live in an anonymous mapping of the insmod process, which
+ *  the threads borrow.
+ *
+ *  write, fill, copy and write_mt overwrite the device from offset 0,
+ *  so they only run with bench_write=1; the other tests leave its
+ *  contents alone.
+ *
+ *  Build with "make tests"; run_tests.sh loads it in a virtme VM with
+ *  bench_write=1, as the driver there only has its RAM emulation.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mman.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#include <linux/mmu_context.h>
+#endif
+#include "hv_cdev.h"
+#include "hv_cdev_uapi.h"
+
+static unsigned int bench_mb = 64;
+module_param(bench_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(bench_mb, "Largest transfer size in MB");
+
+static unsigned int bench_iters = 16;
+module_param(bench_iters, uint, S_IRUGO);
+MODULE_PARM_DESC(bench_iters, "Repetitions per measurement");
+
+static unsigned int bench_threads = 4;
+module_param(bench_threads, uint, S_IRUGO);
+MODULE_PARM_DESC(bench_threads, "Threads in the contended read/write tests");
+
+static char *bench_dev = "/dev/hv_cdev0";
+module_param(bench_dev, charp, S_IRUGO);
+MODULE_PARM_DESC(bench_dev, "Driver node to benchmark");
+
+static bool bench_write;
+module_param(bench_write, bool, S_IRUGO);
+MODULE_PARM_DESC(bench_write, "Also run write, fill and copy tests, which overwrite bench_dev from offset 0 (default 0)");
+
+/* Page-sized ops per thread in the contended tests */
+#define BENCH_MT_OPS	10000
+#define BENCH_MAX_THREADS	64
+
+struct hv_bench {
+	void __user *ubuf;		/* anonymous user mapping */
+	void __user *uarg;		/* last page of it, for ioctl args */
+	struct mm_struct *mm;		/* insmod's, lent to the threads */
+	struct file *filp;
+	size_t size;			/* largest transfer */
+	u64 dev_size;
+	int res;
+};
+
+typedef void (*hv_bench_fn)(struct hv_bench *b, size_t n);
+
+static void hv_bench_report(const char *name, size_t n, u64 ops,
+		u64 ns, u64 cycles)
+{
+	u64 cpb = n ? div64_u64(cycles * 100, n * ops) : 0;
+
+	pr_info("hv_bench: %-16s size=%zu ns/op=%llu cycles/byte=%llu.%02llu\n",
+		name, n, div64_u64(ns, ops), cpb / 100, cpb % 100);
+}
+
+/* Time iters calls of fn on n bytes, after one warm-up call */
+static int hv_bench_run(struct hv_bench *b, const char *name,
+		hv_bench_fn fn, size_t n, unsigned int iters)
+{
+	cycles_t c0;
+	u64 t0, ns, cycles;
+	unsigned int i;
+
+	b->res = 0;
+	fn(b, n);
+
+	t0 = ktime_get_ns();
+	c0 = get_cycles();
+	for (i = 0; i < iters; i++)
+		fn(b, n);
+	cycles = get_cycles() - c0;
+	ns = ktime_get_ns() - t0;
+
+	if (b->res) {
+		pr_info("hv_bench: %-16s size=%zu failed, res=%d\n",
+			name, n, b->res);
+		return b->res;
+	}
+
+	hv_bench_report(name, n, iters, ns, cycles);
+	cond_resched();
+
+	return 0;
+}
+
+/* The argument is passed from user memory, as a real caller's would be */
+static int hv_bench_ioctl(struct hv_bench *b, unsigned int cmd,
+		const void *arg, size_t len)
+{
+	if (copy_to_user(b->uarg, arg, len))
+		return -EFAULT;
+
+	return b->filp->f_op->unlocked_ioctl(b->filp, cmd,
+			(unsigned long)b->uarg);
+}
+
+static void bench_flush(struct hv_bench *b, size_t n)
+{
+	struct hv_mmls_range r = { .offset = 0, .size = n };
+	int res = hv_bench_ioctl(b, HV_MMLS_FLUSH_RANGE, &r, sizeof(r));
+
+	if (res)
+		b->res = res;
+}
+
+static void bench_fill(struct hv_bench *b, size_t n)
+{
+	struct hv_mmls_fill f = {
+		.offset = 0, .size = n, .pattern = 0x5a5a5a5a5a5a5a5aULL
+	};
+	int res = hv_bench_ioctl(b, HV_MMLS_FILL, &f, sizeof(f));
+
+	if (res)
+		b->res = res;
+}
+
+static void bench_copy(struct hv_bench *b, size_t n)
+{
+	struct hv_mmls_copy c = { .src = 0, .dst = n, .size = n };
+	int res = hv_bench_ioctl(b, HV_MMLS_COPY, &c, sizeof(c));
+
+	if (res)
+		b->res = res;
+}
+
+static void bench_crc(struct hv_bench *b, size_t n)
+{
+	struct hv_mmls_crc c = { .offset = 0, .size = n, .seed = ~0U };
+	int res = hv_bench_ioctl(b, HV_MMLS_CRC, &c, sizeof(c));
+
+	if (res)
+		b->res = res;
+}
+
+static void bench_dev_read(struct hv_bench *b, size_t n)
+{
+	loff_t pos = 0;
+	ssize_t r = b->filp->f_op->read(b->filp, b->ubuf, n, &pos);
+
+	/* Short means n is past the end of the device */
+	if (r != n)
+		b->res = r < 0 ? r : -ENOSPC;
+}
+
+static void bench_dev_write(struct hv_bench *b, size_t n)
+{
+	loff_t pos = 0;
+	ssize_t r = b->filp->f_op->write(b->filp, b->ubuf, n, &pos);
+
+	/* Short means n is past the end of the device */
+	if (r != n)
+		b->res = r < 0 ? r : -ENOSPC;
+}
+
+/*
+ * Map, touch every page, unmap. Each pass starts from an empty page
+ * table, so heat and pgmap mappings take one fault per page. Loads
+ * only, so it runs without bench_write.
+ */
+static void bench_dev_mmap(struct hv_bench *b, size_t n)
+{
+	unsigned long addr;
+	size_t off;
+	u8 v;
+
+	addr = vm_mmap(b->filp, 0, n, PROT_READ, MAP_SHARED, 0);
+	if (IS_ERR_VALUE(addr)) {
+		b->res = (long)addr;
+		return;
+	}
+
+	for (off = 0; off < n; off += PAGE_SIZE) {
+		if (get_user(v, (u8 __user *)(addr + off)))
+			b->res = -EFAULT;
+	}
+
+	vm_munmap(addr, n);
+}
+
+/* Which fault path bench_dev_mmap() goes through */
+static const char *hv_bench_mmap_name(struct hv_bench *b)
+{
+	hv_cdev_file *hfile = b->filp->private_data;
+
+	if (hfile->priv->pgmap)
+		return "mmap_pgmap";
+	if (hfile->priv->heat)
+		return "mmap_heat";
+	return "mmap_remap";
+}
+
+struct hv_bench_thread {
+	struct hv_bench *b;
+	void __user *ubuf;		/* this thread's page */
+	loff_t pos;			/* and its device offset */
+	bool write;
+	int res;
+	struct completion done;
+};
+
+static int hv_bench_thread_fn(void *arg)
+{
+	struct hv_bench_thread *t = arg;
+	struct file *filp = t->b->filp;
+	loff_t pos;
+	ssize_t r;
+	int i;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_use_mm(t->b->mm);
+#else
+	use_mm(t->b->mm);
+#endif
+
+	for (i = 0; i < BENCH_MT_OPS && !t->res; i++) {
+		pos = t->pos;
+		if (t->write)
+			r = filp->f_op->write(filp, t->ubuf, PAGE_SIZE, &pos);
+		else
+			r = filp->f_op->read(filp, t->ubuf, PAGE_SIZE, &pos);
+		if (r != PAGE_SIZE)
+			t->res = r < 0 ? r : -ENOSPC;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_unuse_mm(t->b->mm);
+#else
+	unuse_mm(t->b->mm);
+#endif
+
+	complete(&t->done);
+
+	return 0;
+}
+
+/*
+ * nthreads threads read or write their own page of the device through
+ * one file at the same time. Different offsets, so they only meet on
+ * cmutex. ns/op is wall time over all ops of all threads.
+ */
+static void hv_bench_contended(struct hv_bench *b, const char *name,
+		bool write, unsigned int nthreads)
+{
+	struct hv_bench_thread *t;
+	struct task_struct *task;
+	cycles_t c0;
+	u64 t0, ns, cycles;
+	unsigned int i, started = 0;
+	int res = 0;
+
+	t = kcalloc(nthreads, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return;
+
+	t0 = ktime_get_ns();
+	c0 = get_cycles();
+	for (i = 0; i < nthreads; i++) {
+		t[i].b = b;
+		t[i].ubuf = b->ubuf + (size_t)i * PAGE_SIZE;
+		t[i].pos = (loff_t)i * PAGE_SIZE;
+		t[i].write = write;
+		init_completion(&t[i].done);
+
+		task = kthread_run(hv_bench_thread_fn, &t[i], "hv_bench/%u", i);
+		if (IS_ERR(task)) {
+			res = PTR_ERR(task);
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&t[i].done);
+		if (t[i].res)
+			res = t[i].res;
+	}
+	cycles = get_cycles() - c0;
+	ns = ktime_get_ns() - t0;
+
+	if (res || started != nthreads)
+		pr_info("hv_bench: %-16s threads=%u failed, res=%d\n", name,
+			nthreads, res);
+	else
+		hv_bench_report(name, PAGE_SIZE, (u64)nthreads * BENCH_MT_OPS,
+			ns, cycles);
+
+	kfree(t);
+}
+
+static void hv_bench_device(struct hv_bench *b)
+{
+	unsigned int nthreads;
+	size_t n, max;
+
+	/* COPY needs room for a second range after the first */
+	max = min_t(u64, b->size, b->dev_size / 2);
+	if (max < PAGE_SIZE)
+		return;
+
+	for (n = PAGE_SIZE; n <= max; n <<= 4) {
+		hv_bench_run(b, "read", bench_dev_read, n, bench_iters);
+		hv_bench_run(b, "flush_range", bench_flush, n, bench_iters);
+		hv_bench_run(b, "crc", bench_crc, n, bench_iters);
+		hv_bench_run(b, hv_bench_mmap_name(b), bench_dev_mmap, n,
+			bench_iters);
+
+		if (!bench_write)
+			continue;
+
+		hv_bench_run(b, "write", bench_dev_write, n, bench_iters);
+		hv_bench_run(b, "fill", bench_fill, n, bench_iters);
+		hv_bench_run(b, "copy", bench_copy, n, bench_iters);
+	}
+
+	nthreads = clamp_t(unsigned int, bench_threads, 1,
+			min_t(u64, BENCH_MAX_THREADS, max >> PAGE_SHIFT));
+	hv_bench_contended(b, "read_mt", false, nthreads);
+	if (bench_write)
+		hv_bench_contended(b, "write_mt", true, nthreads);
+}
+
+static int __init hv_bench_init(void)
+{
+	struct hv_bench b = { 0 };
+	unsigned long addr;
+	u64 dev_size;
+	int res = 0;
+
+	if (!bench_dev || !*bench_dev)
+		return -EINVAL;
+
+	b.size = (size_t)max(bench_mb, 1U) << 20;
+	b.mm = current->mm;
+
+	b.filp = filp_open(bench_dev, O_RDWR, 0);
+	if (IS_ERR(b.filp)) {
+		pr_info("hv_bench: %s not available, res=%ld\n", bench_dev,
+			PTR_ERR(b.filp));
+		return PTR_ERR(b.filp);
+	}
+
+	/* insmod's own mm stands in for a user process */
+	addr = vm_mmap(NULL, 0, b.size + PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (IS_ERR_VALUE(addr)) {
+		res = (long)addr;
+		goto out;
+	}
+	b.ubuf = (void __user *)addr;
+	b.uarg = b.ubuf + b.size;
+	if (clear_user(b.ubuf, b.size + PAGE_SIZE))
+		pr_info("hv_bench: could not fault in user buffer\n");
+
+	res = hv_bench_ioctl(&b, HV_MMLS_SIZE, &b.dev_size, sizeof(u64));
+	if (!res && get_user(dev_size, (u64 __user *)b.uarg))
+		res = -EFAULT;
+	if (res) {
+		pr_info("hv_bench: HV_MMLS_SIZE failed, res=%d\n", res);
+		goto unmap;
+	}
+	b.dev_size = dev_size;
+
+	pr_info("hv_bench: start, %s, %llu MB device, %zu MB max, %u iterations\n",
+		bench_dev, b.dev_size >> 20, b.size >> 20, bench_iters);
+	if (bench_write)
+		pr_warn("hv_bench: bench_write=1, overwriting the first %llu MB of %s\n",
+			min_t(u64, b.size * 2, b.dev_size) >> 20, bench_dev);
+	else
+		pr_info("hv_bench: read-only tests, bench_write=1 adds the rest\n");
+
+	hv_bench_device(&b);
+
+	pr_info("hv_bench: done\n");
+unmap:
+	vm_munmap(addr, b.size + PAGE_SIZE);
+out:
+	filp_close(b.filp, NULL);
+
+	return res;
+}
+
+static void __exit hv_bench_exit(void)
+{
+}
+
+module_init(hv_bench_init);
+module_exit(hv_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("hv_mmls driver entry point microbenchmark");
@@ -0,0 +1,429 @@
+/*
+ *
+ *  KUnit tests for code that does not need the device.
+ *
+ *  Built by "make tests" when the kernel has CONFIG_KUNIT. The buddy
+ *  allocator, the QoS token buckets and the transaction undo log are
+ *  compiled in directly so the suite does not depend on hv_mmls_cdev.ko
+ *  being loaded. The undo log runs on priv->buff, as with the driver's
+ *  static buffer, and what it calls in the rest of the driver is
+ *  stubbed out below.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include "hv_cdev.h"
+#include "hv_buddy.c"
+#include "hv_cdev_qos.c"
+#include "hv_cdev_txn.c"
+
+int use_static_buff = 1;
+
+void hv_cdev_backend_read(hv_cdev_private *priv, u64 off, u64 len)
+{
+}
+
+void hv_cdev_backend_write(hv_cdev_private *priv, u64 off, u64 len)
+{
+}
+
+int hv_cdev_get_range(hv_cdev_file *hfile, u64 off, u64 size)
+{
+	return 0;
+}
+
+void hv_cdev_put_range(hv_cdev_file *hfile, u64 off, u64 size)
+{
+}
+
+void hv_snap_write(hv_cdev_private *priv, u64 off, u64 len)
+{
+}
+
+void hv_csum_update(hv_cdev_private *priv, u64 off, u64 len)
+{
+}
+
+void hv_heat_io(hv_cdev_private *priv, u64 off, u64 len)
+{
+}
+
+void hv_trace_rec(hv_cdev_private *priv, u8 op, u64 off, u64 len, u64 arg,
+		long res, u64 t0)
+{
+}
+
+#define UNIT_SHIFT	12
+#define UNIT		(1ULL << UNIT_SHIFT)
+
+static void buddy_init_carves_all(struct kunit *test)
+{
+	struct hv_buddy b;
+	u64 off, size;
+	int i;
+
+	/* Not a power of two: 8 + 4 + 1 */
+	KUNIT_ASSERT_EQ(test, 0, hv_buddy_init(&b, 13 * UNIT, UNIT_SHIFT));
+	KUNIT_EXPECT_EQ(test, 13U, b.free_units);
+
+	for (i = 0; i < 13; i++)
+		KUNIT_EXPECT_EQ(test, 0,
+			hv_buddy_alloc(&b, UNIT, 0, &off, &size));
+
+	KUNIT_EXPECT_EQ(test, 0U, b.free_units);
+	KUNIT_EXPECT_EQ(test, -ENOMEM, hv_buddy_alloc(&b, UNIT, 0, &off, &size));
+
+	hv_buddy_destroy(&b);
+}
+
+static void buddy_alloc_rounds_and_aligns(struct kunit *test)
+{
+	struct hv_buddy b;
+	u64 off, size;
+
+	KUNIT_ASSERT_EQ(test, 0, hv_buddy_init(&b, 64 * UNIT, UNIT_SHIFT));
+
+	/* 3 units round up to 4 */
+	KUNIT_EXPECT_EQ(test, 0, hv_buddy_alloc(&b, 3 * UNIT, 0, &off, &size));
+	KUNIT_EXPECT_EQ(test, 4 * UNIT, size);
+
+	/* Alignment wins over a smaller size */
+	KUNIT_EXPECT_EQ(test, 0,
+		hv_buddy_alloc(&b, UNIT, 16 * UNIT, &off, &size));
+	KUNIT_EXPECT_EQ(test, 0ULL, off % (16 * UNIT));
+	KUNIT_EXPECT_EQ(test, 16 * UNIT, size);
+
+	KUNIT_EXPECT_EQ(test, -EINVAL, hv_buddy_alloc(&b, 0, 0, &off, &size));
+	KUNIT_EXPECT_EQ(test, -EINVAL,
+		hv_buddy_alloc(&b, UNIT, 3 * UNIT, &off, &size));
+	KUNIT_EXPECT_EQ(test, -ENOMEM,
+		hv_buddy_alloc(&b, 128 * UNIT, 0, &off, &size));
+
+	hv_buddy_destroy(&b);
+}
+
+static void buddy_free_coalesces(struct kunit *test)
+{
+	struct hv_buddy b;
+	u64 offs[16], off, size;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, 0, hv_buddy_init(&b, 16 * UNIT, UNIT_SHIFT));
+
+	for (i = 0; i < 16; i++)
+		KUNIT_ASSERT_EQ(test, 0,
+			hv_buddy_alloc(&b, UNIT, 0, &offs[i], &size));
+
+	/* Free in an order that forces merges at every level */
+	for (i = 0; i < 16; i += 2)
+		KUNIT_EXPECT_EQ(test, 0, hv_buddy_free(&b, offs[i]));
+	for (i = 1; i < 16; i += 2)
+		KUNIT_EXPECT_EQ(test, 0, hv_buddy_free(&b, offs[i]));
+
+	KUNIT_EXPECT_EQ(test, 16U, b.free_units);
+	KUNIT_EXPECT_EQ(test, 0,
+		hv_buddy_alloc(&b, 16 * UNIT, 0, &off, &size));
+	KUNIT_EXPECT_EQ(test, 0ULL, off);
+
+	hv_buddy_destroy(&b);
+}
+
+static void buddy_free_rejects_bad_offsets(struct kunit *test)
+{
+	struct hv_buddy b;
+	u64 off, size;
+
+	KUNIT_ASSERT_EQ(test, 0, hv_buddy_init(&b, 8 * UNIT, UNIT_SHIFT));
+	KUNIT_ASSERT_EQ(test, 0, hv_buddy_alloc(&b, 2 * UNIT, 0, &off, &size));
+
+	KUNIT_EXPECT_EQ(test, -EINVAL, hv_buddy_free(&b, off + 1));
+	KUNIT_EXPECT_EQ(test, -EINVAL, hv_buddy_free(&b, 8 * UNIT));
+	KUNIT_EXPECT_EQ(test, 0, hv_buddy_free(&b, off));
+	KUNIT_EXPECT_EQ(test, -EINVAL, hv_buddy_free(&b, off));
+
+	hv_buddy_destroy(&b);
+}
+
+/* Odd sizes and offsets exercise the head/tail of the nt copy */
+static void memcpy_nt_matches(struct kunit *test)
+{
+	static const size_t sizes[] = { 1, 7, 63, 64, 65, 4095, 4096, 12345 };
+	u8 *src, *dst;
+	size_t i, j, n;
+
+	src = kunit_kmalloc(test, 16384, GFP_KERNEL);
+	dst = kunit_kmalloc(test, 16384, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, src);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dst);
+
+	for (j = 0; j < 16384; j++)
+		src[j] = j * 31 + 7;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		n = sizes[i];
+		memset(dst, 0, 16384);
+		hv_cdev_memcpy_nt(dst + 3, src + 5, n);
+		wmb();
+		KUNIT_EXPECT_EQ(test, 0, memcmp(dst + 3, src + 5, n));
+		KUNIT_EXPECT_EQ(test, 0, dst[2]);
+		KUNIT_EXPECT_EQ(test, 0, dst[3 + n]);
+	}
+}
+
+static void qos_bucket_refills_to_burst(struct kunit *test)
+{
+	struct hv_qos_bucket b;
+
+	hv_qos_bucket_set(&b, 1000, 100);
+	KUNIT_EXPECT_EQ(test, 100ULL, b.tokens);
+
+	b.tokens = 0;
+	b.last_ns = 0;
+	hv_qos_bucket_refill(&b, 50 * NSEC_PER_MSEC);
+	KUNIT_EXPECT_EQ(test, 50ULL, b.tokens);
+	KUNIT_EXPECT_EQ(test, 50ULL * NSEC_PER_MSEC, b.last_ns);
+
+	/* Less than one token: the clock is not advanced */
+	hv_qos_bucket_refill(&b, 50 * NSEC_PER_MSEC + 500 * NSEC_PER_USEC);
+	KUNIT_EXPECT_EQ(test, 50ULL, b.tokens);
+	KUNIT_EXPECT_EQ(test, 50ULL * NSEC_PER_MSEC, b.last_ns);
+
+	hv_qos_bucket_refill(&b, 10 * NSEC_PER_SEC);
+	KUNIT_EXPECT_EQ(test, 100ULL, b.tokens);
+}
+
+static void qos_bucket_wait_and_take(struct kunit *test)
+{
+	struct hv_qos_bucket b;
+	u64 now = 5 * NSEC_PER_SEC;
+
+	hv_qos_bucket_set(&b, 1000, 100);
+	b.last_ns = now;
+
+	KUNIT_EXPECT_EQ(test, 0ULL, hv_qos_bucket_wait(&b, 100, now));
+	hv_qos_bucket_take(&b, 100);
+	KUNIT_EXPECT_EQ(test, 0ULL, b.tokens);
+
+	/* 10 tokens at 1000/s */
+	KUNIT_EXPECT_EQ(test, 10 * NSEC_PER_MSEC + 1,
+		hv_qos_bucket_wait(&b, 10, now));
+
+	/* Taking more than is there leaves 0, not a wrapped count */
+	b.tokens = 5;
+	hv_qos_bucket_take(&b, 10);
+	KUNIT_EXPECT_EQ(test, 0ULL, b.tokens);
+
+	/* Rate 0 is unlimited */
+	hv_qos_bucket_set(&b, 0, 0);
+	KUNIT_EXPECT_EQ(test, 0ULL, hv_qos_bucket_wait(&b, U32_MAX, now));
+}
+
+static void qos_bucket_huge_rate_is_capped(struct kunit *test)
+{
+	struct hv_qos_bucket b;
+	u64 wait;
+
+	hv_qos_bucket_set(&b, U64_MAX, U64_MAX);
+	KUNIT_EXPECT_EQ(test, HV_QOS_MAX_RATE, b.rate);
+	KUNIT_EXPECT_EQ(test, HV_QOS_MAX_BURST, b.burst);
+
+	/* 100s at the top rate must not wrap the refill */
+	b.tokens = 0;
+	b.last_ns = 0;
+	hv_qos_bucket_refill(&b, 100 * NSEC_PER_SEC);
+	KUNIT_EXPECT_EQ(test, b.burst, b.tokens);
+
+	/* Nor a wait for a whole burst */
+	b.tokens = 0;
+	b.last_ns = 100 * NSEC_PER_SEC;
+	wait = hv_qos_bucket_wait(&b, b.burst, b.last_ns);
+	KUNIT_EXPECT_EQ(test,
+		div64_u64(HV_QOS_MAX_BURST * NSEC_PER_SEC, HV_QOS_MAX_RATE) + 1,
+		wait);
+}
+
+#define TXN_DEV		(HV_CDEV_BUFF_SIZE / 2)
+
+/* Device in the first half of priv->buff, undo log in the second */
+static hv_cdev_private *txn_setup(struct kunit *test)
+{
+	hv_cdev_private *priv;
+	struct hv_txn *t;
+	int i;
+
+	priv = kunit_kzalloc(test, sizeof(*priv), GFP_KERNEL);
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, priv);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	priv->dev_size = TXN_DEV;
+	t->log_off = TXN_DEV;
+	t->log_size = HV_CDEV_BUFF_SIZE - TXN_DEV;
+	t->hdr = hv_cdev_vaddr(priv, t->log_off);
+	t->hdr->magic = HV_TXN_MAGIC;
+	t->hdr->log_size = t->log_size;
+	priv->txn = t;
+
+	for (i = 0; i < TXN_DEV; i++)
+		priv->buff[i] = i * 7;
+
+	return priv;
+}
+
+/* Commit 0x55 over vec, then reopen the log as if power was lost */
+static u8 *txn_commit_and_crash(struct kunit *test, hv_cdev_private *priv,
+		const struct hv_mmls_txn_vec *vec, u32 nvec)
+{
+	u8 *old, *data;
+	u64 total = 0;
+	u32 i;
+
+	for (i = 0; i < nvec; i++)
+		total += vec[i].len;
+
+	old = kunit_kmalloc(test, TXN_DEV, GFP_KERNEL);
+	data = kunit_kmalloc(test, total, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, old);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data);
+	memcpy(old, priv->buff, TXN_DEV);
+	memset(data, 0x55, total);
+
+	hv_txn_commit(priv, vec, nvec, data);
+	KUNIT_EXPECT_EQ(test, 0ULL, priv->txn->hdr->nrec);
+	KUNIT_EXPECT_EQ(test, 1ULL, priv->txn->hdr->seq);
+	for (i = 0; i < nvec; i++)
+		KUNIT_EXPECT_EQ(test, 0x55,
+			(u8)priv->buff[vec[i].offset + vec[i].len - 1]);
+
+	priv->txn->hdr->nrec = nvec;
+
+	return old;
+}
+
+static struct hv_txn_rec *txn_rec(hv_cdev_private *priv,
+		const struct hv_mmls_txn_vec *vec, u32 n)
+{
+	u64 pos = HV_TXN_REC_START;
+	u32 i;
+
+	for (i = 0; i < n; i++)
+		pos += hv_txn_rec_size(vec[i].len);
+
+	return (struct hv_txn_rec *)((u8 *)priv->txn->hdr + pos);
+}
+
+static void txn_rec_size_pads_to_8(struct kunit *test)
+{
+	size_t h = sizeof(struct hv_txn_rec);
+
+	KUNIT_EXPECT_EQ(test, 16UL, h);
+	KUNIT_EXPECT_EQ(test, (u64)h + 8, hv_txn_rec_size(1));
+	KUNIT_EXPECT_EQ(test, (u64)h + 8, hv_txn_rec_size(8));
+	KUNIT_EXPECT_EQ(test, (u64)h + 16, hv_txn_rec_size(9));
+}
+
+static void txn_recover_rolls_back(struct kunit *test)
+{
+	/* Overlapping, so records must unwind newest first */
+	static const struct hv_mmls_txn_vec vec[] = {
+		{ .offset = 100, .len = 50 },
+		{ .offset = 120, .len = 300 },
+		{ .offset = 4093, .len = 9 },
+	};
+	hv_cdev_private *priv = txn_setup(test);
+	u8 *old = txn_commit_and_crash(test, priv, vec, ARRAY_SIZE(vec));
+
+	hv_txn_recover(priv);
+
+	KUNIT_EXPECT_EQ(test, 0ULL, priv->txn->hdr->nrec);
+	KUNIT_EXPECT_EQ(test, 0, memcmp(priv->buff, old, TXN_DEV));
+}
+
+static void txn_recover_skips_damaged_records(struct kunit *test)
+{
+	static const struct hv_mmls_txn_vec vec[] = {
+		{ .offset = 100, .len = 50 },
+		{ .offset = 1000, .len = 64 },
+	};
+	hv_cdev_private *priv = txn_setup(test);
+	u8 *old = txn_commit_and_crash(test, priv, vec, ARRAY_SIZE(vec));
+
+	txn_rec(priv, vec, 0)->crc ^= 1;
+	hv_txn_recover(priv);
+
+	KUNIT_EXPECT_EQ(test, 0ULL, priv->txn->hdr->nrec);
+	KUNIT_EXPECT_EQ(test, 0x55, (u8)priv->buff[100]);
+	KUNIT_EXPECT_EQ(test, 0, memcmp(priv->buff + 1000, old + 1000, 64));
+}
+
+static void txn_recover_stops_at_log_end(struct kunit *test)
+{
+	static const struct hv_mmls_txn_vec vec[] = {
+		{ .offset = 100, .len = 50 },
+		{ .offset = 1000, .len = 64 },
+	};
+	hv_cdev_private *priv = txn_setup(test);
+	u8 *old = txn_commit_and_crash(test, priv, vec, ARRAY_SIZE(vec));
+
+	/* The second record runs past the log: the walk ends before it */
+	txn_rec(priv, vec, 1)->len = U32_MAX;
+	hv_txn_recover(priv);
+
+	KUNIT_EXPECT_EQ(test, 0ULL, priv->txn->hdr->nrec);
+	KUNIT_EXPECT_EQ(test, 0, memcmp(priv->buff + 100, old + 100, 50));
+	KUNIT_EXPECT_EQ(test, 0x55, (u8)priv->buff[1000]);
+}
+
+static void txn_recover_ignores_bad_header(struct kunit *test)
+{
+	static const struct hv_mmls_txn_vec vec[] = {
+		{ .offset = 100, .len = 50 },
+	};
+	hv_cdev_private *priv = txn_setup(test);
+
+	txn_commit_and_crash(test, priv, vec, ARRAY_SIZE(vec));
+
+	/* More records than a transaction can have: nothing is trusted */
+	priv->txn->hdr->nrec = HV_MMLS_TXN_MAX_VEC + 1;
+	hv_txn_recover(priv);
+
+	KUNIT_EXPECT_EQ(test, 0ULL, priv->txn->hdr->nrec);
+	KUNIT_EXPECT_EQ(test, 0x55, (u8)priv->buff[100]);
+}
+
+static struct kunit_case hv_mmls_cases[] = {
+	KUNIT_CASE(buddy_init_carves_all),
+	KUNIT_CASE(buddy_alloc_rounds_and_aligns),
+	KUNIT_CASE(buddy_free_coalesces),
+	KUNIT_CASE(buddy_free_rejects_bad_offsets),
+	KUNIT_CASE(memcpy_nt_matches),
+	KUNIT_CASE(qos_bucket_refills_to_burst),
+	KUNIT_CASE(qos_bucket_wait_and_take),
+	KUNIT_CASE(qos_bucket_huge_rate_is_capped),
+	KUNIT_CASE(txn_rec_size_pads_to_8),
+	KUNIT_CASE(txn_recover_rolls_back),
+	KUNIT_CASE(txn_recover_skips_damaged_records),
+	KUNIT_CASE(txn_recover_stops_at_log_end),
+	KUNIT_CASE(txn_recover_ignores_bad_header),
+	{}
+};
+
+static struct kunit_suite hv_mmls_suite = {
+	.name = "hv_mmls",
+	.test_cases = hv_mmls_cases,
+};
+
+kunit_test_suite(hv_mmls_suite);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,36 @@
+# Build with "make tests" first. Boots the kernel in KERN_SRC (default:
+# the running one) under virtme-ng or virtme, loads the driver on its
+# RAM emulation, runs the KUnit suite and the microbenchmark (with its
+# writing tests: the VM's device holds nothing worth keeping), and
+# prints their results. Exits non-zero if a KUnit case failed.
+#
+# usage: sh run_tests.sh [kernel build dir]
+
+KERN_SRC=${1:-/lib/modules/$(uname -r)/build/}
+OUT=$(mktemp -d)
+
+GUEST="cd $(pwd) &&
+insmod hv_mmls_cdev.ko &&
+if [ -f hv_mmls_kunit.ko ]; then insmod hv_mmls_kunit.ko; rmmod hv_mmls_kunit; fi;
+insmod hv_mmls_bench.ko bench_write=1 && rmmod hv_mmls_bench;
+rmmod hv_mmls_cdev;
+dmesg > $OUT/dmesg"
+
+if command -v vng > /dev/null; then
+	vng --run "$KERN_SRC" --rwdir "$OUT" --exec "$GUEST"
+elif command -v virtme-run > /dev/null; then
+	virtme-run --kdir "$KERN_SRC" --rwdir "$OUT" --script-sh "$GUEST"
+else
+	echo "virtme-ng or virtme is needed to run the tests"
+	exit 1
+fi
+
+grep -E "KTAP|# hv_mmls|ok [0-9]+ " $OUT/dmesg
+grep "hv_bench:" $OUT/dmesg
+
+if grep -q "not ok" $OUT/dmesg; then
+	echo "KUnit failures, full log in $OUT/dmesg"
+	exit 1
+fi
+
+rm -rf $OUT
@@ -0,0 +1,80 @@
+/*
+ *
+ *  Example for hv_mmls.hpp: several threads append to a persistent
+ *  ring log in the first MB of the device, then the log is reopened
+ *  as after a crash and replayed.
+ *
+ *  (C) 2015 Netlist, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "hv_mmls.hpp"
+
+#define LOG_SIZE	(1 << 20)
+#define N_THREADS	4
+#define N_RECORDS	1000
+
+struct entry {
+	uint32_t thread;
+	uint32_t seq;
+	char text[24];
+};
+
+int main()
+{
+	try {
+		hv::device dev;
+		hv::mapping map(dev, 0, LOG_SIZE);
+		std::vector<std::thread> threads;
+
+		printf("mmls size: %llu\n", (unsigned long long)dev.size());
+
+		hv::ring_log log(map.as<uint8_t>(0, LOG_SIZE), true);
+
+		for (uint32_t t = 0; t < N_THREADS; t++) {
+			threads.emplace_back([&log, t] {
+				struct entry e = {};
+
+				e.thread = t;
+				for (e.seq = 0; e.seq < N_RECORDS; e.seq++) {
+					snprintf(e.text, sizeof(e.text), "t%u #%u", t, e.seq);
+					if (log.append(&e, sizeof(e)) < 0)
+						break;	/* full */
+				}
+			});
+		}
+
+		for (auto &th : threads)
+			th.join();
+
+		/* Reopen without formatting, as recovery would */
+		hv::ring_log again(map.as<uint8_t>(0, LOG_SIZE), false);
+		size_t n = 0;
+
+		uint64_t end = again.for_each([&n](uint64_t, const uint8_t *, uint32_t) {
+			n++;
+		});
+
+		printf("%zu records recovered, log bytes %llu..%llu\n", n,
+		       (unsigned long long)again.head(), (unsigned long long)end);
+
+		again.consume(end);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,567 @@
+/*
+ *
+ *  Header-only C++ user-space library for the HVDIMM MMLS char driver
+ *
+ *  (C) 2015 Netlist, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Wraps the open/ioctl/mmap sequence of test.c:
+ *
+ *	hv::device dev;				// opens /dev/hv_cdev0
+ *	hv::mapping map(dev, 0, dev.size());	// mmap, unmapped on scope exit
+ *	hv::view<uint64_t> v = map.as<uint64_t>(0, 1024);
+ *	v[0] = 42;
+ *	hv::persist(&v[0], sizeof(v[0]));	// clwb + sfence
+ *
+ *	hv::ring_log log(map.as<uint8_t>(0, 1 << 20), true);
+ *	log.append(rec, sizeof(rec));		// lock-free, any thread
+ *
+ *  Needs C++17. Errors are reported by throwing std::system_error.
+ *  hv_cdev_uapi.h must be on the include path: -I to the driver source,
+ *  or wherever it was installed next to this header.
+ */
+
+#ifndef _HV_MMLS_HPP_
+#define _HV_MMLS_HPP_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+extern "C" {
+#include <hv_cdev_uapi.h>
+}
+
+namespace hv {
+
+constexpr size_t cache_line = 64;
+
+inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/*
+ * Write back the cache lines covering [addr, addr + len) and fence.
+ * Uses clwb when the compiler targets it (-mclwb or -march=native on
+ * a CPU that has it), then clflushopt, then clflush.
+ */
+inline void persist_nofence(const void *addr, size_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uintptr_t p = reinterpret_cast<uintptr_t>(addr) & ~(cache_line - 1);
+	uintptr_t end = reinterpret_cast<uintptr_t>(addr) + len;
+
+	for (; p < end; p += cache_line) {
+#if defined(__CLWB__)
+		_mm_clwb(reinterpret_cast<void *>(p));
+#elif defined(__CLFLUSHOPT__)
+		_mm_clflushopt(reinterpret_cast<void *>(p));
+#else
+		_mm_clflush(reinterpret_cast<const void *>(p));
+#endif
+	}
+#else
+	(void)addr;
+	(void)len;
+#endif
+}
+
+inline void fence()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_sfence();
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+inline void persist(const void *addr, size_t len)
+{
+	persist_nofence(addr, len);
+	fence();
+}
+
+/* Span-style typed view over mapped device memory */
+template <typename T>
+class view {
+	static_assert(std::is_trivially_copyable<T>::value,
+		      "device memory holds trivially copyable types only");
+
+public:
+	using value_type = T;
+	using iterator = T *;
+
+	view() : ptr_(nullptr), n_(0) {}
+	view(T *ptr, size_t n) : ptr_(ptr), n_(n) {}
+
+	T *data() const { return ptr_; }
+	size_t size() const { return n_; }
+	size_t size_bytes() const { return n_ * sizeof(T); }
+	bool empty() const { return n_ == 0; }
+
+	T &operator[](size_t i) const { return ptr_[i]; }
+	iterator begin() const { return ptr_; }
+	iterator end() const { return ptr_ + n_; }
+
+	view subview(size_t first, size_t count) const
+	{
+		if (first > n_ || count > n_ - first)
+			throw std::out_of_range("hv::view::subview");
+		return view(ptr_ + first, count);
+	}
+
+	/* Make stores to the whole view durable */
+	void persist() const { hv::persist(ptr_, size_bytes()); }
+
+private:
+	T *ptr_;
+	size_t n_;
+};
+
+/* Owns an open file descriptor on the device */
+class device {
+public:
+	explicit device(const char *path = "/dev/hv_cdev0", int flags = O_RDWR)
+		: fd_(::open(path, flags | O_CLOEXEC))
+	{
+		if (fd_ < 0)
+			throw_errno(path);
+	}
+
+	~device()
+	{
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	device(device &&o) noexcept : fd_(std::exchange(o.fd_, -1)) {}
+	device &operator=(device &&o) noexcept
+	{
+		if (this != &o) {
+			if (fd_ >= 0)
+				::close(fd_);
+			fd_ = std::exchange(o.fd_, -1);
+		}
+		return *this;
+	}
+
+	int fd() const { return fd_; }
+
+	uint64_t size() const
+	{
+		uint64_t sz;
+
+		ioctl_or_throw(HV_MMLS_SIZE, &sz, "HV_MMLS_SIZE");
+		return sz;
+	}
+
+	void flush(uint64_t offset, uint64_t size) const
+	{
+		struct hv_mmls_range r = { offset, size };
+
+		ioctl_or_throw(HV_MMLS_FLUSH_RANGE, &r, "HV_MMLS_FLUSH_RANGE");
+	}
+
+	void advise(uint64_t offset, uint64_t size, uint32_t advice) const
+	{
+		struct hv_mmls_advise a = {};
+
+		a.offset = offset;
+		a.size = size;
+		a.advice = advice;
+		ioctl_or_throw(HV_MMLS_ADVISE, &a, "HV_MMLS_ADVISE");
+	}
+
+	void fill(uint64_t offset, uint64_t size, uint64_t pattern) const
+	{
+		struct hv_mmls_fill f = { offset, size, pattern };
+
+		ioctl_or_throw(HV_MMLS_FILL, &f, "HV_MMLS_FILL");
+	}
+
+	void copy(uint64_t src, uint64_t dst, uint64_t size) const
+	{
+		struct hv_mmls_copy c = { src, dst, size };
+
+		ioctl_or_throw(HV_MMLS_COPY, &c, "HV_MMLS_COPY");
+	}
+
+	uint32_t crc32c(uint64_t offset, uint64_t size, uint32_t seed = ~0U) const
+	{
+		struct hv_mmls_crc c = {};
+
+		c.offset = offset;
+		c.size = size;
+		c.seed = seed;
+		ioctl_or_throw(HV_MMLS_CRC, &c, "HV_MMLS_CRC");
+		return c.crc;
+	}
+
+	/* Extent owned by this descriptor, needs hv_arena=1 */
+	struct hv_mmls_alloc alloc(uint64_t size, uint32_t flags = 0) const
+	{
+		struct hv_mmls_alloc a = {};
+
+		a.size = size;
+		a.flags = flags;
+		ioctl_or_throw(HV_MMLS_ALLOC, &a, "HV_MMLS_ALLOC");
+		return a;
+	}
+
+	void free(uint64_t offset) const
+	{
+		ioctl_or_throw(HV_MMLS_FREE, &offset, "HV_MMLS_FREE");
+	}
+
+	void ioctl_or_throw(unsigned long cmd, void *arg, const char *what) const
+	{
+		if (::ioctl(fd_, cmd, arg) < 0)
+			throw_errno(what);
+	}
+
+private:
+	int fd_;
+};
+
+/* Owns an mmap of [offset, offset + size) of the device */
+class mapping {
+public:
+	mapping(const device &dev, uint64_t offset, size_t size,
+		int prot = PROT_READ | PROT_WRITE)
+		: dev_(&dev), offset_(offset), size_(size)
+	{
+		addr_ = ::mmap(nullptr, size, prot, MAP_SHARED, dev.fd(), offset);
+		if (addr_ == MAP_FAILED)
+			throw_errno("mmap");
+	}
+
+	~mapping()
+	{
+		if (addr_ != MAP_FAILED)
+			::munmap(addr_, size_);
+	}
+
+	mapping(const mapping &) = delete;
+	mapping &operator=(const mapping &) = delete;
+
+	mapping(mapping &&o) noexcept
+		: dev_(o.dev_), offset_(o.offset_), size_(o.size_),
+		  addr_(std::exchange(o.addr_, MAP_FAILED))
+	{
+	}
+
+	uint8_t *data() const { return static_cast<uint8_t *>(addr_); }
+	size_t size() const { return size_; }
+	uint64_t offset() const { return offset_; }
+	const device &dev() const { return *dev_; }
+
+	/* count Ts starting byte_off into the mapping */
+	template <typename T>
+	view<T> as(size_t byte_off, size_t count) const
+	{
+		if (byte_off % alignof(T))
+			throw std::invalid_argument("hv::mapping::as: misaligned");
+		if (byte_off > size_ || count > (size_ - byte_off) / sizeof(T))
+			throw std::out_of_range("hv::mapping::as");
+		return view<T>(reinterpret_cast<T *>(data() + byte_off), count);
+	}
+
+	/* Driver-side flush (clflush_cache_range) of part of the mapping */
+	void flush(size_t byte_off, size_t len) const
+	{
+		dev_->flush(offset_ + byte_off, len);
+	}
+
+private:
+	const device *dev_;
+	uint64_t offset_;
+	size_t size_;
+	void *addr_;
+};
+
+/*
+ * Collects dirty ranges of a mapping and writes them back in as few
+ * HV_MMLS_FLUSH_RANGE calls as possible: ranges are sorted and
+ * merged when they overlap or are less than merge_gap bytes apart.
+ */
+class flush_batch {
+public:
+	explicit flush_batch(const mapping &map, size_t merge_gap = 4096)
+		: map_(map), gap_(merge_gap)
+	{
+	}
+
+	void add(size_t byte_off, size_t len)
+	{
+		if (len)
+			ranges_.emplace_back(byte_off, byte_off + len);
+	}
+
+	template <typename T>
+	void add(const view<T> &v)
+	{
+		add(reinterpret_cast<const uint8_t *>(v.data()) - map_.data(),
+		    v.size_bytes());
+	}
+
+	/* Returns number of ioctls issued */
+	size_t submit()
+	{
+		size_t n = 0;
+
+		std::sort(ranges_.begin(), ranges_.end());
+
+		for (size_t i = 0; i < ranges_.size();) {
+			size_t start = ranges_[i].first;
+			size_t end = ranges_[i].second;
+
+			for (++i; i < ranges_.size() &&
+				  ranges_[i].first <= end + gap_; ++i)
+				end = std::max(end, ranges_[i].second);
+
+			map_.flush(start, end - start);
+			n++;
+		}
+
+		ranges_.clear();
+		return n;
+	}
+
+private:
+	const mapping &map_;
+	size_t gap_;
+	std::vector<std::pair<size_t, size_t>> ranges_;
+};
+
+/*
+ * Lock-free multi-producer persistent append log laid out directly in
+ * a mapped region.
+ *
+ * Region layout: one header line, then a ring of cache-line aligned
+ * records. Each record starts with a 16 byte header whose commit word
+ * holds the record's absolute log position + 1 once it is durable:
+ *
+ *	[ commit | len | flags ][ payload ... ][ pad to 64 ]
+ *
+ * append() reserves space with a CAS on the tail, copies the payload,
+ * persists it, and only then stores and persists the commit word. A
+ * record left over from an earlier lap has a stale commit word, so
+ * after a crash the log is every committed record from head up to the
+ * first uncommitted one. A producer that dies between reserve and
+ * commit therefore hides the records reserved after it.
+ */
+class ring_log {
+public:
+	static constexpr uint64_t magic = 0x474f4c534c4d4d48ULL; /* "HMMLSLOG" */
+
+	struct record {
+		uint64_t commit;	/* pos + 1 when committed */
+		uint32_t len;
+		uint32_t flags;
+
+		/* payload follows the header */
+		uint8_t *payload() { return reinterpret_cast<uint8_t *>(this + 1); }
+		const uint8_t *payload() const
+		{
+			return reinterpret_cast<const uint8_t *>(this + 1);
+		}
+	};
+
+	static constexpr uint32_t flag_pad = 0x1;	/* skip to wrap */
+
+	/* format = true starts an empty log, else recovers an existing one */
+	ring_log(view<uint8_t> region, bool format)
+	{
+		if (region.size() < 4 * cache_line ||
+		    reinterpret_cast<uintptr_t>(region.data()) % cache_line)
+			throw std::invalid_argument("hv::ring_log: region");
+
+		hdr_ = reinterpret_cast<header *>(region.data());
+		ring_ = region.data() + cache_line;
+		cap_ = (region.size() - cache_line) & ~(cache_line - 1);
+
+		if (format) {
+			std::memset(region.data(), 0, cache_line + cap_);
+			hdr_->capacity = cap_;
+			hdr_->head = 0;
+			hdr_->tail = 0;
+			hv::persist(region.data(), cache_line + cap_);
+			hdr_->magic = magic;
+			hv::persist(hdr_, sizeof(*hdr_));
+		} else {
+			if (hdr_->magic != magic || hdr_->capacity != cap_)
+				throw std::runtime_error("hv::ring_log: no log in region");
+			recover();
+		}
+	}
+
+	/*
+	 * Append one record. Returns its log position, or -1 if the ring is
+	 * full (call consume() to make room). Safe from many threads.
+	 */
+	int64_t append(const void *data, uint32_t len)
+	{
+		uint64_t need = record_size(len);
+		uint64_t pos, start, head;
+
+		if (need > cap_)
+			return -1;
+
+		for (;;) {
+			pos = __atomic_load_n(&hdr_->tail, __ATOMIC_ACQUIRE);
+			head = __atomic_load_n(&hdr_->head, __ATOMIC_ACQUIRE);
+			start = pos;
+
+			/* A record never wraps; pad to the ring start instead */
+			if (pos % cap_ + need > cap_)
+				start = pos + (cap_ - pos % cap_);
+
+			if (start + need - head > cap_)
+				return -1;
+
+			if (__atomic_compare_exchange_n(&hdr_->tail, &pos,
+							start + need, false,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE))
+				break;
+		}
+
+		if (start != pos)
+			commit(pos, nullptr, 0, flag_pad);
+
+		commit(start, data, len, 0);
+
+		return static_cast<int64_t>(start);
+	}
+
+	/*
+	 * Call f(pos, payload, len) for committed records from head on,
+	 * stopping at the first one not committed yet. Returns the position
+	 * after the last record visited, to pass to consume().
+	 */
+	template <typename F>
+	uint64_t for_each(F f) const
+	{
+		uint64_t pos = __atomic_load_n(&hdr_->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = __atomic_load_n(&hdr_->tail, __ATOMIC_ACQUIRE);
+
+		while (pos < tail) {
+			const record *r = at(pos);
+
+			if (__atomic_load_n(&r->commit, __ATOMIC_ACQUIRE) != pos + 1)
+				break;
+
+			if (r->flags & flag_pad) {
+				pos += cap_ - pos % cap_;
+				continue;
+			}
+
+			f(pos, r->payload(), r->len);
+			pos += record_size(r->len);
+		}
+
+		return pos;
+	}
+
+	/* Drop every record before pos, durably. Single consumer. */
+	void consume(uint64_t pos)
+	{
+		__atomic_store_n(&hdr_->head, pos, __ATOMIC_RELEASE);
+		hv::persist(&hdr_->head, sizeof(hdr_->head));
+	}
+
+	uint64_t head() const { return __atomic_load_n(&hdr_->head, __ATOMIC_ACQUIRE); }
+	uint64_t tail() const { return __atomic_load_n(&hdr_->tail, __ATOMIC_ACQUIRE); }
+	uint64_t capacity() const { return cap_; }
+
+private:
+	struct alignas(cache_line) header {
+		uint64_t magic;
+		uint64_t capacity;
+		uint64_t head;		/* durable: first live record */
+		uint64_t tail;		/* volatile: rebuilt by recover() */
+	};
+
+	static uint64_t record_size(uint32_t len)
+	{
+		return (sizeof(record) + len + cache_line - 1) & ~(cache_line - 1);
+	}
+
+	record *at(uint64_t pos) const
+	{
+		return reinterpret_cast<record *>(ring_ + pos % cap_);
+	}
+
+	void commit(uint64_t pos, const void *data, uint32_t len, uint32_t flags)
+	{
+		record *r = at(pos);
+
+		r->len = len;
+		r->flags = flags;
+		if (len)
+			std::memcpy(r->payload(), data, len);
+		persist_nofence(r, sizeof(record) + len);
+		fence();
+
+		__atomic_store_n(&r->commit, pos + 1, __ATOMIC_RELEASE);
+		hv::persist(&r->commit, sizeof(r->commit));
+	}
+
+	/* Rebuild tail by walking committed records from head */
+	void recover()
+	{
+		uint64_t pos = hdr_->head;
+		uint64_t end = pos + cap_;
+
+		while (pos < end) {
+			const record *r = at(pos);
+
+			if (r->commit != pos + 1)
+				break;
+			if (r->flags & flag_pad)
+				pos += cap_ - pos % cap_;
+			else
+				pos += record_size(r->len);
+		}
+
+		hdr_->tail = pos;
+	}
+
+	header *hdr_;
+	uint8_t *ring_;
+	uint64_t cap_;
+};
+
+} /* namespace hv */
+
+#endif
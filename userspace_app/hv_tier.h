@@ -0,0 +1,251 @@
+/*
+ *
+ *  DRAM tier for hv_cdev, shared between hv_tierd and its clients.
+ *
+ *  hv_tierd keeps copies of the hottest device regions in a shared
+ *  memory cache. Programs that do their I/O with hv_tier_pread() and
+ *  hv_tier_pwrite() are served from DRAM when the region is resident
+ *  and from the device otherwise. Writes to a resident region reach
+ *  the device when the daemon writes it back (each pass, on demotion
+ *  and at exit), so the DRAM tier holds data that is not yet durable.
+ *
+ *  Every client op registers on its region's state word, so hv_tierd
+ *  only moves a region while no client is inside it. Processes that
+ *  write the device without this header, or through mmap(), must not
+ *  run while hv_tierd caches those regions.
+ *
+ *  (C) 2015 Netlist, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef HV_TIER_H
+#define HV_TIER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HV_TIER_SHM		"/hv_tier"
+#define HV_TIER_MAGIC		0x3130524549545648ULL	/* "HVTIER01" */
+
+/* hv_tier_layout.state[] bits; the rest counts clients in the region */
+#define HV_TIER_RESIDENT	0x1u	/* served from slot dir[region] */
+#define HV_TIER_BUSY		0x2u	/* daemon moving it, clients wait */
+#define HV_TIER_USER		0x4u
+
+struct hv_tier_hdr {
+	uint64_t magic;
+	uint32_t region_shift;
+	uint32_t nslots;
+	uint64_t nregions;
+	uint64_t dev_size;
+	uint64_t data_off;		/* slot data, from start of shm */
+	uint64_t promotions;
+	uint64_t demotions;
+	uint64_t writebacks;
+	char dev_path[64];
+};
+
+/*
+ * Shared memory layout: the header, then per region a state word, a
+ * slot index and a hit count, then per slot a dirty flag, then the
+ * slot data at data_off.
+ */
+struct hv_tier {
+	int dev_fd;
+	size_t map_size;
+	struct hv_tier_hdr *hdr;		/* NULL = no daemon, device only */
+	_Atomic uint32_t *state;
+	int32_t *dir;
+	_Atomic uint32_t *hits;			/* cache hits, halved by hv_tierd */
+	_Atomic uint32_t *dirty;
+	uint8_t *data;
+};
+
+static inline size_t hv_tier_map_size(uint64_t nregions, uint32_t nslots,
+		uint32_t region_shift, uint64_t *data_off)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t off = sizeof(struct hv_tier_hdr) +
+		nregions * (sizeof(uint32_t) * 2 + sizeof(int32_t)) +
+		(size_t)nslots * sizeof(uint32_t);
+
+	off = (off + page - 1) & ~(page - 1);
+	*data_off = off;
+
+	return off + ((size_t)nslots << region_shift);
+}
+
+static inline void hv_tier_layout(struct hv_tier *t, void *base)
+{
+	struct hv_tier_hdr *hdr = (struct hv_tier_hdr *)base;
+	uint8_t *p = (uint8_t *)(hdr + 1);
+
+	t->hdr = hdr;
+	t->state = (_Atomic uint32_t *)p;
+	p += hdr->nregions * sizeof(uint32_t);
+	t->hits = (_Atomic uint32_t *)p;
+	p += hdr->nregions * sizeof(uint32_t);
+	t->dir = (int32_t *)p;
+	p += hdr->nregions * sizeof(int32_t);
+	t->dirty = (_Atomic uint32_t *)p;
+	t->data = (uint8_t *)base + hdr->data_off;
+}
+
+/* Attach to a running hv_tierd, or use dev alone if there is none */
+static inline int hv_tier_open(struct hv_tier *t, const char *dev)
+{
+	struct hv_tier_hdr hdr;
+	void *base;
+	int fd;
+
+	memset(t, 0, sizeof(*t));
+
+	t->dev_fd = open(dev, O_RDWR);
+	if (t->dev_fd < 0)
+		return -errno;
+
+	fd = shm_open(HV_TIER_SHM, O_RDWR, 0);
+	if (fd < 0)
+		return 0;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != HV_TIER_MAGIC || strcmp(hdr.dev_path, dev)) {
+		close(fd);
+		return 0;
+	}
+
+	t->map_size = hv_tier_map_size(hdr.nregions, hdr.nslots,
+			hdr.region_shift, &hdr.data_off);
+	base = mmap(NULL, t->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+
+	hv_tier_layout(t, base);
+
+	return 0;
+}
+
+static inline void hv_tier_close(struct hv_tier *t)
+{
+	if (t->hdr)
+		munmap(t->hdr, t->map_size);
+	close(t->dev_fd);
+	t->hdr = NULL;
+}
+
+/* One region's worth of an op; returns bytes moved or -errno */
+static inline ssize_t hv_tier_io(struct hv_tier *t, void *buf, size_t len,
+		uint64_t off, int write)
+{
+	uint64_t r = off >> t->hdr->region_shift;
+	uint64_t in = off & ((1ULL << t->hdr->region_shift) - 1);
+	uint32_t v;
+	ssize_t n;
+
+	/* Join the region unless the daemon is moving it */
+	v = atomic_load(&t->state[r]);
+	for (;;) {
+		if (v & HV_TIER_BUSY) {
+			sched_yield();
+			v = atomic_load(&t->state[r]);
+			continue;
+		}
+		if (atomic_compare_exchange_weak(&t->state[r], &v,
+				v + HV_TIER_USER))
+			break;
+	}
+
+	if (v & HV_TIER_RESIDENT) {
+		int32_t slot = t->dir[r];
+		uint8_t *p = t->data + ((uint64_t)slot << t->hdr->region_shift) + in;
+
+		if (write) {
+			memcpy(p, buf, len);
+			atomic_store(&t->dirty[slot], 1);
+		} else {
+			memcpy(buf, p, len);
+		}
+		atomic_fetch_add_explicit(&t->hits[r], 1, memory_order_relaxed);
+		n = len;
+	} else if (write) {
+		n = pwrite(t->dev_fd, buf, len, off);
+	} else {
+		n = pread(t->dev_fd, buf, len, off);
+	}
+	if (n < 0)
+		n = -errno;
+
+	atomic_fetch_sub(&t->state[r], HV_TIER_USER);
+
+	return n;
+}
+
+static inline ssize_t hv_tier_rw(struct hv_tier *t, void *buf, size_t len,
+		uint64_t off, int write)
+{
+	uint64_t region, chunk;
+	size_t done = 0;
+	ssize_t n;
+
+	if (!t->hdr)
+		return write ? pwrite(t->dev_fd, buf, len, off) :
+			pread(t->dev_fd, buf, len, off);
+
+	if (off >= t->hdr->dev_size)
+		return 0;
+	if (len > t->hdr->dev_size - off)
+		len = t->hdr->dev_size - off;
+
+	region = 1ULL << t->hdr->region_shift;
+	while (done < len) {
+		chunk = region - ((off + done) & (region - 1));
+		if (chunk > len - done)
+			chunk = len - done;
+
+		n = hv_tier_io(t, (uint8_t *)buf + done, chunk, off + done,
+				write);
+		if (n < 0) {
+			if (done)
+				break;
+			errno = -n;
+			return -1;
+		}
+		done += n;
+		if ((uint64_t)n < chunk)
+			break;
+	}
+
+	return done;
+}
+
+static inline ssize_t hv_tier_pread(struct hv_tier *t, void *buf,
+		size_t len, uint64_t off)
+{
+	return hv_tier_rw(t, buf, len, off, 0);
+}
+
+static inline ssize_t hv_tier_pwrite(struct hv_tier *t, const void *buf,
+		size_t len, uint64_t off)
+{
+	return hv_tier_rw(t, (void *)buf, len, off, 1);
+}
+
+#endif
@@ -0,0 +1,413 @@
+/*
+ *
+ *  Reference tiering daemon for hv_cdev.
+ *
+ *  Reads the driver's heat table (load with hv_heat=1) once per decay
+ *  pass and keeps the hottest regions of the device in a DRAM cache
+ *  shared with programs using hv_tier.h:
+ *
+ *    - dirty cached regions are written back to the device
+ *    - resident regions whose heat fell below half the threshold are
+ *      demoted
+ *    - regions at or above the threshold are promoted, into a free
+ *      slot or in place of a resident region with under half the heat
+ *
+ *  Heat of a region is its read()/write() count from the driver plus
+ *  the cache hits its clients recorded. Faults through mmap() are
+ *  printed with -v but not used: the cache cannot serve mappings.
+ *
+ *  Usage: hv_tierd [-d dev] [-c cache_mb] [-t min_heat] [-v]
+ *
+ *  (C) 2015 Netlist, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "hv_tier.h"
+#include "../hv_cdev_uapi.h"
+
+struct tierd {
+	struct hv_tier t;
+	const struct hv_mmls_heat_hdr *heat;
+	const struct hv_mmls_heat_region *regions;
+	uint64_t region_size;
+	uint32_t *score;
+	int32_t *free_slots;
+	uint32_t nfree;
+	uint64_t *cand;
+	uint32_t min_heat;
+	int verbose;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t region_len(struct tierd *d, uint64_t r)
+{
+	uint64_t off = r * d->region_size;
+	uint64_t left = d->t.hdr->dev_size - off;
+
+	return left < d->region_size ? left : d->region_size;
+}
+
+static uint8_t *slot_data(struct tierd *d, int32_t slot)
+{
+	return d->t.data + (uint64_t)slot * d->region_size;
+}
+
+/* Clear the flag first: a write racing the copy sets it again */
+static int writeback(struct tierd *d, uint64_t r, int32_t slot)
+{
+	uint64_t len = region_len(d, r);
+
+	if (!atomic_exchange(&d->t.dirty[slot], 0))
+		return 0;
+
+	if (pwrite(d->t.dev_fd, slot_data(d, slot), len,
+			r * d->region_size) != (ssize_t)len) {
+		perror("hv_tierd: writeback");
+		atomic_store(&d->t.dirty[slot], 1);
+		return -1;
+	}
+	d->t.hdr->writebacks++;
+
+	return 0;
+}
+
+/* Fails while clients are inside the region; retried next pass */
+static int demote(struct tierd *d, uint64_t r)
+{
+	uint32_t v = HV_TIER_RESIDENT;
+	int32_t slot = d->t.dir[r];
+
+	if (!atomic_compare_exchange_strong(&d->t.state[r], &v,
+			HV_TIER_RESIDENT | HV_TIER_BUSY))
+		return -1;
+
+	if (writeback(d, r, slot)) {
+		atomic_store(&d->t.state[r], HV_TIER_RESIDENT);
+		return -1;
+	}
+
+	d->t.dir[r] = -1;
+	d->free_slots[d->nfree++] = slot;
+	d->t.hdr->demotions++;
+	atomic_store(&d->t.state[r], 0);
+
+	return 0;
+}
+
+static int promote(struct tierd *d, uint64_t r)
+{
+	uint64_t len = region_len(d, r);
+	uint32_t v = 0;
+	int32_t slot;
+
+	if (!d->nfree)
+		return -1;
+
+	if (!atomic_compare_exchange_strong(&d->t.state[r], &v, HV_TIER_BUSY))
+		return -1;
+
+	slot = d->free_slots[d->nfree - 1];
+	if (pread(d->t.dev_fd, slot_data(d, slot), len,
+			r * d->region_size) != (ssize_t)len) {
+		perror("hv_tierd: promote");
+		atomic_store(&d->t.state[r], 0);
+		return -1;
+	}
+
+	d->nfree--;
+	atomic_store(&d->t.dirty[slot], 0);
+	d->t.dir[r] = slot;
+	d->t.hdr->promotions++;
+	atomic_store(&d->t.state[r], HV_TIER_RESIDENT);
+
+	return 0;
+}
+
+static struct tierd *sort_ctx;
+
+static int by_score_desc(const void *a, const void *b)
+{
+	uint32_t sa = sort_ctx->score[*(const uint64_t *)a];
+	uint32_t sb = sort_ctx->score[*(const uint64_t *)b];
+
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/* Resident region with the lowest score, or -1 */
+static int64_t coldest(struct tierd *d)
+{
+	uint64_t r, n = d->t.hdr->nregions;
+	int64_t best = -1;
+
+	for (r = 0; r < n; r++) {
+		if (!(atomic_load(&d->t.state[r]) & HV_TIER_RESIDENT))
+			continue;
+		if (best < 0 || d->score[r] < d->score[best])
+			best = r;
+	}
+
+	return best;
+}
+
+static void pass(struct tierd *d)
+{
+	uint64_t r, n = d->t.hdr->nregions, ncand = 0, i;
+	uint64_t mapped = 0;
+	int64_t victim;
+	uint32_t s;
+
+	for (r = 0; r < n; r++) {
+		/* Hits decay like the driver's counts */
+		s = atomic_load_explicit(&d->t.hits[r], memory_order_relaxed);
+		atomic_fetch_sub_explicit(&d->t.hits[r], s / 2,
+				memory_order_relaxed);
+		d->score[r] = d->regions[r].io + s;
+		mapped += d->regions[r].map;
+
+		if (atomic_load(&d->t.state[r]) & HV_TIER_RESIDENT) {
+			int32_t slot = d->t.dir[r];
+
+			if (d->score[r] * 2 < d->min_heat)
+				demote(d, r);
+			else if (atomic_load(&d->t.dirty[slot]))
+				writeback(d, r, slot);
+		} else if (d->score[r] >= d->min_heat) {
+			d->cand[ncand++] = r;
+		}
+	}
+
+	sort_ctx = d;
+	qsort(d->cand, ncand, sizeof(*d->cand), by_score_desc);
+
+	for (i = 0; i < ncand; i++) {
+		r = d->cand[i];
+		if (!d->nfree) {
+			victim = coldest(d);
+			if (victim < 0 || d->score[victim] * 2 >= d->score[r])
+				break;
+			if (demote(d, victim))
+				continue;
+		}
+		promote(d, r);
+	}
+
+	if (d->verbose)
+		printf("hv_tierd: epoch %llu, %llu candidates, %u free slots, "
+			"promoted %llu, demoted %llu, written back %llu, "
+			"mmap faults %llu\n",
+			(unsigned long long)d->heat->epoch,
+			(unsigned long long)ncand, d->nfree,
+			(unsigned long long)d->t.hdr->promotions,
+			(unsigned long long)d->t.hdr->demotions,
+			(unsigned long long)d->t.hdr->writebacks,
+			(unsigned long long)mapped);
+}
+
+static void *map_heat(int dev_fd, const struct hv_mmls_heat_hdr **heat)
+{
+	struct hv_mmls_heat_hdr hdr;
+	size_t size;
+	void *p;
+	int fd;
+
+	fd = ioctl(dev_fd, HV_MMLS_HEAT);
+	if (fd < 0) {
+		perror("hv_tierd: HV_MMLS_HEAT (is hv_heat=1 set?)");
+		return NULL;
+	}
+
+	p = mmap(NULL, sizeof(hdr), PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	memcpy(&hdr, p, sizeof(hdr));
+	munmap(p, sizeof(hdr));
+
+	if (hdr.magic != HV_MMLS_HEAT_MAGIC) {
+		fprintf(stderr, "hv_tierd: bad heat table\n");
+		close(fd);
+		return NULL;
+	}
+
+	size = sizeof(hdr) + hdr.nregions * sizeof(struct hv_mmls_heat_region);
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+
+	close(fd);
+	*heat = p;
+
+	return p;
+
+fail:
+	perror("hv_tierd: mmap heat table");
+	close(fd);
+	return NULL;
+}
+
+static int create_cache(struct tierd *d, const char *dev, uint64_t dev_size,
+		uint64_t cache_mb)
+{
+	struct hv_tier_hdr hdr = { 0 };
+	uint64_t r;
+	size_t size;
+	void *base;
+	int fd;
+
+	hdr.region_shift = d->heat->region_shift;
+	hdr.nregions = d->heat->nregions;
+	hdr.nslots = (cache_mb << 20) >> hdr.region_shift;
+	hdr.dev_size = dev_size;
+	snprintf(hdr.dev_path, sizeof(hdr.dev_path), "%s", dev);
+	if (!hdr.nslots) {
+		fprintf(stderr, "hv_tierd: cache smaller than one region\n");
+		return -1;
+	}
+	size = hv_tier_map_size(hdr.nregions, hdr.nslots, hdr.region_shift,
+			&hdr.data_off);
+
+	/* A previous daemon's cache is stale */
+	shm_unlink(HV_TIER_SHM);
+	fd = shm_open(HV_TIER_SHM, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || ftruncate(fd, size)) {
+		perror("hv_tierd: shm");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("hv_tierd: mmap cache");
+		shm_unlink(HV_TIER_SHM);
+		return -1;
+	}
+
+	/* Magic last, so clients never attach to a half-built cache */
+	memcpy(base, &hdr, sizeof(hdr));
+	d->t.map_size = size;
+	hv_tier_layout(&d->t, base);
+	for (r = 0; r < hdr.nregions; r++)
+		d->t.dir[r] = -1;
+	atomic_thread_fence(memory_order_release);
+	d->t.hdr->magic = HV_TIER_MAGIC;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tierd d = { 0 };
+	const char *dev = "/dev/hv_cdev0";
+	uint64_t cache_mb = 1024, dev_size, epoch, r;
+	struct timespec ts;
+	uint32_t i;
+	int opt;
+
+	d.min_heat = 4;
+
+	while ((opt = getopt(argc, argv, "d:c:t:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'c':
+			cache_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			d.min_heat = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			d.verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d dev] [-c cache_mb] "
+				"[-t min_heat] [-v]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	d.t.dev_fd = open(dev, O_RDWR);
+	if (d.t.dev_fd < 0) {
+		perror(dev);
+		return 1;
+	}
+
+	if (ioctl(d.t.dev_fd, HV_MMLS_SIZE, &dev_size)) {
+		perror("hv_tierd: HV_MMLS_SIZE");
+		return 1;
+	}
+
+	if (!map_heat(d.t.dev_fd, &d.heat))
+		return 1;
+	d.regions = (const struct hv_mmls_heat_region *)(d.heat + 1);
+	d.region_size = 1ULL << d.heat->region_shift;
+
+	if (create_cache(&d, dev, dev_size, cache_mb))
+		return 1;
+
+	d.score = calloc(d.t.hdr->nregions, sizeof(*d.score));
+	d.cand = calloc(d.t.hdr->nregions, sizeof(*d.cand));
+	d.free_slots = calloc(d.t.hdr->nslots, sizeof(*d.free_slots));
+	if (!d.score || !d.cand || !d.free_slots) {
+		fprintf(stderr, "hv_tierd: out of memory\n");
+		shm_unlink(HV_TIER_SHM);
+		return 1;
+	}
+	for (i = 0; i < d.t.hdr->nslots; i++)
+		d.free_slots[d.nfree++] = d.t.hdr->nslots - 1 - i;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	printf("hv_tierd: %s, %llu regions of %llu KB, %u cache slots\n", dev,
+		(unsigned long long)d.t.hdr->nregions,
+		(unsigned long long)(d.region_size >> 10), d.t.hdr->nslots);
+
+	/* One pass per driver decay pass */
+	epoch = d.heat->epoch;
+	while (!stop) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 50 * 1000 * 1000;
+		nanosleep(&ts, NULL);
+
+		if (d.heat->epoch == epoch)
+			continue;
+		epoch = d.heat->epoch;
+		pass(&d);
+	}
+
+	/* New clients go to the device; wait out the ones inside */
+	shm_unlink(HV_TIER_SHM);
+	for (r = 0; r < d.t.hdr->nregions; r++)
+		while ((atomic_load(&d.t.state[r]) & HV_TIER_RESIDENT) &&
+		       demote(&d, r))
+			sched_yield();
+
+	printf("hv_tierd: exit, promoted %llu, demoted %llu, written back %llu\n",
+		(unsigned long long)d.t.hdr->promotions,
+		(unsigned long long)d.t.hdr->demotions,
+		(unsigned long long)d.t.hdr->writebacks);
+
+	return 0;
+}
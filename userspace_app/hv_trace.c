@@ -0,0 +1,642 @@
+/*
+ *
+ *  Capture and replay of hv_cdev I/O traces.
+ *
+ *    hv_trace record [-d dev] [-k ring_kb] [-t seconds] -o file
+ *    hv_trace replay [-d dev] [-s speed] [-o file] -i file
+ *    hv_trace report file
+ *    hv_trace compare base_file new_file
+ *
+ *  record drains the driver's per-CPU trace rings (HV_MMLS_TRACE) until
+ *  SIGINT or the time limit and writes the records sorted by start
+ *  time. A trace holds op, offset, length, time, latency and thread id
+ *  of every read(), write(), device-side op and mmap(); no data.
+ *
+ *  replay reissues a trace against a device. Each thread of the trace
+ *  gets its own thread, which issues that thread's ops in order at the
+ *  original offsets from start, divided by speed (-s 0 = back to back).
+ *  Writes carry a fixed pattern, so replay only on a lab device. It
+ *  prints per-op latency of the capture against the replay; with -o it
+ *  also saves the replay as a trace, so two builds can be compared with
+ *  "hv_trace compare".
+ *
+ *  File: struct trace_file_hdr, then nrecs struct hv_mmls_trace_rec.
+ *
+ *  (C) 2015 Netlist, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "../hv_cdev_uapi.h"
+
+#define TRACE_MAGIC	"HVTRACE1"
+#define MAX_THREADS	256
+#define N_OPS		(HV_MMLS_TRACE_TXN + 1)
+
+struct trace_file_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint64_t nrecs;
+	uint64_t dev_size;
+	uint64_t dropped;		/* records the driver could not queue */
+};
+
+struct trace {
+	struct trace_file_hdr hdr;
+	struct hv_mmls_trace_rec *recs;
+};
+
+static const char *op_names[N_OPS] = {
+	"?", "read", "write", "flush", "fill", "copy", "crc", "compare", "mmap",
+	"txn",
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int by_ts(const void *a, const void *b)
+{
+	const struct hv_mmls_trace_rec *ra = a, *rb = b;
+
+	return ra->ts_ns < rb->ts_ns ? -1 : ra->ts_ns > rb->ts_ns;
+}
+
+static int save(const char *path, struct trace *t)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	memcpy(t->hdr.magic, TRACE_MAGIC, 8);
+	t->hdr.version = 1;
+	t->hdr.rec_size = sizeof(struct hv_mmls_trace_rec);
+
+	if (fwrite(&t->hdr, sizeof(t->hdr), 1, f) != 1 ||
+	    fwrite(t->recs, sizeof(*t->recs), t->hdr.nrecs, f) != t->hdr.nrecs) {
+		perror(path);
+		fclose(f);
+		return -1;
+	}
+
+	return fclose(f);
+}
+
+static int load(const char *path, struct trace *t)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(&t->hdr, sizeof(t->hdr), 1, f) != 1 ||
+	    memcmp(t->hdr.magic, TRACE_MAGIC, 8) ||
+	    t->hdr.rec_size != sizeof(struct hv_mmls_trace_rec)) {
+		fprintf(stderr, "%s: not an hv_trace file\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	t->recs = malloc(t->hdr.nrecs * sizeof(*t->recs) + 1);
+	if (!t->recs ||
+	    fread(t->recs, sizeof(*t->recs), t->hdr.nrecs, f) != t->hdr.nrecs) {
+		fprintf(stderr, "%s: truncated\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/*
+ * record
+ */
+
+static int record(int argc, char *argv[])
+{
+	struct hv_mmls_trace tr = { 0 };
+	struct trace t;
+	const char *dev = "/dev/hv_cdev0", *out = NULL;
+	uint64_t cap = 0, deadline = 0, dev_size = 0;
+	struct hv_mmls_trace_ring *ring;
+	struct hv_mmls_trace_rec *recs;
+	uint64_t head, tail;
+	/* Each ring's header takes one kernel page */
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint32_t i;
+	uint8_t *area;
+	int fd, tfd, opt;
+
+	while ((opt = getopt(argc, argv, "d:k:t:o:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'k':
+			tr.ring_kb = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			deadline = now_ns() + strtoull(optarg, NULL, 0) * 1000000000ULL;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (!out) {
+		fprintf(stderr, "record: -o file is required\n");
+		return 2;
+	}
+
+	memset(&t, 0, sizeof(t));
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	ioctl(fd, HV_MMLS_SIZE, &dev_size);
+
+	tfd = ioctl(fd, HV_MMLS_TRACE, &tr);
+	if (tfd < 0) {
+		perror("HV_MMLS_TRACE");
+		return 1;
+	}
+
+	area = mmap(NULL, tr.ring_bytes * tr.nr_rings, PROT_READ | PROT_WRITE,
+			MAP_SHARED, tfd, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap trace rings");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	fprintf(stderr, "hv_trace: recording %s, ^C to stop\n", dev);
+
+	/* One last drain after stop, so nothing queued is left behind */
+	for (;;) {
+		int last = stop || (deadline && now_ns() >= deadline);
+
+		for (i = 0; i < tr.nr_rings; i++) {
+			ring = (struct hv_mmls_trace_ring *)(area +
+					(uint64_t)i * tr.ring_bytes);
+			recs = (struct hv_mmls_trace_rec *)(area +
+					(uint64_t)i * tr.ring_bytes + page);
+			head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+			for (tail = ring->tail; tail != head; tail++) {
+				if (t.hdr.nrecs == cap) {
+					cap = cap ? cap * 2 : 65536;
+					t.recs = realloc(t.recs,
+						cap * sizeof(*t.recs));
+					if (!t.recs) {
+						fprintf(stderr, "out of memory\n");
+						return 1;
+					}
+				}
+				t.recs[t.hdr.nrecs++] =
+					recs[tail & (ring->nrecs - 1)];
+			}
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+
+		if (last)
+			break;
+		usleep(10000);
+	}
+
+	for (i = 0; i < tr.nr_rings; i++)
+		t.hdr.dropped += ((struct hv_mmls_trace_ring *)(area +
+				(uint64_t)i * tr.ring_bytes))->dropped;
+
+	munmap(area, tr.ring_bytes * tr.nr_rings);
+	close(tfd);
+	close(fd);
+
+	qsort(t.recs, t.hdr.nrecs, sizeof(*t.recs), by_ts);
+	t.hdr.dev_size = dev_size;
+
+	fprintf(stderr, "hv_trace: %llu records, %llu dropped\n",
+		(unsigned long long)t.hdr.nrecs,
+		(unsigned long long)t.hdr.dropped);
+
+	return save(out, &t) ? 1 : 0;
+}
+
+/*
+ * report / compare
+ */
+
+struct op_stats {
+	uint64_t *lat;
+	uint64_t n;
+	uint64_t sum;
+	uint64_t errors;
+};
+
+static int by_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void stats(const struct trace *t, struct op_stats *st)
+{
+	uint64_t i;
+	int op;
+
+	memset(st, 0, sizeof(*st) * N_OPS);
+	for (op = 0; op < N_OPS; op++)
+		st[op].lat = malloc(t->hdr.nrecs * sizeof(uint64_t) + 1);
+
+	for (i = 0; i < t->hdr.nrecs; i++) {
+		const struct hv_mmls_trace_rec *r = &t->recs[i];
+
+		op = r->op < N_OPS ? r->op : 0;
+		st[op].lat[st[op].n++] = r->lat_ns;
+		st[op].sum += r->lat_ns;
+		if (r->flags & HV_MMLS_TRACE_ERR)
+			st[op].errors++;
+	}
+
+	for (op = 0; op < N_OPS; op++)
+		qsort(st[op].lat, st[op].n, sizeof(uint64_t), by_u64);
+}
+
+static uint64_t pct(const struct op_stats *s, int p)
+{
+	return s->n ? s->lat[(s->n - 1) * p / 100] : 0;
+}
+
+static void print_stats(const char *title, const struct trace *t)
+{
+	struct op_stats st[N_OPS];
+	int op;
+
+	stats(t, st);
+	printf("%s: %llu records, %llu dropped\n", title,
+		(unsigned long long)t->hdr.nrecs,
+		(unsigned long long)t->hdr.dropped);
+	printf("%-8s %10s %8s %10s %10s %10s\n", "op", "count", "errors",
+		"mean_ns", "p50_ns", "p99_ns");
+
+	for (op = 1; op < N_OPS; op++) {
+		if (!st[op].n)
+			continue;
+		printf("%-8s %10llu %8llu %10llu %10llu %10llu\n", op_names[op],
+			(unsigned long long)st[op].n,
+			(unsigned long long)st[op].errors,
+			(unsigned long long)(st[op].sum / st[op].n),
+			(unsigned long long)pct(&st[op], 50),
+			(unsigned long long)pct(&st[op], 99));
+	}
+
+	for (op = 0; op < N_OPS; op++)
+		free(st[op].lat);
+}
+
+static double delta(uint64_t base, uint64_t now)
+{
+	return base ? 100.0 * ((double)now - (double)base) / base : 0.0;
+}
+
+static void print_compare(const struct trace *a, const struct trace *b)
+{
+	struct op_stats sa[N_OPS], sb[N_OPS];
+	int op;
+
+	stats(a, sa);
+	stats(b, sb);
+
+	printf("%-8s %10s %10s %8s %10s %10s %8s\n", "op", "base_p50",
+		"new_p50", "delta%", "base_p99", "new_p99", "delta%");
+
+	for (op = 1; op < N_OPS; op++) {
+		if (!sa[op].n && !sb[op].n)
+			continue;
+		printf("%-8s %10llu %10llu %+8.1f %10llu %10llu %+8.1f\n",
+			op_names[op],
+			(unsigned long long)pct(&sa[op], 50),
+			(unsigned long long)pct(&sb[op], 50),
+			delta(pct(&sa[op], 50), pct(&sb[op], 50)),
+			(unsigned long long)pct(&sa[op], 99),
+			(unsigned long long)pct(&sb[op], 99),
+			delta(pct(&sa[op], 99), pct(&sb[op], 99)));
+	}
+
+	for (op = 0; op < N_OPS; op++) {
+		free(sa[op].lat);
+		free(sb[op].lat);
+	}
+}
+
+/*
+ * replay
+ */
+
+struct replayer {
+	pthread_t thread;
+	int fd;
+	struct trace *in;
+	struct trace *out;
+	uint64_t *idx;			/* this thread's records, in order */
+	uint64_t n;
+	uint64_t start_ns;
+	uint64_t ts0;
+	double speed;
+	uint64_t dev_size;
+	uint8_t *buf;
+	size_t buf_size;
+};
+
+static int replay_one(struct replayer *p, const struct hv_mmls_trace_rec *r)
+{
+	union {
+		struct hv_mmls_range range;
+		struct hv_mmls_fill fill;
+		struct hv_mmls_copy copy;
+		struct hv_mmls_crc crc;
+		struct hv_mmls_compare cmp;
+		struct hv_mmls_txn txn;
+	} a;
+	struct hv_mmls_txn_vec vec;
+	void *m;
+
+	memset(&a, 0, sizeof(a));
+
+	if ((r->op == HV_MMLS_TRACE_READ || r->op == HV_MMLS_TRACE_WRITE ||
+	     r->op == HV_MMLS_TRACE_TXN) && r->len > p->buf_size) {
+		free(p->buf);
+		p->buf = malloc(r->len);
+		p->buf_size = p->buf ? r->len : 0;
+		if (!p->buf)
+			return -ENOMEM;
+		memset(p->buf, 0xa5, r->len);
+	}
+
+	switch (r->op) {
+	case HV_MMLS_TRACE_READ:
+		return pread(p->fd, p->buf, r->len, r->offset) < 0 ? -errno : 0;
+	case HV_MMLS_TRACE_WRITE:
+		return pwrite(p->fd, p->buf, r->len, r->offset) < 0 ? -errno : 0;
+	case HV_MMLS_TRACE_FLUSH:
+		a.range.offset = r->offset;
+		a.range.size = r->len;
+		return ioctl(p->fd, HV_MMLS_FLUSH_RANGE, &a.range) ? -errno : 0;
+	case HV_MMLS_TRACE_FILL:
+		a.fill.offset = r->offset;
+		a.fill.size = r->len;
+		a.fill.pattern = r->arg;
+		return ioctl(p->fd, HV_MMLS_FILL, &a.fill) ? -errno : 0;
+	case HV_MMLS_TRACE_COPY:
+		a.copy.src = r->offset;
+		a.copy.dst = r->arg;
+		a.copy.size = r->len;
+		return ioctl(p->fd, HV_MMLS_COPY, &a.copy) ? -errno : 0;
+	case HV_MMLS_TRACE_CRC:
+		a.crc.offset = r->offset;
+		a.crc.size = r->len;
+		return ioctl(p->fd, HV_MMLS_CRC, &a.crc) ? -errno : 0;
+	case HV_MMLS_TRACE_COMPARE:
+		a.cmp.offset1 = r->offset;
+		a.cmp.offset2 = r->arg;
+		a.cmp.size = r->len;
+		return ioctl(p->fd, HV_MMLS_COMPARE, &a.cmp) ? -errno : 0;
+	case HV_MMLS_TRACE_MMAP:
+		m = mmap(NULL, r->len, PROT_READ | (r->arg ? PROT_WRITE : 0),
+				MAP_SHARED, p->fd, r->offset);
+		if (m == MAP_FAILED)
+			return -errno;
+		munmap(m, r->len);
+		return 0;
+	case HV_MMLS_TRACE_TXN:
+		/* Only the total is traced: one update of the same size */
+		vec.offset = r->offset;
+		vec.len = r->len;
+		vec.data = (uintptr_t)p->buf;
+		a.txn.nvec = 1;
+		a.txn.vec = (uintptr_t)&vec;
+		return ioctl(p->fd, HV_MMLS_TXN, &a.txn) ? -errno : 0;
+	}
+
+	return -EINVAL;
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replayer *p = arg;
+	struct timespec ts;
+	uint64_t i, t0, target;
+
+	for (i = 0; i < p->n && !stop; i++) {
+		const struct hv_mmls_trace_rec *r = &p->in->recs[p->idx[i]];
+		struct hv_mmls_trace_rec *o = &p->out->recs[p->idx[i]];
+
+		if (p->speed > 0) {
+			target = p->start_ns + (uint64_t)((r->ts_ns - p->ts0) /
+					p->speed);
+			ts.tv_sec = target / 1000000000ULL;
+			ts.tv_nsec = target % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		*o = *r;
+		if (r->offset >= p->dev_size) {
+			o->flags = HV_MMLS_TRACE_ERR;
+			o->lat_ns = 0;
+			continue;
+		}
+
+		t0 = now_ns();
+		o->flags = replay_one(p, r) ? HV_MMLS_TRACE_ERR : 0;
+		o->lat_ns = now_ns() - t0;
+		o->ts_ns = t0;
+	}
+
+	return NULL;
+}
+
+static int replay(int argc, char *argv[])
+{
+	struct replayer *p;
+	struct trace in, out;
+	const char *dev = "/dev/hv_cdev0", *inf = NULL, *outf = NULL;
+	uint32_t tids[MAX_THREADS];
+	uint64_t i, dev_size = 0;
+	double speed = 1.0;
+	int fd, n = 0, j, opt;
+
+	while ((opt = getopt(argc, argv, "d:s:i:o:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'i':
+			inf = optarg;
+			break;
+		case 'o':
+			outf = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (!inf) {
+		fprintf(stderr, "replay: -i file is required\n");
+		return 2;
+	}
+	if (load(inf, &in))
+		return 1;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	if (ioctl(fd, HV_MMLS_SIZE, &dev_size)) {
+		perror("HV_MMLS_SIZE");
+		return 1;
+	}
+
+	out.hdr = in.hdr;
+	out.hdr.dropped = 0;
+	out.recs = calloc(in.hdr.nrecs + 1, sizeof(*out.recs));
+	p = calloc(MAX_THREADS, sizeof(*p));
+	if (!out.recs || !p) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* One replayer per traced thread; beyond MAX_THREADS they share */
+	for (i = 0; i < in.hdr.nrecs; i++) {
+		uint32_t tid = in.recs[i].tid;
+
+		for (j = 0; j < n && tids[j] != tid; j++)
+			;
+		if (j == n) {
+			if (n < MAX_THREADS)
+				tids[n++] = tid;
+			else
+				j = tid % MAX_THREADS;
+		}
+		if (!p[j].idx)
+			p[j].idx = malloc(in.hdr.nrecs * sizeof(uint64_t));
+		if (!p[j].idx) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		p[j].idx[p[j].n++] = i;
+	}
+
+	signal(SIGINT, on_signal);
+	fprintf(stderr, "hv_trace: replaying %llu records on %d threads, speed %g\n",
+		(unsigned long long)in.hdr.nrecs, n, speed);
+
+	/* Give every thread time to start before the first op is due */
+	for (j = 0; j < n; j++) {
+		p[j].fd = fd;
+		p[j].in = &in;
+		p[j].out = &out;
+		p[j].start_ns = now_ns() + 100000000ULL;
+		p[j].ts0 = in.hdr.nrecs ? in.recs[0].ts_ns : 0;
+		p[j].speed = speed;
+		p[j].dev_size = dev_size;
+	}
+	for (j = 1; j < n; j++)
+		p[j].start_ns = p[0].start_ns;
+	for (j = 0; j < n; j++)
+		pthread_create(&p[j].thread, NULL, replay_thread, &p[j]);
+	for (j = 0; j < n; j++)
+		pthread_join(p[j].thread, NULL);
+
+	close(fd);
+
+	print_stats("captured", &in);
+	print_stats("replayed", &out);
+	print_compare(&in, &out);
+
+	if (outf) {
+		qsort(out.recs, out.hdr.nrecs, sizeof(*out.recs), by_ts);
+		out.hdr.dev_size = dev_size;
+		if (save(outf, &out))
+			return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace a, b;
+
+	if (argc >= 2 && !strcmp(argv[1], "record"))
+		return record(argc - 1, argv + 1);
+	if (argc >= 2 && !strcmp(argv[1], "replay"))
+		return replay(argc - 1, argv + 1);
+	if (argc == 3 && !strcmp(argv[1], "report")) {
+		if (load(argv[2], &a))
+			return 1;
+		print_stats(argv[2], &a);
+		return 0;
+	}
+	if (argc == 4 && !strcmp(argv[1], "compare")) {
+		if (load(argv[2], &a) || load(argv[3], &b))
+			return 1;
+		print_compare(&a, &b);
+		return 0;
+	}
+
+	fprintf(stderr,
+		"usage: %s record [-d dev] [-k ring_kb] [-t seconds] -o file\n"
+		"       %s replay [-d dev] [-s speed] [-o file] -i file\n"
+		"       %s report file\n"
+		"       %s compare base_file new_file\n",
+		argv[0], argv[0], argv[0], argv[0]);
+
+	return 2;
+}
@@ -0,0 +1,640 @@
+/*
+ *
+ *  Python bindings for the HVDIMM MMLS char driver
+ *
+ *  (C) 2015 Netlist, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *	import hv_mmls, numpy as np
+ *
+ *	dev = hv_mmls.Device()			# /dev/hv_cdev0
+ *	m = dev.map()				# whole device
+ *	a = m.numpy(np.uint64)			# or np.frombuffer(m, np.uint64)
+ *	a[:1024] = 7				# stores go straight to the device
+ *	m.flush(0, 8192)
+ *	dev.flush_ranges([(0, 64), (4096, 64)])	# merged, one ioctl each run
+ *
+ *  Mappings export the buffer protocol, so memoryview(), NumPy and
+ *  anything else that takes a buffer see the device memory with no
+ *  copy. The GIL is released around every ioctl, so other threads keep
+ *  running during flushes and device-side fills, copies and CRCs.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <hv_cdev_uapi.h>
+
+#define HV_DEFAULT_PATH		"/dev/hv_cdev0"
+#define HV_FLUSH_MERGE_GAP	4096
+
+typedef struct {
+	PyObject_HEAD
+	int fd;
+	uint64_t size;
+} DeviceObject;
+
+typedef struct {
+	PyObject_HEAD
+	DeviceObject *dev;		/* strong ref, keeps fd open */
+	void *addr;
+	uint64_t offset;
+	Py_ssize_t length;
+	int readonly;
+	Py_ssize_t exports;		/* live buffer views */
+} MappingObject;
+
+static PyTypeObject DeviceType;
+static PyTypeObject MappingType;
+
+/* ioctl with the GIL released; sets an OSError on failure */
+static int hv_ioctl(DeviceObject *dev, unsigned long cmd, void *arg)
+{
+	int res;
+
+	if (dev->fd < 0) {
+		PyErr_SetString(PyExc_ValueError, "device is closed");
+		return -1;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	res = ioctl(dev->fd, cmd, arg);
+	Py_END_ALLOW_THREADS
+
+	if (res < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+
+	return res;
+}
+
+/*
+ * Device
+ */
+
+static int Device_init(DeviceObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "path", "writable", NULL };
+	const char *path = HV_DEFAULT_PATH;
+	int writable = 1;
+	uint64_t size;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sp", kwlist,
+				&path, &writable))
+		return -1;
+
+	self->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (self->fd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		return -1;
+	}
+
+	if (hv_ioctl(self, HV_MMLS_SIZE, &size) < 0)
+		return -1;
+	self->size = size;
+
+	return 0;
+}
+
+static PyObject *Device_close(DeviceObject *self, PyObject *unused)
+{
+	if (self->fd >= 0)
+		close(self->fd);
+	self->fd = -1;
+
+	Py_RETURN_NONE;
+}
+
+static void Device_dealloc(DeviceObject *self)
+{
+	if (self->fd >= 0)
+		close(self->fd);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Device_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	DeviceObject *self = (DeviceObject *)type->tp_alloc(type, 0);
+
+	if (self)
+		self->fd = -1;
+
+	return (PyObject *)self;
+}
+
+static PyObject *Device_get_size(DeviceObject *self, void *closure)
+{
+	return PyLong_FromUnsignedLongLong(self->size);
+}
+
+static PyObject *Device_get_fd(DeviceObject *self, void *closure)
+{
+	return PyLong_FromLong(self->fd);
+}
+
+static PyObject *Device_flush(DeviceObject *self, PyObject *args)
+{
+	struct hv_mmls_range r;
+
+	if (!PyArg_ParseTuple(args, "KK", &r.offset, &r.size))
+		return NULL;
+
+	if (hv_ioctl(self, HV_MMLS_FLUSH_RANGE, &r) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct hv_mmls_range *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * flush_ranges(ranges, merge_gap=4096) -> number of ioctls issued
+ *
+ * Sorts (offset, size) pairs and merges those that overlap or are
+ * closer than merge_gap, then flushes every merged run with the GIL
+ * released once for the whole batch.
+ */
+static PyObject *Device_flush_ranges(DeviceObject *self, PyObject *args,
+		PyObject *kwds)
+{
+	static char *kwlist[] = { "ranges", "merge_gap", NULL };
+	unsigned long long gap = HV_FLUSH_MERGE_GAP;
+	PyObject *seq, *fast;
+	struct hv_mmls_range *r;
+	Py_ssize_t i, n, out = 0;
+	uint64_t end;
+	int res = 0, err = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|K", kwlist, &seq, &gap))
+		return NULL;
+
+	if (self->fd < 0) {
+		PyErr_SetString(PyExc_ValueError, "device is closed");
+		return NULL;
+	}
+
+	fast = PySequence_Fast(seq, "ranges must be a sequence of (offset, size)");
+	if (!fast)
+		return NULL;
+
+	n = PySequence_Fast_GET_SIZE(fast);
+	r = PyMem_Malloc((n ? n : 1) * sizeof(*r));
+	if (!r) {
+		Py_DECREF(fast);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(fast, i), "KK",
+					&r[i].offset, &r[i].size)) {
+			PyMem_Free(r);
+			Py_DECREF(fast);
+			return NULL;
+		}
+	}
+	Py_DECREF(fast);
+
+	Py_BEGIN_ALLOW_THREADS
+	qsort(r, n, sizeof(*r), range_cmp);
+
+	for (i = 0; i < n && !res;) {
+		struct hv_mmls_range run = r[i];
+
+		end = run.offset + run.size;
+		for (++i; i < n && r[i].offset <= end + gap; ++i)
+			if (r[i].offset + r[i].size > end)
+				end = r[i].offset + r[i].size;
+
+		run.size = end - run.offset;
+		if (!run.size)
+			continue;
+
+		res = ioctl(self->fd, HV_MMLS_FLUSH_RANGE, &run);
+		err = errno;
+		out++;
+	}
+	Py_END_ALLOW_THREADS
+
+	PyMem_Free(r);
+
+	if (res < 0) {
+		errno = err;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+
+	return PyLong_FromSsize_t(out);
+}
+
+static PyObject *Device_fill(DeviceObject *self, PyObject *args)
+{
+	struct hv_mmls_fill f = { 0 };
+
+	if (!PyArg_ParseTuple(args, "KK|K", &f.offset, &f.size, &f.pattern))
+		return NULL;
+
+	if (hv_ioctl(self, HV_MMLS_FILL, &f) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Device_copy(DeviceObject *self, PyObject *args)
+{
+	struct hv_mmls_copy c;
+
+	if (!PyArg_ParseTuple(args, "KKK", &c.src, &c.dst, &c.size))
+		return NULL;
+
+	if (hv_ioctl(self, HV_MMLS_COPY, &c) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Device_crc(DeviceObject *self, PyObject *args)
+{
+	struct hv_mmls_crc c = { 0 };
+	unsigned int seed = 0xFFFFFFFF;
+
+	if (!PyArg_ParseTuple(args, "KK|I", &c.offset, &c.size, &seed))
+		return NULL;
+	c.seed = seed;
+
+	if (hv_ioctl(self, HV_MMLS_CRC, &c) < 0)
+		return NULL;
+
+	return PyLong_FromUnsignedLong(c.crc);
+}
+
+/* map(offset=0, length=None, writable=True) -> Mapping */
+static PyObject *Device_map(DeviceObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "offset", "length", "writable", NULL };
+	unsigned long long offset = 0;
+	PyObject *len_obj = Py_None;
+	int writable = 1;
+	uint64_t length;
+	MappingObject *m;
+	void *addr;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOp", kwlist,
+				&offset, &len_obj, &writable))
+		return NULL;
+
+	if (self->fd < 0) {
+		PyErr_SetString(PyExc_ValueError, "device is closed");
+		return NULL;
+	}
+
+	if (offset % sysconf(_SC_PAGESIZE) || offset >= self->size) {
+		PyErr_SetString(PyExc_ValueError,
+			"offset must be page aligned and inside the device");
+		return NULL;
+	}
+
+	if (len_obj == Py_None) {
+		length = self->size - offset;
+	} else {
+		length = PyLong_AsUnsignedLongLong(len_obj);
+		if (PyErr_Occurred())
+			return NULL;
+	}
+
+	if (!length || length > self->size - offset || length > PY_SSIZE_T_MAX) {
+		PyErr_SetString(PyExc_ValueError, "bad mapping length");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	addr = mmap(NULL, length,
+		    PROT_READ | (writable ? PROT_WRITE : 0),
+		    MAP_SHARED, self->fd, offset);
+	Py_END_ALLOW_THREADS
+
+	if (addr == MAP_FAILED)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	m = PyObject_New(MappingObject, &MappingType);
+	if (!m) {
+		munmap(addr, length);
+		return NULL;
+	}
+
+	Py_INCREF(self);
+	m->dev = self;
+	m->addr = addr;
+	m->offset = offset;
+	m->length = length;
+	m->readonly = !writable;
+	m->exports = 0;
+
+	return (PyObject *)m;
+}
+
+static PyObject *Device_enter(PyObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *Device_exit(DeviceObject *self, PyObject *args)
+{
+	return Device_close(self, NULL);
+}
+
+static PyMethodDef Device_methods[] = {
+	{ "close", (PyCFunction)Device_close, METH_NOARGS,
+	  "Close the device. Existing mappings stay valid." },
+	{ "flush", (PyCFunction)Device_flush, METH_VARARGS,
+	  "flush(offset, size): HV_MMLS_FLUSH_RANGE" },
+	{ "flush_ranges", (PyCFunction)(void (*)(void))Device_flush_ranges,
+	  METH_VARARGS | METH_KEYWORDS,
+	  "flush_ranges(ranges, merge_gap=4096) -> ioctls issued\n\n"
+	  "Merge (offset, size) pairs and flush each run." },
+	{ "fill", (PyCFunction)Device_fill, METH_VARARGS,
+	  "fill(offset, size, pattern=0): device-side 64-bit pattern fill" },
+	{ "copy", (PyCFunction)Device_copy, METH_VARARGS,
+	  "copy(src, dst, size): device-side copy" },
+	{ "crc", (PyCFunction)Device_crc, METH_VARARGS,
+	  "crc(offset, size, seed=0xFFFFFFFF) -> crc32c of a range" },
+	{ "map", (PyCFunction)(void (*)(void))Device_map,
+	  METH_VARARGS | METH_KEYWORDS,
+	  "map(offset=0, length=None, writable=True) -> Mapping" },
+	{ "__enter__", Device_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction)Device_exit, METH_VARARGS, NULL },
+	{ NULL }
+};
+
+static PyGetSetDef Device_getset[] = {
+	{ "size", (getter)Device_get_size, NULL, "Device size in bytes", NULL },
+	{ "fd", (getter)Device_get_fd, NULL, "File descriptor, -1 if closed", NULL },
+	{ NULL }
+};
+
+static PyTypeObject DeviceType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "hv_mmls.Device",
+	.tp_basicsize = sizeof(DeviceObject),
+	.tp_dealloc = (destructor)Device_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Device(path='/dev/hv_cdev0', writable=True)",
+	.tp_methods = Device_methods,
+	.tp_getset = Device_getset,
+	.tp_init = (initproc)Device_init,
+	.tp_new = Device_new,
+};
+
+/*
+ * Mapping
+ */
+
+static int Mapping_check(MappingObject *self)
+{
+	if (!self->addr) {
+		PyErr_SetString(PyExc_ValueError, "mapping is closed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int Mapping_getbuffer(MappingObject *self, Py_buffer *view, int flags)
+{
+	if (Mapping_check(self) < 0)
+		return -1;
+
+	if (PyBuffer_FillInfo(view, (PyObject *)self, self->addr, self->length,
+				self->readonly, flags) < 0)
+		return -1;
+
+	self->exports++;
+
+	return 0;
+}
+
+static void Mapping_releasebuffer(MappingObject *self, Py_buffer *view)
+{
+	self->exports--;
+}
+
+static PyBufferProcs Mapping_as_buffer = {
+	(getbufferproc)Mapping_getbuffer,
+	(releasebufferproc)Mapping_releasebuffer,
+};
+
+static int Mapping_unmap(MappingObject *self)
+{
+	if (self->exports) {
+		PyErr_SetString(PyExc_BufferError,
+			"mapping still has views (arrays, memoryviews)");
+		return -1;
+	}
+
+	if (self->addr)
+		munmap(self->addr, self->length);
+	self->addr = NULL;
+
+	return 0;
+}
+
+static PyObject *Mapping_close(MappingObject *self, PyObject *unused)
+{
+	if (Mapping_unmap(self) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static void Mapping_dealloc(MappingObject *self)
+{
+	/* No views can be left, each one holds a reference */
+	if (self->addr)
+		munmap(self->addr, self->length);
+	Py_XDECREF(self->dev);
+	PyObject_Free(self);
+}
+
+static Py_ssize_t Mapping_len(MappingObject *self)
+{
+	return self->length;
+}
+
+/* flush(offset=0, size=None): offsets are relative to the mapping */
+static PyObject *Mapping_flush(MappingObject *self, PyObject *args)
+{
+	unsigned long long off = 0;
+	PyObject *size_obj = Py_None;
+	struct hv_mmls_range r;
+
+	if (!PyArg_ParseTuple(args, "|KO", &off, &size_obj))
+		return NULL;
+
+	if (Mapping_check(self) < 0)
+		return NULL;
+
+	if (off > (uint64_t)self->length) {
+		PyErr_SetString(PyExc_ValueError, "offset outside the mapping");
+		return NULL;
+	}
+
+	r.offset = self->offset + off;
+	if (size_obj == Py_None) {
+		r.size = self->length - off;
+	} else {
+		r.size = PyLong_AsUnsignedLongLong(size_obj);
+		if (PyErr_Occurred())
+			return NULL;
+	}
+
+	if (hv_ioctl(self->dev, HV_MMLS_FLUSH_RANGE, &r) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * numpy(dtype='u1', offset=0, count=-1) -> ndarray
+ *
+ * Same as numpy.frombuffer(mapping, dtype, count, offset): the array
+ * shares the device memory. NumPy is only imported when called.
+ */
+static PyObject *Mapping_numpy(MappingObject *self, PyObject *args,
+		PyObject *kwds)
+{
+	static char *kwlist[] = { "dtype", "offset", "count", NULL };
+	PyObject *dtype = NULL, *np, *res;
+	Py_ssize_t offset = 0, count = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Onn", kwlist,
+				&dtype, &offset, &count))
+		return NULL;
+
+	if (Mapping_check(self) < 0)
+		return NULL;
+
+	np = PyImport_ImportModule("numpy");
+	if (!np)
+		return NULL;
+
+	if (dtype)
+		res = PyObject_CallMethod(np, "frombuffer", "OOnn",
+				(PyObject *)self, dtype, count, offset);
+	else
+		res = PyObject_CallMethod(np, "frombuffer", "Osnn",
+				(PyObject *)self, "u1", count, offset);
+
+	Py_DECREF(np);
+
+	return res;
+}
+
+static PyObject *Mapping_get_offset(MappingObject *self, void *closure)
+{
+	return PyLong_FromUnsignedLongLong(self->offset);
+}
+
+static PyObject *Mapping_get_closed(MappingObject *self, void *closure)
+{
+	return PyBool_FromLong(self->addr == NULL);
+}
+
+static PyObject *Mapping_enter(PyObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *Mapping_exit(MappingObject *self, PyObject *args)
+{
+	return Mapping_close(self, NULL);
+}
+
+static PyMethodDef Mapping_methods[] = {
+	{ "close", (PyCFunction)Mapping_close, METH_NOARGS,
+	  "Unmap. Fails with BufferError while views exist." },
+	{ "flush", (PyCFunction)Mapping_flush, METH_VARARGS,
+	  "flush(offset=0, size=None): write back part of the mapping" },
+	{ "numpy", (PyCFunction)(void (*)(void))Mapping_numpy,
+	  METH_VARARGS | METH_KEYWORDS,
+	  "numpy(dtype='u1', offset=0, count=-1) -> zero-copy ndarray" },
+	{ "__enter__", Mapping_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction)Mapping_exit, METH_VARARGS, NULL },
+	{ NULL }
+};
+
+static PyGetSetDef Mapping_getset[] = {
+	{ "offset", (getter)Mapping_get_offset, NULL,
+	  "Device offset of the first byte", NULL },
+	{ "closed", (getter)Mapping_get_closed, NULL, NULL, NULL },
+	{ NULL }
+};
+
+static PySequenceMethods Mapping_as_sequence = {
+	.sq_length = (lenfunc)Mapping_len,
+};
+
+static PyTypeObject MappingType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "hv_mmls.Mapping",
+	.tp_basicsize = sizeof(MappingObject),
+	.tp_dealloc = (destructor)Mapping_dealloc,
+	.tp_as_sequence = &Mapping_as_sequence,
+	.tp_as_buffer = &Mapping_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Shared mapping of the device; create with Device.map()",
+	.tp_methods = Mapping_methods,
+	.tp_getset = Mapping_getset,
+};
+
+static struct PyModuleDef hv_mmls_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "hv_mmls",
+	.m_doc = "Zero-copy access to the HVDIMM MMLS char driver",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_hv_mmls(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&DeviceType) < 0 || PyType_Ready(&MappingType) < 0)
+		return NULL;
+
+	m = PyModule_Create(&hv_mmls_module);
+	if (!m)
+		return NULL;
+
+	Py_INCREF(&DeviceType);
+	Py_INCREF(&MappingType);
+	if (PyModule_AddObject(m, "Device", (PyObject *)&DeviceType) < 0 ||
+	    PyModule_AddObject(m, "Mapping", (PyObject *)&MappingType) < 0 ||
+	    PyModule_AddStringConstant(m, "DEFAULT_PATH", HV_DEFAULT_PATH) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	return m;
+}
@@ -0,0 +1,24 @@
+# Build in place with:  python3 setup.py build_ext --inplace
+# or from userspace_app: make python
+#
+# hv_cdev_uapi.h is taken from the driver source two levels up, or from
+# HV_UAPI_INCLUDE if set (e.g. an installed copy).
+
+import os
+
+from setuptools import Extension, setup
+
+here = os.path.dirname(os.path.abspath(__file__))
+uapi_inc = os.environ.get("HV_UAPI_INCLUDE",
+                          os.path.join(here, "..", ".."))
+
+setup(
+    name="hv_mmls",
+    version="1.0",
+    description="Zero-copy access to the HVDIMM MMLS char driver",
+    ext_modules=[
+        Extension("hv_mmls", ["hv_mmls.c"],
+                  include_dirs=[uapi_inc],
+                  extra_compile_args=["-O2"]),
+    ],
+)
@@ -124,7 +124,8 @@ static void print_menu()
 	printf("4. <TBD> To write n-bytes to device\n");
 	printf("5. <TBD> To run read / write/ compare test\n");
 	printf("6. To do mmap, write pattern to entire mmls space, and verify written data\n");
-	printf("7. To get mmls disk size via ioctl\n\n");
+	printf("7. To get mmls disk size via ioctl\n");
+	printf("8. To fill, copy and compare in the device via ioctl\n\n");
 	printf("q to quit\n ");
 }
 
@@ -285,6 +286,88 @@ error:
 	return;
 }
 
+/*
+ * device_ops_test()
+ *
+ * Same pattern test as mmap_file(), but the data never leaves the
+ * device: fill the first half with a pattern, copy it onto the second
+ * half, then compare the halves and checksum them in the driver.
+ */
+static void device_ops_test()
+{
+	struct hv_mmls_fill fill;
+	struct hv_mmls_copy copy;
+	struct hv_mmls_compare cmp;
+	struct hv_mmls_crc crc;
+	uint64_t dev_size, half;
+	uint32_t crc0;
+
+	if (get_dev_size(&dev_size))
+		return;
+
+	half = dev_size / 2;
+
+	fill.offset = 0;
+	fill.size = half;
+	fill.pattern = 0x0101010101010101ULL * PATTERN;
+
+	printf("Filling %llu bytes with 0x%02X...\n", half, PATTERN);
+	if (ioctl(fd, HV_MMLS_FILL, &fill) < 0) {
+		perror("ioctl HV_MMLS_FILL failed");
+		return;
+	}
+
+	copy.src = 0;
+	copy.dst = half;
+	copy.size = half;
+
+	printf("Copying first half onto second half...\n");
+	if (ioctl(fd, HV_MMLS_COPY, &copy) < 0) {
+		perror("ioctl HV_MMLS_COPY failed");
+		return;
+	}
+
+	cmp.offset1 = 0;
+	cmp.offset2 = half;
+	cmp.size = half;
+
+	if (ioctl(fd, HV_MMLS_COMPARE, &cmp) < 0) {
+		perror("ioctl HV_MMLS_COMPARE failed");
+		return;
+	}
+
+	if (cmp.result != HV_MMLS_CMP_EQUAL) {
+		printf("compare failed at byte %llu !\n", cmp.result);
+		return;
+	}
+
+	crc.offset = 0;
+	crc.size = half;
+	crc.seed = ~0U;
+
+	if (ioctl(fd, HV_MMLS_CRC, &crc) < 0) {
+		perror("ioctl HV_MMLS_CRC failed");
+		return;
+	}
+	crc0 = crc.crc;
+
+	crc.offset = half;
+	crc.seed = ~0U;
+
+	if (ioctl(fd, HV_MMLS_CRC, &crc) < 0) {
+		perror("ioctl HV_MMLS_CRC failed");
+		return;
+	}
+
+	printf("crc32c of each half: 0x%08X 0x%08X\n", crc0, crc.crc);
+
+	if (crc0 != crc.crc) {
+		printf("crc mismatch between halves !\n");
+		return;
+	}
+	printf("\nTest PASSED...\n");
+}
+
 main ( )
 {
         int i, res;
@@ -339,6 +422,10 @@ main ( )
                 	printf("mmls size: %llu\n", dev_size);
                 	break;
                 	
+                case '8':
+                	device_ops_test();
+                	break;
+
                 case 'q':
                 	goto exit;
 
@@ -1,11 +1,29 @@
-filename = "/dev/hv_cdev"
+# Reads the start of the device with read(), then the same bytes through
+# a zero-copy mapping if the hv_mmls extension is built (make python).
 
-txt = open(filename)
+import os
+import sys
 
-print "Open file %r" % filename
+filename = "/dev/hv_cdev0"
+nbytes = 64
 
-print txt.read()
+with open(filename, "rb") as f:
+    print("Open file %r" % filename)
+    data = f.read(nbytes)
+    print("read():  %s" % data.hex())
+print("Close file %r" % filename)
 
-txt.close()
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                "python"))
+try:
+    import hv_mmls
+except ImportError:
+    print("hv_mmls not built, skipping mmap view")
+    sys.exit(0)
 
-print "Close file %r" % filename 
+with hv_mmls.Device(filename) as dev:
+    print("Device size %d bytes" % dev.size)
+    with dev.map(0, os.sysconf("SC_PAGE_SIZE")) as m:
+        view = memoryview(m)
+        print("mmap():  %s" % view[:nbytes].hex())
+        view.release()